@@ -93,6 +93,9 @@
 #define HAL_NV_DMA_CH              0
 #define HAL_DMA_CH_RX              3
 #define HAL_DMA_CH_TX              4
+// USART1 SPI bursts to/from the external OTA flash.
+#define HAL_XNV_DMA_CH_TX          1
+#define HAL_XNV_DMA_CH_RX          2
 
 #define HAL_NV_DMA_GET_DESC()      HAL_DMA_GET_DESC0()
 #define HAL_NV_DMA_SET_ADDR(a)     HAL_DMA_SET_ADDR_DESC0((a))
@@ -212,17 +215,44 @@ extern void MAC_RfFrontendSetup(void);
 #define XNV_SPI_WAIT_RXRDY()        st(while (!(U1CSR & 0x02));)
 #define XNV_SPI_END()               st(P1_3 = 1;)
 
+/* USART1 SPI clock profiles. The SPI master clock is
+ *   F_SCK = (256 + BAUD_M) * 2^BAUD_E / 2^28 * F_CPU
+ * and the CC2530 master tops out at F_CPU / 8 (BAUD_E = 17, BAUD_M = 0).
+ * Both fitted parts (M25PE20 at 75 MHz, W25Q80 at 104 MHz) are far faster than that.
+ */
+#define XNV_SPI_PROFILE_115K        0  // 115.2 kbit/s, the original TI reference setting.
+#define XNV_SPI_PROFILE_1M          1  // 1 Mbit/s, conservative default for the boot code.
+#define XNV_SPI_PROFILE_4M          2  // 4 Mbit/s (F_CPU / 8), default for the application.
+
+#if !defined XNV_SPI_PROFILE
+#if defined HAL_OTA_BOOT_CODE && HAL_OTA_BOOT_CODE
+#define XNV_SPI_PROFILE             XNV_SPI_PROFILE_1M
+#else
+#define XNV_SPI_PROFILE             XNV_SPI_PROFILE_4M
+#endif
+#endif
+
+#if (XNV_SPI_PROFILE == XNV_SPI_PROFILE_115K)
+#define XNV_SPI_BAUD_E              11
+#define XNV_SPI_BAUD_M              216
+#elif (XNV_SPI_PROFILE == XNV_SPI_PROFILE_1M)
+#define XNV_SPI_BAUD_E              15
+#define XNV_SPI_BAUD_M              0
+#elif (XNV_SPI_PROFILE == XNV_SPI_PROFILE_4M)
+#define XNV_SPI_BAUD_E              17
+#define XNV_SPI_BAUD_M              0
+#else
+#error Invalid XNV_SPI_PROFILE.
+#endif
+
 // The TI reference design uses UART1 Alt. 2 in SPI mode.
 #define XNV_SPI_INIT() \
 st( \
   /* Mode select UART1 SPI Mode as master. */\
   U1CSR = 0; \
-  /* Setup for 115200 baud. */\
-  U1GCR |= 11;  \
-  U1BAUD = 216; \
-  \
-  /* Set bit order to MSB */\
-  U1GCR |= BV(5); \
+  /* Set the clock profile, SPI mode 0 and bit order to MSB. */\
+  U1GCR = BV(5) | XNV_SPI_BAUD_E; \
+  U1BAUD = XNV_SPI_BAUD_M; \
   \
   /* Set UART1 I/O to alternate 2 location on P1 pins. */\
   PERCFG |= 0x02;  /* U1CFG */\
@@ -55,9 +55,15 @@
 
 #include "Debug.h"
 #include "OSAL.h"
+#if !HAL_OTA_BOOT_CODE
+#include "OnBoard.h"
+#endif
 /******************************************************************************
  * CONSTANTS
  */
+#define OTA_IMAGE_TAG_ID  0  // OTA_UPGRADE_IMAGE_TAG_ID
+#define OTA_ELEM_MAX      4  // Sub-elements looked at for the upgrade image.
+
 #if HAL_OTA_XNV_IS_SPI
 /*
 #define XNV_STAT_CMD  0x05
@@ -73,13 +79,128 @@
 #define XNV_WREN_CMD  0x06
 #define XNV_WRPG_CMD  0x02
 #define XNV_READ_CMD  0x0B //READ DATA BYTES at HIGHER SPEED
-#define XNV_STAT_WIP  0x00
+#define XNV_STAT_WIP  0x01
 #define XNV_BE_CMD    0xC7
 #define XNV_SE_CMD    0x20 // SECTOR ERASE 4K
+#define XNV_BE32_CMD  0x52 // BLOCK ERASE 32K
+#define XNV_BE64_CMD  0xD8 // BLOCK ERASE 64K
+#define XNV_RDID_CMD  0x9F // READ JEDEC IDENTIFICATION
+#define XNV_DPD_CMD   0xB9 // DEEP POWER-DOWN
+#define XNV_RDP_CMD   0xAB // RELEASE FROM DEEP POWER-DOWN
+
+#define XNV_TRES1_US  30   // Release from deep power-down to standby, the longest of the supported parts.
+
+// Capacity codes trusted from the JEDEC ID of any part: 256 KB (HAL_OTA_DL_MAX) to 16 MB.
+#define XNV_CAP_CODE_MIN  0x12
+#define XNV_CAP_CODE_MAX  0x18
 
 #define ERASE_SECTOR_SIZE 0x1000  // 4 KB
+#define ERASE_BLOCK32_SIZE 0x8000  // 32 KB
+#define ERASE_BLOCK64_SIZE 0x10000 // 64 KB
+
+/* Command set and geometry of a SPI flash part. The read opcode is the fastest one usable
+ * on the single-MISO USART1: the dual/quad output reads need more data lines, and at the
+ * XNV_SPI_PROFILE clock rates the plain READ (0x03) needs no dummy byte.
+ */
+typedef struct
+{
+  uint8 jedecId[3];  // Manufacturer, memory type, capacity code (size is 2^code bytes).
+  uint8 readCmd;
+  uint8 readDummy;   // Dummy bytes between the address and the data.
+  uint8 seCmd;       // 4 KB sector erase.
+  uint8 be32Cmd;     // 32 KB block erase, 0 if not supported.
+  uint8 be64Cmd;     // 64 KB block erase, 0 if not supported.
+  uint8 wipMask;     // Write In Progress bit(s) of the status register.
+  uint16 pageSize;   // Page program size, at most XNV_PAGE_SIZE.
+} xnvChip_t;
+
+/* The first entry is used before the probe and for unknown parts: it only relies on
+ * commands common to all supported parts.
+ */
+static const CODE xnvChip_t xnvChips[] =
+{
+  { {0x00, 0x00, 0x00}, XNV_READ_CMD, 1, XNV_SE_CMD, 0, XNV_BE64_CMD, XNV_STAT_WIP, 256 },
+#if !HAL_OTA_BOOT_CODE
+  // M25PE20, 2 Mbit.
+  { {0x20, 0x80, 0x12}, 0x03, 0, XNV_SE_CMD, 0, XNV_BE64_CMD, 0x01, 256 },
+  // W25Q80, 8 Mbit.
+  { {0xEF, 0x40, 0x14}, 0x03, 0, XNV_SE_CMD, XNV_BE32_CMD, XNV_BE64_CMD, 0x01, 256 },
+#endif
+};
+#define XNV_CHIP_CNT  (sizeof(xnvChips) / sizeof(xnvChip_t))
+
+static const CODE xnvChip_t *xnvChip = xnvChips;
+static uint32 xnvCapacity = HAL_OTA_DL_MAX;
+static uint8 xnvInited = FALSE;
+
+// The boot status and dl2rc() journal sector, the last one of the part.
+#define XNV_STATUS_ADDR  (xnvCapacity - ERASE_SECTOR_SIZE)
+
+// Put the external NV in deep power-down whenever it has no users, see HalOTARelease().
+#if !defined HAL_OTA_XNV_PWR
+#if defined POWER_SAVING && !HAL_OTA_BOOT_CODE
+#define HAL_OTA_XNV_PWR  TRUE
+#else
+#define HAL_OTA_XNV_PWR  FALSE
+#endif
+#endif
+
+// The part may have been left in deep power-down before the reset, so the first access always releases it.
+static uint8 xnvPowerDown = TRUE;
+#if HAL_OTA_XNV_PWR
+static uint8 xnvUsers = 0;
+static uint32 xnvPwrStamp = 0;             // osal_GetSystemClock() at the last power state change.
+static uint32 xnvPwrTime[2] = { 0, 0 };    // Milliseconds spent in standby [0] and deep power-down [1].
+#endif
 
 static uint32 lastErased = 0xFFFFFFFF;
+static uint8 xnvBusy = FALSE;  // An erase was issued and has not been seen to complete.
+
+// Erase-ahead range, see HalOTAEraseAhead(): [xnvAheadFrom, xnvAheadNext) is erased or being erased.
+static uint32 xnvAheadFrom = 0;
+static uint32 xnvAheadNext = 0;
+static uint32 xnvAheadEnd = 0;
+
+// Move the data phase of SPI reads and page programs by DMA instead of polling each byte.
+#if !defined HAL_OTA_SPI_DMA
+#if HAL_DMA && !HAL_OTA_BOOT_CODE
+#define HAL_OTA_SPI_DMA  TRUE
+#else
+#define HAL_OTA_SPI_DMA  FALSE
+#endif
+#endif
+
+/* The boot code copies the DL image a flash page at a time, reading the next page from
+ * external NV by DMA while the current one is erased and programmed.
+ */
+#if !defined HAL_OTA_BOOT_DMA
+#define HAL_OTA_BOOT_DMA  (HAL_OTA_BOOT_CODE && HAL_DMA)
+#endif
+
+#if HAL_OTA_SPI_DMA
+#define XNV_DMA_MIN_LEN  8       // Shorter data phases are cheaper to poll than to set up for DMA.
+#endif
+#if HAL_OTA_SPI_DMA || HAL_OTA_BOOT_DMA
+#define XNV_DMA_MAX_LEN  0x1000  // Keep within the 13-bit DMA length field.
+#endif
+
+// Combine consecutive DL writes into whole page programs, see HalOTAFlush().
+#if !defined HAL_OTA_XNV_PAGE_BUF
+#define HAL_OTA_XNV_PAGE_BUF  !HAL_OTA_BOOT_CODE
+#endif
+
+#define XNV_PAGE_SIZE     256  // Largest page program of the SPI flash.
+#define XNV_STALL_ROOM    HAL_OTA_BLOCK_MAX  // Page buffer room needed to queue another OTA block behind an erase.
+#if XNV_STALL_ROOM > XNV_PAGE_SIZE
+#error "HAL_OTA_BLOCK_MAX does not fit in the page buffer."
+#endif
+#define XNV_BLANK_CHUNK   64   // Bytes read per transaction when checking for an erased sector.
+
+#if HAL_OTA_XNV_PAGE_BUF
+static uint8 xnvPageBuf[XNV_PAGE_SIZE];
+static uint32 xnvPageAddr;     // External NV address of xnvPageBuf[0].
+static uint16 xnvPageLen = 0;  // Number of bytes buffered, never crossing a page boundary.
+#endif
 #endif
 
 /******************************************************************************
@@ -96,27 +217,167 @@ typedef struct
  */
 OTA_CrcControl_t OTA_crcControl;
 
+#if !HAL_OTA_BOOT_CODE
+/* Running image CRC kept while the upgrade image element is downloaded. Until the CRC control
+ * block has gone by the checksum type is unknown, so both types are run up to that point.
+ */
+static uint32 otaCrcPos;                // Program image offset of the next byte.
+static uint16 otaCrcRun[2];             // Indexed by HAL_OTA_CRC_TYPE_1021 / HAL_OTA_CRC_TYPE_HW.
+static OTA_CrcControl_t otaCrcControl;  // Collected as it goes by.
+
+/* A delta image element is applied after the download: the upgrade image element it rebuilds
+ * is written to the DL image right after the OTA file, where otaImageElem() finds it.
+ */
+#if !defined OTA_DELTA_STEP_LEN
+#define OTA_DELTA_STEP_LEN   256  // Bytes rebuilt per HalOTADeltaStep().
+#endif
+#define OTA_DELTA_BUF_LEN    64   // COPY bytes read from the running image at a time.
+
+typedef struct
+{
+  halOtaStream_t patch;  // Over the ops still to be applied.
+  uint32 srcSize;        // Program size of the running image.
+  uint32 outOset;        // DL image offset of the next byte rebuilt.
+  uint32 outEnd;         // DL image offset past the last byte rebuilt.
+  uint32 copySrc;        // Running image offset of the next byte of a COPY.
+  uint16 opLeft;         // Bytes left of the COPY or INSERT in progress.
+  uint8 op;
+  uint8 buf[OTA_DELTA_BUF_LEN];
+} otaDelta_t;
+
+static otaDelta_t *otaDelta = NULL;
+
+/* A compressed image element is expanded into the DL image as its blocks arrive. Matches copy
+ * from the bytes already expanded, read back from the DL image, so the LZ4 history window
+ * costs no RAM.
+ */
+#define OTA_LZ4_TOKEN        4  // 0-3: reading the program image length.
+#define OTA_LZ4_LIT_LEN      5
+#define OTA_LZ4_LITERALS     6
+#define OTA_LZ4_OFFSET0      7
+#define OTA_LZ4_OFFSET1      8
+#define OTA_LZ4_MATCH_LEN    9
+#define OTA_LZ4_DONE         10
+#define OTA_LZ4_BUF_LEN      32   // Match bytes read back at a time.
+#define OTA_LZ4_STEP_LEN     256  // Bytes expanded before yielding to the caller.
+
+typedef struct
+{
+  uint32 rawLen;     // Length of the program image.
+  uint32 produced;   // Program image bytes written.
+  uint32 runLen;     // Literal or match length.
+  uint16 matchOset;  // Distance back to the match.
+  uint8 token;
+  uint8 state;
+} otaLz4_t;
+
+static otaLz4_t otaLz4;
+static uint8 otaLz4Buf[OTA_LZ4_BUF_LEN];
+static uint8 *otaLz4In;     // Input held behind a match that yielded.
+static uint16 otaLz4InLen;
+static uint16 otaLz4Step;   // Bytes expanded this step.
+#endif
+
 #if HAL_OTA_BOOT_CODE
 halDMADesc_t dmaCh0;
 #endif
 
+#if HAL_OTA_BOOT_DMA
+halDMADesc_t dmaCh1234[4];
+static uint8 dlPage[2][HAL_FLASH_PAGE_SIZE];  // dl2rc() ping-pong page buffers.
+
+/* dl2rc() progress journal, kept in the boot status sector so that a copy cut short by a
+ * power failure resumes where it stopped. A header names the DL image by its CRC and is
+ * followed by one byte per page done, holding its page number, appended as pages complete.
+ * xnvBootStatus() erases the sector when the copy has finished.
+ */
+#define XNV_JOURNAL_ADDR    (XNV_STATUS_ADDR + 0x100)
+#define XNV_JOURNAL_MAGIC   0x10C9
+#define XNV_JOURNAL_MAX     (HAL_OTA_DL_SIZE / HAL_FLASH_PAGE_SIZE)
+
+typedef struct
+{
+  uint16 magic;
+  uint16 dlCrc;  // CRC of the DL image being copied, from its CRC control block.
+} xnvJournalHdr_t;
+#endif
+
 /******************************************************************************
  * LOCAL FUNCTIONS
  */
 static uint16 runPoly(uint16 crc, uint8 val);
+static uint16 runHwPoly(uint16 crc, uint8 *pBuf, uint16 len);
+static uint16 crcRun(uint8 type, uint16 crc, uint8 *pBuf, uint16 len);
+static uint16 crcImage(uint32 start, uint32 size, uint8 crcType, image_t image);
+static uint32 otaImageElem(uint32 *pLen);
+#if !HAL_OTA_BOOT_CODE
+static uint8 otaBuildFits(uint32 oset, uint32 len);
+static uint8 otaDeltaOp(void);
+static uint8 otaLz4Run(uint8 *pBuf, uint16 len, uint32 *pOset);
+static void otaLz4Write(uint32 *pOset, uint8 *pBuf, uint16 len);
+static uint8 otaLz4Match(uint32 *pOset);
+#endif
 
 #if HAL_OTA_XNV_IS_SPI
 static void HalSPIRead(uint32 addr, uint8 *pBuf, uint16 len);
 static void HalSPIWrite(uint32 addr, uint8 *pBuf, uint16 len);
 static void xnvSPIWrite(uint8 ch);
-static void HalSPIEraseSector4K(uint32 addr);
-static void DelayMs(uint16 delaytime);
+#if HAL_OTA_SPI_DMA
+static void xnvSPIBurst(uint8 *pTx, uint8 *pRx, uint16 len);
+#endif
+#if HAL_OTA_SPI_DMA || HAL_OTA_BOOT_DMA
+static void xnvSPIBurstStart(uint8 *pTx, uint8 *pRx, uint16 len);
+static void xnvSPIBurstWait(void);
+#endif
+#if HAL_OTA_BOOT_DMA
+static void xnvSPIReadStart(uint32 addr, uint8 *pBuf, uint16 len);
+static void xnvSPIReadEnd(void);
+#endif
+static void xnvSPIWaitIdle(void);
+static uint8 xnvReadStatus(void);
+#if !HAL_OTA_BOOT_CODE
+static void xnvWaitReady(void);
+#endif
+static void xnvProbe(void);
+static void xnvWake(void);
+static void xnvPwrState(uint8 down);
+static void xnvDelayUs(uint16 us);
+#if HAL_OTA_XNV_PWR
+static void xnvSleep(void);
+#endif
+static void HalSPIErase(uint8 cmd, uint32 addr);
+static void xnvEraseAheadStep(void);
+static uint8 xnvBlankCheck(uint32 addr, uint16 len);
+static void xnvSectorPrep(uint32 addr);
+#if HAL_OTA_XNV_PAGE_BUF
+static void xnvPageWrite(uint32 addr, uint8 *pBuf, uint16 len);
+#endif
 #endif
 
 
 #if HAL_OTA_BOOT_CODE
 static void dl2rc(void);
 static uint16 crcCalc(void);
+#if HAL_OTA_BOOT_DMA
+static uint8 rcPageSame(uint8 pg, uint8 *pBuf, uint16 len);
+static uint8 xnvJournalOpen(uint16 dlCrc, uint8 first);
+static void xnvJournalAdd(uint8 idx, uint8 pg);
+#endif
+#if HAL_OTA_XNV_IS_SPI
+static void xnvBootStatus(uint8 written, uint8 skipped);
+#endif
+
+#if HAL_OTA_XNV_IS_SPI && (HAL_OTA_DL_OSET + HAL_OTA_DL_SIZE > HAL_OTA_DL_MAX - ERASE_SECTOR_SIZE)
+#error The boot status record must not overlap the DL image on the smallest part.
+#endif
+
+#if (HAL_FLASH_PAGE_SIZE % HAL_OTA_STREAM_LEN)
+#error HAL_OTA_STREAM_LEN must divide HAL_FLASH_PAGE_SIZE.
+#endif
+
+#if HAL_OTA_BOOT_DMA && (XNV_JOURNAL_MAX + 4 > 0x100)  // 4: sizeof(xnvJournalHdr_t)
+#error The dl2rc() journal must fit in one page program.
+#endif
 
 /******************************************************************************
  * @fn      main
@@ -133,11 +394,16 @@ void main(void)
   HAL_BOARD_INIT();
 #if HAL_OTA_XNV_IS_SPI
   XNV_SPI_INIT();
+  xnvProbe();  // Where the boot status and dl2rc() journal are.
 #endif
   /* This is in place of calling HalDmaInit() which would require init of the
    * other 4 DMA descriptors in addition to just Channel 0.
    */
   HAL_DMA_SET_ADDR_DESC0( &dmaCh0 );
+#if HAL_OTA_BOOT_DMA
+  // Only the XNV channels of the 1-4 descriptor block are ever armed.
+  HAL_DMA_SET_ADDR_DESC1234( dmaCh1234 );
+#endif
 
   while (1)
   {
@@ -175,312 +441,2223 @@ void main(void)
  *
  * @return  None.
  */
+#if HAL_OTA_BOOT_DMA
 static void dl2rc(void)
 {
-  uint32 oset;
-  OTA_SubElementHdr_t subElement;
-  OTA_ImageHeader_t header;
-  uint16 addr = HAL_OTA_RC_START / HAL_FLASH_WORD_SIZE;
-  uint8 buf[4];
+  uint32 oset, left;
+  uint16 cnt, next;
+  uint16 dlCrc;
+  uint8 pg = HAL_OTA_RC_START / HAL_FLASH_PAGE_SIZE;
+  uint8 idx = 0;
+  uint8 done, n;
+  uint8 written = 0, skipped = 0;
 
   // Determine the length and starting point of the upgrade image
-  HalOTARead(0, (uint8 *)&header, sizeof(OTA_ImageHeader_t), HAL_OTA_DL);
-  HalOTARead(header.headerLength, (uint8*)&subElement, OTA_SUB_ELEMENT_HDR_LEN, HAL_OTA_DL);
+  oset = otaImageElem(&left);
+  HalOTARead(oset + HAL_OTA_CRC_OSET, (uint8 *)&dlCrc, sizeof(dlCrc), HAL_OTA_DL);
+  oset += HAL_OTA_DL_OSET;
 
-  for (oset = 0; oset < subElement.length; oset += HAL_FLASH_WORD_SIZE)
+  /* Resume after the pages a previous, interrupted copy of this image finished. The last of
+   * them is done again: if it already holds the DL page the compare below skips it.
+   */
+  done = xnvJournalOpen(dlCrc, pg);
+  n = (done) ? done - 1 : 0;
+  if (((uint32)n * HAL_FLASH_PAGE_SIZE) >= left)
   {
-    HalOTARead(oset + header.headerLength + OTA_SUB_ELEMENT_HDR_LEN, buf, HAL_FLASH_WORD_SIZE, HAL_OTA_DL);
-    if ((addr % (HAL_FLASH_PAGE_SIZE / HAL_FLASH_WORD_SIZE)) == 0)
+    n = 0;
+  }
+  oset += (uint32)n * HAL_FLASH_PAGE_SIZE;
+  left -= (uint32)n * HAL_FLASH_PAGE_SIZE;
+  pg += n;
+
+  cnt = (left < HAL_FLASH_PAGE_SIZE) ? (uint16)left : HAL_FLASH_PAGE_SIZE;
+
+  xnvSPIReadStart(oset, dlPage[idx], cnt);
+  xnvSPIReadEnd();
+
+  while (cnt)
+  {
+    oset += cnt;
+    left -= cnt;
+    next = (left < HAL_FLASH_PAGE_SIZE) ? (uint16)left : HAL_FLASH_PAGE_SIZE;
+
+    /* The DMA keeps reading the next page into the other buffer while the CPU
+     * is held up by the page erase and the flash write.
+     */
+    if (next)
     {
-      HalFlashErase(addr / (HAL_FLASH_PAGE_SIZE / HAL_FLASH_WORD_SIZE));
+      xnvSPIReadStart(oset, dlPage[idx ^ 1], next);
+    }
+
+    // Pad a partial last word the same as an erased page.
+    while (cnt % HAL_FLASH_WORD_SIZE)
+    {
+      dlPage[idx][cnt++] = 0xFF;
+    }
+
+    // Pages that did not change between releases are neither erased nor programmed.
+    if (rcPageSame(pg, dlPage[idx], cnt))
+    {
+      skipped++;
+    }
+    else
+    {
+      HalFlashErase(pg);
+      HalFlashWrite((uint16)pg * (HAL_FLASH_PAGE_SIZE / HAL_FLASH_WORD_SIZE), dlPage[idx],
+                    cnt / HAL_FLASH_WORD_SIZE);
+      written++;
+    }
+
+    if (next)
+    {
+      xnvSPIReadEnd();
+    }
+
+    if (n >= done)
+    {
+      xnvJournalAdd(n, pg);
     }
-    HalFlashWrite(addr++, buf, 1);
+
+    n++;
+    pg++;
+    idx ^= 1;
+    cnt = next;
   }
+
+  xnvBootStatus(written, skipped);
 }
 
 /******************************************************************************
- * @fn      crcCalc
+ * @fn      xnvJournalOpen
  *
- * @brief   Run the CRC16 Polynomial calculation over the RC image.
+ * @brief   Find how far a previous dl2rc() of the same DL image got, or start
+ *          a new journal for it.
  *
- * @param   None.
+ * @param   dlCrc - CRC of the DL image from its CRC control block.
+ * @param   first - Internal flash page of the first page of the image.
  *
- * @return  The CRC16 calculated.
+ * @return  Number of pages in order from the first one that are journaled as done.
  */
-static uint16 crcCalc()
+static uint8 xnvJournalOpen(uint16 dlCrc, uint8 first)
 {
-  uint32 oset;
-  uint16 crc = 0;
+  xnvJournalHdr_t hdr;
+  uint8 *pEntry = dlPage[0];  // Not in use before the first page is read.
+  uint8 done = 0;
 
-  // Run the CRC calculation over the active body of code.
-  for (oset = 0; oset < OTA_crcControl.programSize; oset++)
+  HalSPIRead(XNV_JOURNAL_ADDR, (uint8 *)&hdr, sizeof(hdr));
+
+  if ((hdr.magic == XNV_JOURNAL_MAGIC) && (hdr.dlCrc == dlCrc))
   {
-    if ((oset < HAL_OTA_CRC_OSET) || (oset >= HAL_OTA_CRC_OSET + 4))
+    HalSPIRead(XNV_JOURNAL_ADDR + sizeof(hdr), pEntry, XNV_JOURNAL_MAX);
+
+    // An entry cut short by the power failure does not hold the expected page number.
+    while ((done < XNV_JOURNAL_MAX) && (pEntry[done] == (uint8)(first + done)))
     {
-      uint8 buf;
-      HalOTARead(oset, &buf, 1, HAL_OTA_RC);
-      crc = runPoly(crc, buf);
+      done++;
     }
+
+    return done;
   }
 
-  return crc;
+  hdr.magic = XNV_JOURNAL_MAGIC;
+  hdr.dlCrc = dlCrc;
+  HalSPIErase(xnvChip->seCmd, XNV_STATUS_ADDR);
+  HalSPIWrite(XNV_JOURNAL_ADDR, (uint8 *)&hdr, sizeof(hdr));
+
+  return 0;
 }
-#endif //HAL_OTA_BOOT_CODE
 
 /******************************************************************************
- * @fn      runPoly
+ * @fn      xnvJournalAdd
  *
- * @brief   Run the CRC16 Polynomial calculation over the byte parameter.
+ * @brief   Journal a page of the image as erased and programmed.
  *
- * @param   crc - Running CRC calculated so far.
- * @param   val - Value on which to run the CRC16.
+ * @param   idx - Index of the page in the image.
+ * @param   pg - Internal flash page.
  *
- * @return  crc - Updated for the run.
+ * @return  None.
  */
-static uint16 runPoly(uint16 crc, uint8 val)
+static void xnvJournalAdd(uint8 idx, uint8 pg)
 {
-  const uint16 poly = 0x1021;
-  uint8 cnt;
-
-  for (cnt = 0; cnt < 8; cnt++, val <<= 1)
-  {
-    uint8 msb = (crc & 0x8000) ? 1 : 0;
-
-    crc <<= 1;
-    if (val & 0x80)  crc |= 0x0001;
-    if (msb)         crc ^= poly;
-  }
-
-  return crc;
+  HalSPIWrite(XNV_JOURNAL_ADDR + sizeof(xnvJournalHdr_t) + idx, &pg, 1);
 }
 
 /******************************************************************************
- * @fn      HalOTAChkDL
+ * @fn      rcPageSame
  *
- * @brief   Run the CRC16 Polynomial calculation over the DL image.
+ * @brief   Compare the start of an internal flash page with a buffer.
  *
- * @param   None
+ * @param   pg - Internal flash page.
+ * @param   pBuf - Pointer to the bytes expected.
+ * @param   len - Number of bytes to compare.
  *
- * @return  SUCCESS or FAILURE.
+ * @return  TRUE if the page already holds the bytes, FALSE otherwise.
  */
-uint8 HalOTAChkDL(uint8 dlImagePreambleOffset)
+static uint8 rcPageSame(uint8 pg, uint8 *pBuf, uint16 len)
 {
- (void)dlImagePreambleOffset;  // Intentionally unreferenced parameter
+  uint8 buf[32];
+  uint16 oset;
 
-  uint32 oset;
-  uint16 crc = 0;
-  OTA_CrcControl_t crcControl;
-  OTA_ImageHeader_t header;
-  uint32 programStart;
-
-#if HAL_OTA_XNV_IS_SPI
-  XNV_SPI_INIT();
-#endif
+  for (oset = 0; oset < len; oset += sizeof(buf))
+  {
+    uint8 cnt = (len - oset < sizeof(buf)) ? (uint8)(len - oset) : sizeof(buf);
 
-  // Read the OTA File Header
-  HalOTARead(0, (uint8 *)&header, sizeof(OTA_ImageHeader_t), HAL_OTA_DL);
+    HalFlashRead(pg, oset, buf, cnt);
+    for (uint8 i = 0; i < cnt; i++)
+    {
+      if (buf[i] != pBuf[oset + i])
+      {
+        return FALSE;
+      }
+    }
+  }
 
-  // Calculate the update image start address
-  programStart = header.headerLength + OTA_SUB_ELEMENT_HDR_LEN; // 0x38 + 0x06 = 0x3E
-  
-  uint8 raw[16];
-  HalOTARead(0, raw, 16, HAL_OTA_DL);
-  LREP("magicNumber=0x%02X%02X%02X%02X\r\n", raw[3], raw[2], raw[1], raw[0]); //32
-//  LREP("headerVersion=0x%02X%02X\r\n", raw[5], raw[4]); //16
-//  LREP("headerLength=0x%02X%02X\r\n", raw[7], raw[6]); //16
-//  LREP("fieldControl=0x%02X%02X\r\n", raw[9], raw[8]); //16
-  
-  uint8 raw1[4];
-  osal_buffer_uint32(raw1, programStart + HAL_OTA_CRC_OSET ); // 0x3E + 0x88 = 0xC6
-  LREP("prStart+CRC_OSET =0x%02X%02X%02X%02X\r\n", raw1[3], raw1[2], raw1[1], raw1[0]); //32
-  
-  // Get the CRC Control structure
-  HalOTARead(programStart + HAL_OTA_CRC_OSET, (uint8 *)&crcControl, sizeof(crcControl), HAL_OTA_DL);
-  
-  uint8 raw2[8];
-  HalOTARead(programStart + HAL_OTA_CRC_OSET, raw2, 8, HAL_OTA_DL);
-  LREP("crcC.crc =0x%02X%02X%02X%02X\r\n", raw2[3], raw2[2], raw2[1], raw2[0]); //32
-  LREP("crcC.prSize =0x%02X%02X%02X%02X\r\n", raw2[7], raw2[6], raw2[5], raw2[4]); //32
-  
-//  memset(bytes, 0, 4 * sizeof(uint8));
-//  osal_buffer_uint32( bytes, HAL_OTA_DL_MAX );
-//  LREP("HAL_OTA_DL_MAX =0x%02X%02X%02X%02X\r\n", bytes[3], bytes[2], bytes[1], bytes[0]);
+  return TRUE;
+}
+#else
+static void dl2rc(void)
+{
+  halOtaStream_t stream;
+  uint32 start, len;
+  uint16 addr = HAL_OTA_RC_START / HAL_FLASH_WORD_SIZE;
+  uint16 cnt;
+  uint8 *pBuf;
+  uint8 written = 0;
 
-  if ((crcControl.programSize > HAL_OTA_DL_MAX) || (crcControl.programSize == 0))
-  {
-    return FAILURE;
-  }
+  // Determine the length and starting point of the upgrade image
+  start = otaImageElem(&len);
 
-  // Run the CRC calculation over the downloaded image.
-  for (oset = 0; oset < crcControl.programSize; oset++)
+  /* Chunks start page aligned and HAL_OTA_STREAM_LEN divides the page size,
+   * so a chunk never straddles a page and the erase check once per chunk is enough.
+   */
+  HalOTAStreamOpen(&stream, start, len, HAL_OTA_DL);
+  while ((cnt = HalOTAStreamSpan(&stream, &pBuf, HAL_OTA_STREAM_LEN)) != 0)
   {
-    if ((oset < HAL_OTA_CRC_OSET) || (oset >= HAL_OTA_CRC_OSET+4))
+    if ((addr % (HAL_FLASH_PAGE_SIZE / HAL_FLASH_WORD_SIZE)) == 0)
     {
-      uint8 buf;
-      HalOTARead(oset + programStart, &buf, 1, HAL_OTA_DL);
-      crc = runPoly(crc, buf);
+      HalFlashErase(addr / (HAL_FLASH_PAGE_SIZE / HAL_FLASH_WORD_SIZE));
+      written++;
     }
+    cnt = (cnt + HAL_FLASH_WORD_SIZE - 1) / HAL_FLASH_WORD_SIZE;
+    HalFlashWrite(addr, pBuf, cnt);
+    addr += cnt;
   }
 
-  return (crcControl.crc[0] == crc) ? SUCCESS : FAILURE;
+#if HAL_OTA_XNV_IS_SPI
+  xnvBootStatus(written, 0);
+#endif
 }
+#endif
 
+#if HAL_OTA_XNV_IS_SPI
 /******************************************************************************
- * @fn      HalOTAInvRC
+ * @fn      xnvBootStatus
  *
- * @brief   Invalidate the active image so that the boot code will instantiate
- *          the DL image on the next reset.
+ * @brief   Record the outcome of dl2rc() for the application to report.
  *
- * @param   None.
+ * @param   written - Number of flash pages erased and programmed.
+ * @param   skipped - Number of flash pages left alone because they matched.
  *
  * @return  None.
  */
-void HalOTAInvRC(void)
+static void xnvBootStatus(uint8 written, uint8 skipped)
 {
-  uint16 crc[2] = {0,0xFFFF};
-  HalFlashWrite((HAL_OTA_CRC_ADDR / HAL_FLASH_WORD_SIZE), (uint8 *)crc, 1);
+  halOtaBootStatus_t status;
+
+  status.magic = HAL_OTA_BOOT_STATUS_MAGIC;
+  status.written = written;
+  status.skipped = skipped;
+
+  HalSPIErase(xnvChip->seCmd, XNV_STATUS_ADDR);
+  HalSPIWrite(XNV_STATUS_ADDR, (uint8 *)&status, sizeof(status));
 }
+#endif
 
 /******************************************************************************
- * @fn      HalOTARead
+ * @fn      crcCalc
  *
- * @brief   Read from the storage medium according to image type.
+ * @brief   Run the CRC16 Polynomial calculation over the RC image.
  *
- * @param   oset - Offset into the monolithic image.
- * @param   pBuf - Pointer to the buffer in which to copy the bytes read.
- * @param   len - Number of bytes to read.
- * @param   type - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ * @param   None.
  *
- * @return  None.
+ * @return  The CRC16 calculated, or 0 if the control block size is out of range.
  */
-void HalOTARead(uint32 oset, uint8 *pBuf, uint16 len, image_t type)
+static uint16 crcCalc()
 {
-  if (HAL_OTA_RC != type)
+  uint32 size = OTA_crcControl.programSize & HAL_OTA_CRC_SIZE_MASK;
+
+  // A size no image can have is a control block torn by a power cut: never matches crc[0].
+  if (size > HAL_OTA_DL_SIZE)
   {
-#if HAL_OTA_XNV_IS_INT
-    preamble_t preamble;
+    return 0;
+  }
 
-    HalOTARead(PREAMBLE_OFFSET, (uint8 *)&preamble, sizeof(preamble_t), HAL_OTA_RC);
-    oset += HAL_OTA_RC_START + HAL_OTA_DL_OSET;
-#elif HAL_OTA_XNV_IS_SPI
-    oset += HAL_OTA_DL_OSET;
-    HalSPIRead(oset, pBuf, len);
-   
-//    LREPMaster("HalOTARead\r\n");
-/*    
-    uint8 buf[4];
-    osal_buffer_uint32( buf, oset );
-    LREP("oset=0x%02X%02X%02X%02X\r\n", buf[3], buf[2], buf[1], buf[0]); //32
-    LREP("len=%d\r\n", len); //16
+  // Run the CRC calculation over the active body of code.
+  return crcImage(0, size, HAL_OTA_CRC_TYPE(OTA_crcControl.programSize), HAL_OTA_RC);
+}
+#endif //HAL_OTA_BOOT_CODE
 
-    for(uint8 i = 0; i<len; i++){
-      LREP("0x%02X\r\n", pBuf[i]);
-    }
- */         
-    if (oset == 0) {
-//      LREP("magicNumber=0x%02X%02X%02X%02X\r\n", pBuf[3], pBuf[2], pBuf[1], pBuf[0]); //32
-//      LREP("headerVersion=0x%02X%02X\r\n", pBuf[5], pBuf[4]); //16
-//      LREP("headerLength=0x%02X%02X\r\n", pBuf[7], pBuf[6]); //16
-//      LREP("fieldControl=0x%02X%02X\r\n", pBuf[9], pBuf[8]); //16
-      
-//      LREP("imageSize=0x%02X%02X%02X%02X\r\n", pBuf[55-oset], pBuf[54-oset], pBuf[53-oset], pBuf[52-oset]); //32
-    }  
-    return;
+/* runPoly() processes a byte at a time with a table in CODE space: crcTable[h] is the
+ * feedback the bit-serial 0x1021 shift register accumulates over 8 shifts when its high
+ * byte is h. The boot code has no room for 512 bytes of table and goes a nibble at a time.
+ */
+#if HAL_OTA_BOOT_CODE
+static const CODE uint16 crcNibble[16] =
+{
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+#else
+static const CODE uint16 crcTable[256] =
+{
+  0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+  0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+  0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
+  0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
+  0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
+  0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
+  0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
+  0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
+  0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
+  0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
+  0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
+  0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
+  0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
+  0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
+  0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
+  0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
+  0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
+  0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
+  0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
+  0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
+  0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
+  0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+  0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
+  0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
+  0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
+  0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
+  0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
+  0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
+  0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
+  0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
+  0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
+  0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
+};
 #endif
+
+/******************************************************************************
+ * @fn      runPoly
+ *
+ * @brief   Run the CRC16 Polynomial calculation over the byte parameter.
+ *
+ * @param   crc - Running CRC calculated so far.
+ * @param   val - Value on which to run the CRC16.
+ *
+ * @return  crc - Updated for the run.
+ */
+static uint16 runPoly(uint16 crc, uint8 val)
+{
+#if HAL_OTA_BOOT_CODE
+  crc = ((crc << 4) | (val >> 4)) ^ crcNibble[crc >> 12];
+  crc = ((crc << 4) | (val & 0x0F)) ^ crcNibble[crc >> 12];
+
+  return crc;
+#else
+  return ((crc << 8) | val) ^ crcTable[crc >> 8];
+#endif
+}
+
+/******************************************************************************
+ * @fn      runHwPoly
+ *
+ * @brief   Run the CC2530 hardware CRC16 (polynomial 0x8005, MSB first) over a buffer.
+ *          The LFSR is shared with the random number generator, so it is seeded with
+ *          the running CRC and read back inside one critical section, and then given
+ *          back the value it held: devices loading the same image must not all be
+ *          left with the same seed for the MAC backoffs and osal_rand().
+ *
+ * @param   crc - Running CRC calculated so far.
+ * @param   pBuf - Pointer to the bytes on which to run the CRC16.
+ * @param   len - Number of bytes.
+ *
+ * @return  crc - Updated for the run.
+ */
+static uint16 runHwPoly(uint16 crc, uint8 *pBuf, uint16 len)
+{
+  halIntState_t is;
+  uint8 rndL, rndH;
+
+  HAL_ENTER_CRITICAL_SECTION(is);
+  ADCCON1 &= ~0x0C;       // RCTRL = 00: the LFSR only runs on writes to RNDH.
+  rndL = RNDL;
+  rndH = RNDH;
+  RNDL = HI_UINT16(crc);  // Seeding takes two writes to RNDL, high byte first.
+  RNDL = LO_UINT16(crc);
+  while (len--)
+  {
+    RNDH = *pBuf++;
+  }
+  crc = BUILD_UINT16(RNDL, RNDH);
+  RNDL = rndH;
+  RNDL = rndL;
+  HAL_EXIT_CRITICAL_SECTION(is);
+
+  return crc;
+}
+
+/******************************************************************************
+ * @fn      crcRun
+ *
+ * @brief   Run the image checksum selected by the CRC control block over a buffer.
+ *
+ * @param   type - HAL_OTA_CRC_TYPE_1021 or HAL_OTA_CRC_TYPE_HW.
+ * @param   crc - Running CRC calculated so far.
+ * @param   pBuf - Pointer to the bytes on which to run the CRC16.
+ * @param   len - Number of bytes.
+ *
+ * @return  crc - Updated for the run.
+ */
+static uint16 crcRun(uint8 type, uint16 crc, uint8 *pBuf, uint16 len)
+{
+  if (type == HAL_OTA_CRC_TYPE_HW)
+  {
+    return runHwPoly(crc, pBuf, len);
+  }
+
+  while (len--)
+  {
+    crc = runPoly(crc, *pBuf++);
+  }
+
+  return crc;
+}
+
+/******************************************************************************
+ * @fn      crcImage
+ *
+ * @brief   Run the image checksum over a program image, streamed a chunk at a time
+ *          and skipping the 4 bytes of the CRC control block that hold the CRCs.
+ *
+ * @param   start - Offset of the program image in the monolithic image.
+ * @param   size - Program size from the CRC control block, without the type byte.
+ * @param   crcType - HAL_OTA_CRC_TYPE_1021 or HAL_OTA_CRC_TYPE_HW.
+ * @param   image - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ *
+ * @return  The CRC16 calculated.
+ */
+static uint16 crcImage(uint32 start, uint32 size, uint8 crcType, image_t image)
+{
+  halOtaStream_t stream;
+  uint16 crc = 0;
+  uint16 cnt;
+  uint8 *pBuf;
+
+  HalOTAStreamOpen(&stream, start, (size < HAL_OTA_CRC_OSET) ? size : HAL_OTA_CRC_OSET, image);
+  while ((cnt = HalOTAStreamSpan(&stream, &pBuf, HAL_OTA_STREAM_LEN)) != 0)
+  {
+    crc = crcRun(crcType, crc, pBuf, cnt);
+  }
+
+  if (size > HAL_OTA_CRC_OSET + 4)
+  {
+    HalOTAStreamOpen(&stream, start + HAL_OTA_CRC_OSET + 4, size - HAL_OTA_CRC_OSET - 4, image);
+    while ((cnt = HalOTAStreamSpan(&stream, &pBuf, HAL_OTA_STREAM_LEN)) != 0)
+    {
+      crc = crcRun(crcType, crc, pBuf, cnt);
+    }
+  }
+
+  return crc;
+}
+
+/******************************************************************************
+ * @fn      otaImageElem
+ *
+ * @brief   Find the upgrade image element of the OTA file in the DL image. It is
+ *          usually the first element, but the element rebuilt from a delta image
+ *          follows the OTA file that carried it.
+ *
+ * @param   pLen - Set to the length of the element.
+ *
+ * @return  Offset of the program image in the DL image.
+ */
+static uint32 otaImageElem(uint32 *pLen)
+{
+  OTA_SubElementHdr_t subElement;
+  OTA_ImageHeader_t header;
+  uint32 oset;
+  uint8 cnt;
+
+  HalOTARead(0, (uint8 *)&header, sizeof(OTA_ImageHeader_t), HAL_OTA_DL);
+  oset = header.headerLength;
+
+  for (cnt = 0; cnt < OTA_ELEM_MAX; cnt++)
+  {
+    HalOTARead(oset, (uint8 *)&subElement, OTA_SUB_ELEMENT_HDR_LEN, HAL_OTA_DL);
+
+    if (subElement.tag == OTA_IMAGE_TAG_ID)
+    {
+      *pLen = subElement.length;
+      return oset + OTA_SUB_ELEMENT_HDR_LEN;
+    }
+
+    // Erased flash past the last element.
+    if (subElement.length > HAL_OTA_DL_MAX)
+    {
+      break;
+    }
+    oset += OTA_SUB_ELEMENT_HDR_LEN + subElement.length;
+  }
+
+  // Nothing better: the first element, as it always was.
+  HalOTARead(header.headerLength, (uint8 *)&subElement, OTA_SUB_ELEMENT_HDR_LEN, HAL_OTA_DL);
+  *pLen = subElement.length;
+  return header.headerLength + OTA_SUB_ELEMENT_HDR_LEN;
+}
+
+/******************************************************************************
+ * @fn      HalOTAChkDL
+ *
+ * @brief   Run the CRC16 Polynomial calculation over the DL image.
+ *
+ * @param   None
+ *
+ * @return  SUCCESS or FAILURE.
+ */
+uint8 HalOTAChkDL(uint8 dlImagePreambleOffset)
+{
+ (void)dlImagePreambleOffset;  // Intentionally unreferenced parameter
+
+  uint16 crc;
+  OTA_CrcControl_t crcControl;
+  uint32 programStart;
+  uint32 programSize;
+  uint32 elemLen;
+  uint8 crcType;
+
+  HalOTAInit();
+  HalOTAFlush();
+  HalOTAAcquire();
+
+  // Calculate the update image start address
+  programStart = otaImageElem(&elemLen); // 0x38 + 0x06 = 0x3E
+  
+  uint8 raw[16];
+  HalOTARead(0, raw, 16, HAL_OTA_DL);
+  LREP("magicNumber=0x%02X%02X%02X%02X\r\n", raw[3], raw[2], raw[1], raw[0]); //32
+//  LREP("headerVersion=0x%02X%02X\r\n", raw[5], raw[4]); //16
+//  LREP("headerLength=0x%02X%02X\r\n", raw[7], raw[6]); //16
+//  LREP("fieldControl=0x%02X%02X\r\n", raw[9], raw[8]); //16
+  
+  uint8 raw1[4];
+  osal_buffer_uint32(raw1, programStart + HAL_OTA_CRC_OSET ); // 0x3E + 0x88 = 0xC6
+  LREP("prStart+CRC_OSET =0x%02X%02X%02X%02X\r\n", raw1[3], raw1[2], raw1[1], raw1[0]); //32
+  
+  // Get the CRC Control structure
+  HalOTARead(programStart + HAL_OTA_CRC_OSET, (uint8 *)&crcControl, sizeof(crcControl), HAL_OTA_DL);
+  
+  uint8 raw2[8];
+  HalOTARead(programStart + HAL_OTA_CRC_OSET, raw2, 8, HAL_OTA_DL);
+  LREP("crcC.crc =0x%02X%02X%02X%02X\r\n", raw2[3], raw2[2], raw2[1], raw2[0]); //32
+  LREP("crcC.prSize =0x%02X%02X%02X%02X\r\n", raw2[7], raw2[6], raw2[5], raw2[4]); //32
+  
+//  memset(bytes, 0, 4 * sizeof(uint8));
+//  osal_buffer_uint32( bytes, HAL_OTA_DL_MAX );
+//  LREP("HAL_OTA_DL_MAX =0x%02X%02X%02X%02X\r\n", bytes[3], bytes[2], bytes[1], bytes[0]);
+
+  programSize = crcControl.programSize & HAL_OTA_CRC_SIZE_MASK;
+  crcType = HAL_OTA_CRC_TYPE(crcControl.programSize);
+
+  if ((programSize > HAL_OTA_DL_MAX) || (programSize == 0) || (programSize > elemLen) ||
+      (crcType > HAL_OTA_CRC_TYPE_MAX))
+  {
+    HalOTARelease();
+    return FAILURE;
+  }
+
+  // Run the CRC calculation over the downloaded image.
+  crc = crcImage(programStart, programSize, crcType, HAL_OTA_DL);
+
+  HalOTARelease();
+  return (crcControl.crc[0] == crc) ? SUCCESS : FAILURE;
+}
+
+#if !HAL_OTA_BOOT_CODE
+/******************************************************************************
+ * @fn      HalOTACrcStart
+ *
+ * @brief   Start the running CRC over an upgrade image element being downloaded.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTACrcStart(void)
+{
+  otaCrcPos = 0;
+  otaCrcRun[HAL_OTA_CRC_TYPE_1021] = 0;
+  otaCrcRun[HAL_OTA_CRC_TYPE_HW] = 0;
+  osal_memset(&otaCrcControl, 0, sizeof(otaCrcControl));
+}
+
+/******************************************************************************
+ * @fn      HalOTACrcUpdate
+ *
+ * @brief   Run the CRC over the next bytes of the upgrade image element, in order.
+ *          The CRC words of the control block are skipped and bytes past the
+ *          program size are ignored, exactly as HalOTAChkDL() does.
+ *
+ * @param   pBuf - Pointer to the element bytes.
+ * @param   len - Number of bytes.
+ *
+ * @return  None.
+ */
+void HalOTACrcUpdate(uint8 *pBuf, uint16 len)
+{
+  while (len)
+  {
+    uint16 cnt;
+
+    if (otaCrcPos < HAL_OTA_CRC_OSET)
+    {
+      cnt = (len < HAL_OTA_CRC_OSET - otaCrcPos) ? len : (uint16)(HAL_OTA_CRC_OSET - otaCrcPos);
+      otaCrcRun[HAL_OTA_CRC_TYPE_1021] = crcRun(HAL_OTA_CRC_TYPE_1021, otaCrcRun[HAL_OTA_CRC_TYPE_1021], pBuf, cnt);
+#if HAL_OTA_CRC_TYPE_MAX >= HAL_OTA_CRC_TYPE_HW
+      otaCrcRun[HAL_OTA_CRC_TYPE_HW] = crcRun(HAL_OTA_CRC_TYPE_HW, otaCrcRun[HAL_OTA_CRC_TYPE_HW], pBuf, cnt);
+#endif
+    }
+    else if (otaCrcPos < HAL_OTA_CRC_OSET + sizeof(OTA_CrcControl_t))
+    {
+      cnt = 1;
+      ((uint8 *)&otaCrcControl)[(uint8)(otaCrcPos - HAL_OTA_CRC_OSET)] = *pBuf;
+      if (otaCrcPos >= HAL_OTA_CRC_OSET + 4)
+      {
+        otaCrcRun[HAL_OTA_CRC_TYPE_1021] = crcRun(HAL_OTA_CRC_TYPE_1021, otaCrcRun[HAL_OTA_CRC_TYPE_1021], pBuf, 1);
+#if HAL_OTA_CRC_TYPE_MAX >= HAL_OTA_CRC_TYPE_HW
+        otaCrcRun[HAL_OTA_CRC_TYPE_HW] = crcRun(HAL_OTA_CRC_TYPE_HW, otaCrcRun[HAL_OTA_CRC_TYPE_HW], pBuf, 1);
+#endif
+      }
+    }
+    else
+    {
+      uint32 size = otaCrcControl.programSize & HAL_OTA_CRC_SIZE_MASK;
+      uint8 type = HAL_OTA_CRC_TYPE(otaCrcControl.programSize);
+
+      if ((otaCrcPos >= size) || (type > HAL_OTA_CRC_TYPE_MAX))
+      {
+        otaCrcPos += len;
+        return;
+      }
+
+      cnt = (len < size - otaCrcPos) ? len : (uint16)(size - otaCrcPos);
+      otaCrcRun[type] = crcRun(type, otaCrcRun[type], pBuf, cnt);
+    }
+
+    otaCrcPos += cnt;
+    pBuf += cnt;
+    len -= cnt;
+  }
+}
+
+/******************************************************************************
+ * @fn      HalOTACrcCheck
+ *
+ * @brief   Check the running CRC against the CRC control block of the element.
+ *
+ * @param   None.
+ *
+ * @return  SUCCESS or FAILURE.
+ */
+uint8 HalOTACrcCheck(void)
+{
+  uint32 size = otaCrcControl.programSize & HAL_OTA_CRC_SIZE_MASK;
+  uint8 type = HAL_OTA_CRC_TYPE(otaCrcControl.programSize);
+
+  if ((otaCrcPos < HAL_OTA_CRC_OSET + sizeof(OTA_CrcControl_t)) || (otaCrcPos < size) ||
+      (size > HAL_OTA_DL_MAX) || (size == 0) || (type > HAL_OTA_CRC_TYPE_MAX))
+  {
+    return FAILURE;
+  }
+
+  return (otaCrcControl.crc[0] == otaCrcRun[type]) ? SUCCESS : FAILURE;
+}
+
+/******************************************************************************
+ * @fn      otaBuildFits
+ *
+ * @brief   Check that an upgrade image element rebuilt on the device fits the DL image.
+ *
+ * @param   oset - DL image offset of the element.
+ * @param   len - Length of its program image.
+ *
+ * @return  TRUE if it fits.
+ */
+static uint8 otaBuildFits(uint32 oset, uint32 len)
+{
+  uint32 limit = HalOTAAvail();
+
+  return ((len != 0) && (len <= HAL_OTA_DL_SIZE) && (oset <= limit) &&
+          (len + OTA_SUB_ELEMENT_HDR_LEN <= limit - oset));
+}
+
+/******************************************************************************
+ * @fn      HalOTADeltaStart
+ *
+ * @brief   Start rebuilding the upgrade image from a downloaded delta image element
+ *          and the running image. The rebuilt element is written at outOset with
+ *          the running CRC of HalOTACrcStart() kept over it.
+ *
+ * @param   patchOset - DL image offset of the delta image element payload.
+ * @param   patchLen - Length of the payload.
+ * @param   outOset - DL image offset for the rebuilt element, the end of the OTA file.
+ *
+ * @return  SUCCESS, or FAILURE if the patch is not for the running image or does not fit.
+ */
+uint8 HalOTADeltaStart(uint32 patchOset, uint32 patchLen, uint32 outOset)
+{
+  OTA_SubElementHdr_t subElement;
+  OTA_CrcControl_t crcControl;
+  halOtaDeltaHdr_t hdr;
+
+  HalOTADeltaStop();
+
+  if (patchLen < sizeof(hdr))
+  {
+    return FAILURE;
+  }
+
+  HalOTARead(patchOset, (uint8 *)&hdr, sizeof(hdr), HAL_OTA_DL);
+  HalOTARead(HAL_OTA_CRC_OSET, (uint8 *)&crcControl, sizeof(crcControl), HAL_OTA_RC);
+  crcControl.programSize &= HAL_OTA_CRC_SIZE_MASK;
+
+  if ((hdr.magic != HAL_OTA_DELTA_MAGIC) || (hdr.srcCrc != crcControl.crc[0]) ||
+      (crcControl.programSize > HAL_OTA_DL_SIZE) ||
+      !otaBuildFits(outOset, hdr.targetLen))
+  {
+    return FAILURE;
+  }
+
+  if ((otaDelta = osal_mem_alloc(sizeof(otaDelta_t))) == NULL)
+  {
+    return FAILURE;
+  }
+
+  HalOTAStreamOpen(&otaDelta->patch, patchOset + sizeof(hdr), patchLen - sizeof(hdr), HAL_OTA_DL);
+  otaDelta->srcSize = crcControl.programSize;
+  otaDelta->outOset = outOset + OTA_SUB_ELEMENT_HDR_LEN;
+  otaDelta->outEnd = otaDelta->outOset + hdr.targetLen;
+  otaDelta->opLeft = 0;
+
+  HalOTAEraseAhead(outOset, OTA_SUB_ELEMENT_HDR_LEN + hdr.targetLen);
+
+  subElement.tag = OTA_IMAGE_TAG_ID;
+  subElement.length = hdr.targetLen;
+  HalOTAWrite(outOset, (uint8 *)&subElement, OTA_SUB_ELEMENT_HDR_LEN, HAL_OTA_DL);
+  HalOTACrcStart();
+
+  return SUCCESS;
+}
+
+/******************************************************************************
+ * @fn      HalOTADeltaStep
+ *
+ * @brief   Rebuild the next OTA_DELTA_STEP_LEN bytes of the upgrade image.
+ *
+ * @param   None.
+ *
+ * @return  HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE or HAL_OTA_BUILD_FAIL.
+ */
+uint8 HalOTADeltaStep(void)
+{
+  uint16 left = OTA_DELTA_STEP_LEN;
+  uint8 status = HAL_OTA_BUILD_BUSY;
+
+  if (otaDelta == NULL)
+  {
+    return HAL_OTA_BUILD_FAIL;
+  }
+
+  while (left && (status == HAL_OTA_BUILD_BUSY))
+  {
+    uint16 cnt;
+    uint8 *pBuf;
+
+    if (otaDelta->opLeft == 0)
+    {
+      status = otaDeltaOp();
+      continue;
+    }
+
+    cnt = (otaDelta->opLeft < left) ? otaDelta->opLeft : left;
+
+    if (otaDelta->op == HAL_OTA_DELTA_COPY)
+    {
+      // A read must not run past the flash bank mapped into XDATA, so it stops at the page end.
+      uint16 pgLeft = HAL_FLASH_PAGE_SIZE -
+                      (uint16)((HAL_OTA_RC_START + otaDelta->copySrc) % HAL_FLASH_PAGE_SIZE);
+
+      if (cnt > OTA_DELTA_BUF_LEN)
+      {
+        cnt = OTA_DELTA_BUF_LEN;
+      }
+      if (cnt > pgLeft)
+      {
+        cnt = pgLeft;
+      }
+
+      pBuf = otaDelta->buf;
+      HalOTARead(otaDelta->copySrc, pBuf, cnt, HAL_OTA_RC);
+      otaDelta->copySrc += cnt;
+    }
+    else if ((cnt = HalOTAStreamSpan(&otaDelta->patch, &pBuf, cnt)) == 0)
+    {
+      status = HAL_OTA_BUILD_FAIL;
+      continue;
+    }
+
+    HalOTAWrite(otaDelta->outOset, pBuf, cnt, HAL_OTA_DL);
+    HalOTACrcUpdate(pBuf, cnt);
+    otaDelta->outOset += cnt;
+    otaDelta->opLeft -= cnt;
+    left -= cnt;
+  }
+
+  if (status != HAL_OTA_BUILD_BUSY)
+  {
+    HalOTADeltaStop();
+  }
+
+  return status;
+}
+
+/******************************************************************************
+ * @fn      otaDeltaOp
+ *
+ * @brief   Fetch and check the next op of the delta image.
+ *
+ * @param   None.
+ *
+ * @return  HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE or HAL_OTA_BUILD_FAIL.
+ */
+static uint8 otaDeltaOp(void)
+{
+  uint8 arg[6];
+
+  if (HalOTAStreamGet(&otaDelta->patch, &otaDelta->op, 1) != 1)
+  {
+    return HAL_OTA_BUILD_FAIL;
+  }
+
+  switch (otaDelta->op)
+  {
+  case HAL_OTA_DELTA_END:
+    return (otaDelta->outOset == otaDelta->outEnd) ? HAL_OTA_BUILD_DONE : HAL_OTA_BUILD_FAIL;
+
+  case HAL_OTA_DELTA_COPY:
+    if (HalOTAStreamGet(&otaDelta->patch, arg, 6) != 6)
+    {
+      return HAL_OTA_BUILD_FAIL;
+    }
+    otaDelta->copySrc = osal_build_uint32(arg, 4);
+    otaDelta->opLeft = BUILD_UINT16(arg[4], arg[5]);
+
+    if ((otaDelta->copySrc > otaDelta->srcSize) ||
+        (otaDelta->opLeft > otaDelta->srcSize - otaDelta->copySrc))
+    {
+      return HAL_OTA_BUILD_FAIL;
+    }
+    break;
+
+  case HAL_OTA_DELTA_INSERT:
+    if (HalOTAStreamGet(&otaDelta->patch, arg, 2) != 2)
+    {
+      return HAL_OTA_BUILD_FAIL;
+    }
+    otaDelta->opLeft = BUILD_UINT16(arg[0], arg[1]);
+    break;
+
+  default:
+    return HAL_OTA_BUILD_FAIL;
+  }
+
+  return (otaDelta->opLeft <= otaDelta->outEnd - otaDelta->outOset) ?
+          HAL_OTA_BUILD_BUSY : HAL_OTA_BUILD_FAIL;
+}
+
+/******************************************************************************
+ * @fn      HalOTADeltaStop
+ *
+ * @brief   Drop a delta image being applied, if any.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTADeltaStop(void)
+{
+  if (otaDelta != NULL)
+  {
+    osal_mem_free(otaDelta);
+    otaDelta = NULL;
+  }
+}
+
+/******************************************************************************
+ * @fn      HalOTALz4Start
+ *
+ * @brief   Start expanding a compressed image element.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTALz4Start(void)
+{
+  HalOTALz4Stop();
+  osal_memset(&otaLz4, 0, sizeof(otaLz4));
+}
+
+/******************************************************************************
+ * @fn      HalOTALz4Stop
+ *
+ * @brief   Drop the input held behind a match that yielded.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTALz4Stop(void)
+{
+  if (otaLz4In != NULL)
+  {
+    osal_mem_free(otaLz4In);
+    otaLz4In = NULL;
+  }
+  otaLz4InLen = 0;
+}
+
+/******************************************************************************
+ * @fn      HalOTABuildSave
+ *
+ * @brief   Copy out the running CRC and LZ4 expansion state, so that a download
+ *          can be resumed after a reset. Call HalOTAFlush() along with it: the
+ *          state is only good with the DL image programmed up to the same point.
+ *
+ * @param   pState - Where to copy the state.
+ *
+ * @return  None.
+ */
+void HalOTABuildSave(halOtaBuildState_t *pState)
+{
+  pState->crcPos = otaCrcPos;
+  pState->crcRun[HAL_OTA_CRC_TYPE_1021] = otaCrcRun[HAL_OTA_CRC_TYPE_1021];
+  pState->crcRun[HAL_OTA_CRC_TYPE_HW] = otaCrcRun[HAL_OTA_CRC_TYPE_HW];
+  pState->crc[0] = otaCrcControl.crc[0];
+  pState->crc[1] = otaCrcControl.crc[1];
+  pState->programSize = otaCrcControl.programSize;
+  pState->lz4RawLen = otaLz4.rawLen;
+  pState->lz4Produced = otaLz4.produced;
+  pState->lz4RunLen = otaLz4.runLen;
+  pState->lz4MatchOset = otaLz4.matchOset;
+  pState->lz4Token = otaLz4.token;
+  pState->lz4State = otaLz4.state;
+}
+
+/******************************************************************************
+ * @fn      HalOTABuildLoad
+ *
+ * @brief   Restore the running CRC and LZ4 expansion state saved by HalOTABuildSave().
+ *
+ * @param   pState - The saved state.
+ *
+ * @return  None.
+ */
+void HalOTABuildLoad(halOtaBuildState_t *pState)
+{
+  otaCrcPos = pState->crcPos;
+  otaCrcRun[HAL_OTA_CRC_TYPE_1021] = pState->crcRun[HAL_OTA_CRC_TYPE_1021];
+  otaCrcRun[HAL_OTA_CRC_TYPE_HW] = pState->crcRun[HAL_OTA_CRC_TYPE_HW];
+  otaCrcControl.crc[0] = pState->crc[0];
+  otaCrcControl.crc[1] = pState->crc[1];
+  otaCrcControl.programSize = pState->programSize;
+  otaLz4.rawLen = pState->lz4RawLen;
+  otaLz4.produced = pState->lz4Produced;
+  otaLz4.runLen = pState->lz4RunLen;
+  otaLz4.matchOset = pState->lz4MatchOset;
+  otaLz4.token = pState->lz4Token;
+  otaLz4.state = pState->lz4State;
+  HalOTALz4Stop();
+}
+
+/******************************************************************************
+ * @fn      HalOTALz4Feed
+ *
+ * @brief   Expand the next bytes of a compressed image element, in order, into an
+ *          upgrade image element in the DL image. The element header goes in once
+ *          the program image length is known, along with HalOTACrcStart().
+ *          A match stops after OTA_LZ4_STEP_LEN bytes, or before a write that
+ *          would stall behind an erase, and the rest of the input is held for
+ *          HalOTALz4Resume().
+ *
+ * @param   pBuf - Pointer to the element bytes.
+ * @param   len - Number of bytes.
+ * @param   pOset - DL image offset to write at, advanced past the bytes written.
+ *
+ * @return  HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE, HAL_OTA_BUILD_WAIT or
+ *          HAL_OTA_BUILD_FAIL.
+ */
+uint8 HalOTALz4Feed(uint8 *pBuf, uint16 len, uint32 *pOset)
+{
+  // Nothing more until what was taken has expanded.
+  if ((otaLz4In != NULL) || ((otaLz4.state == OTA_LZ4_TOKEN) && otaLz4.runLen))
+  {
+    return HAL_OTA_BUILD_FAIL;
+  }
+
+  otaLz4Step = 0;
+  return otaLz4Run(pBuf, len, pOset);
+}
+
+/******************************************************************************
+ * @fn      HalOTALz4Resume
+ *
+ * @brief   Carry on with the match that yielded and the input held behind it,
+ *          another step at a time.
+ *
+ * @param   pOset - DL image offset to write at, advanced past the bytes written.
+ *
+ * @return  As HalOTALz4Feed().
+ */
+uint8 HalOTALz4Resume(uint32 *pOset)
+{
+  uint8 *pIn = otaLz4In;
+  uint8 rtrn;
+
+  otaLz4Step = 0;
+
+  if ((otaLz4.state == OTA_LZ4_TOKEN) && otaLz4.runLen)
+  {
+    if (otaLz4Match(pOset) != SUCCESS)
+    {
+      return HAL_OTA_BUILD_FAIL;
+    }
+    if (otaLz4.runLen)
+    {
+      return HAL_OTA_BUILD_WAIT;
+    }
+    if (otaLz4.produced == otaLz4.rawLen)
+    {
+      otaLz4.state = OTA_LZ4_DONE;
+    }
+  }
+
+  otaLz4In = NULL;
+  rtrn = otaLz4Run(pIn, otaLz4InLen, pOset);
+
+  if (pIn != NULL)
+  {
+    osal_mem_free(pIn);
+  }
+
+  return rtrn;
+}
+
+/******************************************************************************
+ * @fn      otaLz4Run
+ *
+ * @brief   Expand the next bytes of a compressed image element, see HalOTALz4Feed().
+ *
+ * @param   pBuf - Pointer to the element bytes.
+ * @param   len - Number of bytes.
+ * @param   pOset - DL image offset to write at, advanced past the bytes written.
+ *
+ * @return  As HalOTALz4Feed().
+ */
+static uint8 otaLz4Run(uint8 *pBuf, uint16 len, uint32 *pOset)
+{
+  otaLz4InLen = 0;
+
+  while (len)
+  {
+    uint8 ch = *pBuf;
+    uint16 cnt = 1;
+
+    switch (otaLz4.state)
+    {
+    case OTA_LZ4_TOKEN:
+      otaLz4.token = ch;
+      otaLz4.runLen = ch >> 4;
+      otaLz4.state = (otaLz4.runLen == 15) ? OTA_LZ4_LIT_LEN : OTA_LZ4_LITERALS;
+      break;
+
+    case OTA_LZ4_LIT_LEN:
+      otaLz4.runLen += ch;
+      if (ch != 255)
+      {
+        otaLz4.state = OTA_LZ4_LITERALS;
+      }
+      break;
+
+    case OTA_LZ4_LITERALS:
+      cnt = (otaLz4.runLen < len) ? (uint16)otaLz4.runLen : len;
+      otaLz4Write(pOset, pBuf, cnt);
+      otaLz4.runLen -= cnt;
+      break;
+
+    case OTA_LZ4_OFFSET0:
+      otaLz4.matchOset = ch;
+      otaLz4.state = OTA_LZ4_OFFSET1;
+      break;
+
+    case OTA_LZ4_OFFSET1:
+      otaLz4.matchOset |= (uint16)ch << 8;
+      otaLz4.runLen = (otaLz4.token & 0x0F) + HAL_OTA_LZ4_MIN_MATCH;
+      otaLz4.state = ((otaLz4.token & 0x0F) == 15) ? OTA_LZ4_MATCH_LEN : OTA_LZ4_TOKEN;
+      break;
+
+    case OTA_LZ4_MATCH_LEN:
+      otaLz4.runLen += ch;
+      if (ch != 255)
+      {
+        otaLz4.state = OTA_LZ4_TOKEN;
+      }
+      break;
+
+    case OTA_LZ4_DONE:
+      return HAL_OTA_BUILD_FAIL;
+
+    default:
+      // The program image length comes first.
+      otaLz4.rawLen |= (uint32)ch << (8 * otaLz4.state);
+      if (++otaLz4.state == OTA_LZ4_TOKEN)
+      {
+        OTA_SubElementHdr_t subElement;
+
+        if (!otaBuildFits(*pOset, otaLz4.rawLen))
+        {
+          return HAL_OTA_BUILD_FAIL;
+        }
+
+        HalOTAEraseAhead(*pOset, OTA_SUB_ELEMENT_HDR_LEN + otaLz4.rawLen);
+
+        subElement.tag = OTA_IMAGE_TAG_ID;
+        subElement.length = otaLz4.rawLen;
+        HalOTAWrite(*pOset, (uint8 *)&subElement, OTA_SUB_ELEMENT_HDR_LEN, HAL_OTA_DL);
+        *pOset += OTA_SUB_ELEMENT_HDR_LEN;
+        HalOTACrcStart();
+      }
+      break;
+    }
+
+    pBuf += cnt;
+    len -= cnt;
+
+    // A match is copied as soon as its length is complete.
+    if ((otaLz4.state == OTA_LZ4_TOKEN) && otaLz4.runLen)
+    {
+      if (otaLz4Match(pOset) != SUCCESS)
+      {
+        return HAL_OTA_BUILD_FAIL;
+      }
+      if (otaLz4.runLen)
+      {
+        // Yielded, the rest of the input waits for HalOTALz4Resume().
+        if (len)
+        {
+          if ((otaLz4In = osal_mem_alloc(len)) == NULL)
+          {
+            return HAL_OTA_BUILD_FAIL;
+          }
+          osal_memcpy(otaLz4In, pBuf, len);
+          otaLz4InLen = len;
+        }
+        return HAL_OTA_BUILD_WAIT;
+      }
+      if (otaLz4.produced == otaLz4.rawLen)
+      {
+        otaLz4.state = OTA_LZ4_DONE;
+      }
+    }
+
+    // The last sequence of the block ends with its literals.
+    if (otaLz4.state == OTA_LZ4_LITERALS)
+    {
+      if (otaLz4.runLen > otaLz4.rawLen - otaLz4.produced)
+      {
+        return HAL_OTA_BUILD_FAIL;
+      }
+      if (otaLz4.runLen == 0)
+      {
+        otaLz4.state = (otaLz4.produced == otaLz4.rawLen) ? OTA_LZ4_DONE : OTA_LZ4_OFFSET0;
+      }
+    }
+  }
+
+  return (otaLz4.state == OTA_LZ4_DONE) ? HAL_OTA_BUILD_DONE : HAL_OTA_BUILD_BUSY;
+}
+
+/******************************************************************************
+ * @fn      otaLz4Write
+ *
+ * @brief   Write expanded program image bytes and run the CRC over them.
+ *
+ * @param   pOset - DL image offset to write at, advanced past the bytes written.
+ * @param   pBuf - Pointer to the bytes.
+ * @param   len - Number of bytes.
+ *
+ * @return  None.
+ */
+static void otaLz4Write(uint32 *pOset, uint8 *pBuf, uint16 len)
+{
+  HalOTAWrite(*pOset, pBuf, len, HAL_OTA_DL);
+  HalOTACrcUpdate(pBuf, len);
+  *pOset += len;
+  otaLz4.produced += len;
+  otaLz4Step += len;
+}
+
+/******************************************************************************
+ * @fn      otaLz4Match
+ *
+ * @brief   Copy a match from the program image bytes already expanded. A match
+ *          closer than OTA_LZ4_BUF_LEN repeats its bytes from RAM a whole number
+ *          of periods at a time, the runs of padding are usually such matches.
+ *          Stops short, leaving otaLz4.runLen, once OTA_LZ4_STEP_LEN bytes have
+ *          been expanded this step or the flash would stall behind an erase.
+ *          Starting again reads the period back from the same distance.
+ *
+ * @param   pOset - DL image offset to write at, advanced past the bytes written.
+ *
+ * @return  SUCCESS, or FAILURE if the match reaches outside the program image.
+ */
+static uint8 otaLz4Match(uint32 *pOset)
+{
+  uint16 period = 0;
+  uint16 cnt;
+
+  if ((otaLz4.matchOset == 0) || (otaLz4.matchOset > otaLz4.produced) ||
+      (otaLz4.runLen > otaLz4.rawLen - otaLz4.produced))
+  {
+    return FAILURE;
+  }
+
+  // Nor read back behind an erase the writes could not get past anyway.
+  if (HalOTAPoll() == HAL_OTA_XNV_STALL)
+  {
+    return SUCCESS;
+  }
+
+  if (otaLz4.matchOset < OTA_LZ4_BUF_LEN)
+  {
+    HalOTARead(*pOset - otaLz4.matchOset, otaLz4Buf, otaLz4.matchOset, HAL_OTA_DL);
+    for (period = otaLz4.matchOset; period + otaLz4.matchOset <= OTA_LZ4_BUF_LEN; period += otaLz4.matchOset)
+    {
+      osal_memcpy(otaLz4Buf + period, otaLz4Buf, otaLz4.matchOset);
+    }
+  }
+
+  while (otaLz4.runLen)
+  {
+    if ((otaLz4Step >= OTA_LZ4_STEP_LEN) || (HalOTAPoll() == HAL_OTA_XNV_STALL))
+    {
+      break;
+    }
+
+    cnt = (otaLz4.runLen < OTA_LZ4_BUF_LEN) ? (uint16)otaLz4.runLen : OTA_LZ4_BUF_LEN;
+
+    if (period)
+    {
+      if (cnt > period)
+      {
+        cnt = period;
+      }
+    }
+    else
+    {
+      HalOTARead(*pOset - otaLz4.matchOset, otaLz4Buf, cnt, HAL_OTA_DL);
+    }
+
+    otaLz4Write(pOset, otaLz4Buf, cnt);
+    otaLz4.runLen -= cnt;
+  }
+
+  return SUCCESS;
+}
+#endif
+
+/******************************************************************************
+ * @fn      HalOTAInvRC
+ *
+ * @brief   Invalidate the active image so that the boot code will instantiate
+ *          the DL image on the next reset.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTAInvRC(void)
+{
+  uint16 crc[2] = {0,0xFFFF};
+  HalFlashWrite((HAL_OTA_CRC_ADDR / HAL_FLASH_WORD_SIZE), (uint8 *)crc, 1);
+}
+
+/******************************************************************************
+ * @fn      HalOTARead
+ *
+ * @brief   Read from the storage medium according to image type.
+ *
+ * @param   oset - Offset into the monolithic image.
+ * @param   pBuf - Pointer to the buffer in which to copy the bytes read.
+ * @param   len - Number of bytes to read.
+ * @param   type - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ *
+ * @return  None.
+ */
+void HalOTARead(uint32 oset, uint8 *pBuf, uint16 len, image_t type)
+{
+  if (HAL_OTA_RC != type)
+  {
+#if HAL_OTA_XNV_IS_INT
+    preamble_t preamble;
+
+    HalOTARead(PREAMBLE_OFFSET, (uint8 *)&preamble, sizeof(preamble_t), HAL_OTA_RC);
+    oset += HAL_OTA_RC_START + HAL_OTA_DL_OSET;
+#elif HAL_OTA_XNV_IS_SPI
+    oset += HAL_OTA_DL_OSET;
+#if HAL_OTA_XNV_PAGE_BUF
+    // Bytes all in the page buffer don't need to wait for a pending erase.
+    if (!xnvPageLen || (oset < xnvPageAddr) || (oset + len > xnvPageAddr + xnvPageLen))
+#endif
+    {
+      HalOTAAcquire();
+      HalSPIRead(oset, pBuf, len);
+      HalOTARelease();
+    }
+
+#if HAL_OTA_XNV_PAGE_BUF
+    // Bytes still in the page buffer are newer than the external NV contents.
+    if (xnvPageLen && (oset < xnvPageAddr + xnvPageLen) && (oset + len > xnvPageAddr))
+    {
+      uint32 from = (oset > xnvPageAddr) ? oset : xnvPageAddr;
+      uint32 to = oset + len;
+
+      if (to > xnvPageAddr + xnvPageLen)
+      {
+        to = xnvPageAddr + xnvPageLen;
+      }
+      osal_memcpy(pBuf + (uint16)(from - oset), xnvPageBuf + (uint16)(from - xnvPageAddr), (uint16)(to - from));
+    }
+#endif
+   
+//    LREPMaster("HalOTARead\r\n");
+/*    
+    uint8 buf[4];
+    osal_buffer_uint32( buf, oset );
+    LREP("oset=0x%02X%02X%02X%02X\r\n", buf[3], buf[2], buf[1], buf[0]); //32
+    LREP("len=%d\r\n", len); //16
+
+    for(uint8 i = 0; i<len; i++){
+      LREP("0x%02X\r\n", pBuf[i]);
+    }
+ */         
+    if (oset == 0) {
+//      LREP("magicNumber=0x%02X%02X%02X%02X\r\n", pBuf[3], pBuf[2], pBuf[1], pBuf[0]); //32
+//      LREP("headerVersion=0x%02X%02X\r\n", pBuf[5], pBuf[4]); //16
+//      LREP("headerLength=0x%02X%02X\r\n", pBuf[7], pBuf[6]); //16
+//      LREP("fieldControl=0x%02X%02X\r\n", pBuf[9], pBuf[8]); //16
+      
+//      LREP("imageSize=0x%02X%02X%02X%02X\r\n", pBuf[55-oset], pBuf[54-oset], pBuf[53-oset], pBuf[52-oset]); //32
+    }  
+    return;
+#endif
+  }
+  else
+  {
+    oset += HAL_OTA_RC_START;
+  }
+
+  HalFlashRead(oset / HAL_FLASH_PAGE_SIZE, oset % HAL_FLASH_PAGE_SIZE, pBuf, len);
+}
+
+/******************************************************************************
+ * @fn      HalOTAStreamOpen
+ *
+ * @brief   Start a streaming read over a range of an image. The stream fetches
+ *          HAL_OTA_STREAM_LEN bytes per HalOTARead() and hands them out in spans.
+ *
+ * @param   pStream - Pointer to the stream state, owned by the caller.
+ * @param   oset - Offset into the monolithic image of the first byte.
+ * @param   len - Number of bytes in the range.
+ * @param   type - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ *
+ * @return  None.
+ */
+void HalOTAStreamOpen(halOtaStream_t *pStream, uint32 oset, uint32 len, image_t type)
+{
+  pStream->oset = oset;
+  pStream->left = len;
+  pStream->pos = 0;
+  pStream->cnt = 0;
+  pStream->type = type;
+}
+
+/******************************************************************************
+ * @fn      HalOTAStreamSpan
+ *
+ * @brief   Consume the next contiguous run of bytes from a stream, fetching the
+ *          next chunk when the buffered one is used up. The span stays valid until
+ *          the next call on the same stream.
+ *
+ * @param   pStream - Pointer to the stream state.
+ * @param   ppBuf - Set to point at the first byte of the span.
+ * @param   max - Maximum number of bytes to consume.
+ *
+ * @return  Number of bytes in the span, 0 at the end of the range.
+ */
+uint16 HalOTAStreamSpan(halOtaStream_t *pStream, uint8 **ppBuf, uint16 max)
+{
+  uint16 cnt;
+
+  if (pStream->pos == pStream->cnt)
+  {
+    if (pStream->left == 0)
+    {
+      return 0;
+    }
+
+    cnt = (pStream->left < HAL_OTA_STREAM_LEN) ? (uint16)pStream->left : HAL_OTA_STREAM_LEN;
+    HalOTARead(pStream->oset, pStream->buf, cnt, pStream->type);
+    pStream->oset += cnt;
+    pStream->left -= cnt;
+    pStream->pos = 0;
+    pStream->cnt = cnt;
+  }
+
+  cnt = pStream->cnt - pStream->pos;
+  if (cnt > max)
+  {
+    cnt = max;
+  }
+  *ppBuf = pStream->buf + pStream->pos;
+  pStream->pos += cnt;
+
+  return cnt;
+}
+
+#if !HAL_OTA_BOOT_CODE
+/******************************************************************************
+ * @fn      HalOTAStreamGet
+ *
+ * @brief   Copy the next bytes of a stream into a buffer, across chunks as needed.
+ *
+ * @param   pStream - Pointer to the stream state.
+ * @param   pBuf - Pointer to the buffer in which to copy the bytes.
+ * @param   len - Number of bytes wanted.
+ *
+ * @return  Number of bytes copied, less than len at the end of the range.
+ */
+uint16 HalOTAStreamGet(halOtaStream_t *pStream, uint8 *pBuf, uint16 len)
+{
+  uint16 got = 0;
+  uint16 cnt;
+  uint8 *pSpan;
+
+  while ((got < len) && ((cnt = HalOTAStreamSpan(pStream, &pSpan, len - got)) != 0))
+  {
+    osal_memcpy(pBuf + got, pSpan, cnt);
+    got += cnt;
+  }
+
+  return got;
+}
+#endif
+
+/******************************************************************************
+ * @fn      HalOTAWrite
+ *
+ * @brief   Write to the storage medium according to the image type.
+ *
+ *  NOTE:   Destructive write on page boundary! When writing to the first flash word
+ *          of a page boundary, the page is erased without saving/restoring the bytes not written.
+ *          Writes anywhere else on a page assume that the location written to has been erased.
+ *
+ * @param   oset - Offset into the monolithic image, aligned to HAL_FLASH_WORD_SIZE.
+ * @param   pBuf - Pointer to the buffer in from which to write.
+ * @param   len - Number of bytes to write. If not an even multiple of HAL_FLASH_WORD_SIZE,
+ *                remainder bytes are overwritten with garbage.
+ * @param   type - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ *
+ * @return  None.
+ */
+
+void HalOTAWrite(uint32 oset, uint8 *pBuf, uint16 len, image_t type)
+{
+  if (HAL_OTA_RC != type)
+  {
+#if HAL_OTA_XNV_IS_INT
+    oset += HAL_OTA_RC_START + HAL_OTA_DL_OSET;
+#elif HAL_OTA_XNV_IS_SPI
+    oset += HAL_OTA_DL_OSET;
+    HalOTAAcquire();
+
+    // Split on page boundaries so that every sector is erased before its first page is written.
+    while (len)
+    {
+      uint16 cnt = XNV_PAGE_SIZE - (uint16)(oset & (XNV_PAGE_SIZE - 1));
+
+      if (cnt > len)
+      {
+        cnt = len;
+      }
+
+      xnvSectorPrep(oset);
+#if HAL_OTA_XNV_PAGE_BUF
+      xnvPageWrite(oset, pBuf, cnt);
+#else
+      HalSPIWrite(oset, pBuf, cnt);
+#endif
+      oset += cnt;
+      pBuf += cnt;
+      len -= cnt;
+    }
+
+    HalOTARelease();
+    LREPMaster("HalOTAWrite\r\n");
+
+    return;
+#endif
+  }
+  else
+  {
+    oset += HAL_OTA_RC_START;
+  }
+
+  if ((oset % HAL_FLASH_PAGE_SIZE) == 0)
+  {
+    HalFlashErase(oset / HAL_FLASH_PAGE_SIZE);
+  }
+
+  HalFlashWrite(oset / HAL_FLASH_WORD_SIZE, pBuf, len / HAL_FLASH_WORD_SIZE);
+}
+
+/******************************************************************************
+ * @fn      HalOTAFlush
+ *
+ * @brief   Program any DL bytes still held in the write-combining page buffer.
+ *          Must be called before the DL image is used outside of HalOTARead(),
+ *          i.e. before verifying it, on completion and on abort of a download.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTAFlush(void)
+{
+#if HAL_OTA_XNV_IS_SPI && HAL_OTA_XNV_PAGE_BUF
+  if (xnvPageLen)
+  {
+    HalSPIWrite(xnvPageAddr, xnvPageBuf, xnvPageLen);
+    xnvPageLen = 0;
+  }
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTAPoll
+ *
+ * @brief   Complete a pending erase of the external NV without blocking and
+ *          program the page queued behind it once it is done. Call this
+ *          periodically while it does not return HAL_OTA_XNV_IDLE.
+ *
+ * @param   None.
+ *
+ * @return  HAL_OTA_XNV_IDLE when no erase is pending, HAL_OTA_XNV_BUSY while
+ *          an erase is pending but further writes can be queued, or
+ *          HAL_OTA_XNV_STALL when the next write would have to wait for it.
+ */
+uint8 HalOTAPoll(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  if (xnvBusy)
+  {
+    if (!(xnvReadStatus() & xnvChip->wipMask))
+    {
+      xnvBusy = FALSE;
+#if HAL_OTA_XNV_PAGE_BUF
+      if (xnvPageLen && (((xnvPageAddr + xnvPageLen) & (XNV_PAGE_SIZE - 1)) == 0))
+      {
+        HalOTAFlush();
+      }
+#endif
+    }
+  }
+
+  if (!xnvBusy && (xnvAheadNext < xnvAheadEnd))
+  {
+    xnvEraseAheadStep();
+  }
+
+  if (xnvBusy)
+  {
+    return (HalOTARoom() < XNV_STALL_ROOM) ? HAL_OTA_XNV_STALL : HAL_OTA_XNV_BUSY;
+  }
+
+  // Blank sectors are skipped without an erase, there may be more of the range to check.
+  if (xnvAheadNext < xnvAheadEnd)
+  {
+    return HAL_OTA_XNV_BUSY;
+  }
+
+#if HAL_OTA_XNV_PWR
+  // The last user left while an erase was pending.
+  if (xnvUsers == 0)
+  {
+    xnvSleep();
+  }
+#endif
+#endif
+
+  return HAL_OTA_XNV_IDLE;
+}
+
+/******************************************************************************
+ * @fn      HalOTARoom
+ *
+ * @brief   Number of DL bytes that can be written without waiting for the
+ *          pending erase, as of the last HalOTAPoll(): the room left in the
+ *          page buffer. Callers size what they ask for or write next to it.
+ *
+ * @param   None.
+ *
+ * @return  Bytes that can be queued behind the erase, 0xFFFF if none is pending.
+ */
+uint16 HalOTARoom(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  if (xnvBusy)
+  {
+#if HAL_OTA_XNV_PAGE_BUF
+    if (xnvPageLen)
+    {
+      return XNV_PAGE_SIZE - 1 - (uint16)((xnvPageAddr + xnvPageLen - 1) & (XNV_PAGE_SIZE - 1));
+    }
+
+    return XNV_PAGE_SIZE;
+#else
+    return 0;
+#endif
+  }
+#endif
+
+  return 0xFFFF;
+}
+
+/******************************************************************************
+ * @fn      HalOTAReady
+ *
+ * @brief   Check without blocking whether the external NV has settled: no erase
+ *          pending, the erase-ahead range done and no page program in progress.
+ *
+ * @param   None.
+ *
+ * @return  TRUE when the external NV is ready, FALSE otherwise.
+ */
+uint8 HalOTAReady(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  if (HalOTAPoll() != HAL_OTA_XNV_IDLE)
+  {
+    return FALSE;
+  }
+
+  if (!xnvPowerDown && (xnvReadStatus() & xnvChip->wipMask))
+  {
+    return FALSE;
+  }
+#endif
+
+  return TRUE;
+}
+
+/******************************************************************************
+ * @fn      HalOTAEraseAhead
+ *
+ * @brief   Erase a range of the DL image in the background, ahead of the writes
+ *          that will fill it. Each HalOTAPoll() that finds the flash idle starts
+ *          the next erase, using 64 KB and 32 KB block erases where aligned.
+ *          Writes that catch up with the erase-ahead fall back to erasing
+ *          their own sector. A range starting part way into a sector keeps
+ *          the bytes already written in front of it.
+ *
+ * @param   oset - Offset into the DL image where the range starts.
+ * @param   len - Length of the range, zero to cancel erasing ahead.
+ *
+ * @return  None.
+ */
+void HalOTAEraseAhead(uint32 oset, uint32 len)
+{
+#if HAL_OTA_XNV_IS_SPI
+  uint32 avail = HalOTAAvail();
+
+  if (oset > avail)
+  {
+    oset = avail;
+  }
+  if (len > avail - oset)
+  {
+    len = avail - oset;
+  }
+
+  oset += HAL_OTA_DL_OSET;
+  xnvAheadFrom = (oset + ERASE_SECTOR_SIZE - 1) & ~(ERASE_SECTOR_SIZE - 1);
+  xnvAheadNext = xnvAheadFrom;
+  xnvAheadEnd = (len) ? ((oset + len + ERASE_SECTOR_SIZE - 1) & ~(ERASE_SECTOR_SIZE - 1)) : xnvAheadFrom;
+  // A range starting part way into a sector carries on after what was written there.
+  lastErased = (oset == xnvAheadFrom) ? 0xFFFFFFFF : (oset & ~(ERASE_SECTOR_SIZE - 1));
+
+  (void)HalOTAPoll();
+#else
+  (void)oset;
+  (void)len;
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTAAvail
+ *
+ * @brief   Determine the space available for downloading an image.
+ *
+ * @param   None.
+ *
+ * @return  Number of bytes available for storing an OTA image.
+ */
+uint32 HalOTAAvail(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  // Up to the boot status and dl2rc() journal sector.
+  return XNV_STATUS_ADDR - HAL_OTA_DL_OSET;
+#else
+  return HAL_OTA_DL_MAX - HAL_OTA_DL_OSET;
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTAInit
+ *
+ * @brief   Initialize the SPI to the external NV and identify the part by its
+ *          JEDEC ID. Only the first call has any effect.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTAInit(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  if (!xnvInited)
+  {
+    XNV_SPI_INIT();
+    HalOTAAcquire();
+    xnvProbe();
+    HalOTARelease();
+    xnvInited = TRUE;
+  }
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTAAcquire
+ *
+ * @brief   Register a user of the external NV. The part is released from deep
+ *          power-down by the first access, not by this call.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTAAcquire(void)
+{
+#if HAL_OTA_XNV_IS_SPI && HAL_OTA_XNV_PWR
+  xnvUsers++;
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTARelease
+ *
+ * @brief   Unregister a user of the external NV. When the last user leaves, any
+ *          buffered data is programmed and the part enters deep power-down,
+ *          or does so from HalOTAPoll() once a pending erase has completed.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+void HalOTARelease(void)
+{
+#if HAL_OTA_XNV_IS_SPI && HAL_OTA_XNV_PWR
+  if (xnvUsers && (--xnvUsers == 0))
+  {
+    HalOTAFlush();
+    xnvSleep();
+  }
+#endif
+}
+
+/******************************************************************************
+ * @fn      HalOTABootStatus
+ *
+ * @brief   Read the record the boot code left of the last image instantiation.
+ *
+ * @param   None.
+ *
+ * @return  Pages written in the high byte and pages skipped in the low byte,
+ *          or HAL_OTA_BOOT_STATUS_NONE if there is no record.
+ */
+uint16 HalOTABootStatus(void)
+{
+#if HAL_OTA_XNV_IS_SPI
+  halOtaBootStatus_t status;
+
+  HalOTAAcquire();
+  HalSPIRead(XNV_STATUS_ADDR, (uint8 *)&status, sizeof(status));
+  HalOTARelease();
+
+  if (status.magic == HAL_OTA_BOOT_STATUS_MAGIC)
+  {
+    return BUILD_UINT16(status.skipped, status.written);
+  }
+#endif
+
+  return HAL_OTA_BOOT_STATUS_NONE;
+}
+
+/******************************************************************************
+ * @fn      HalOTAPwrStats
+ *
+ * @brief   Report the time the external NV has spent in each power state.
+ *
+ * @param   pActive - Milliseconds spent in standby or active.
+ * @param   pDown - Milliseconds spent in deep power-down.
+ *
+ * @return  None.
+ */
+void HalOTAPwrStats(uint32 *pActive, uint32 *pDown)
+{
+#if HAL_OTA_XNV_IS_SPI && HAL_OTA_XNV_PWR
+  xnvPwrState(xnvPowerDown);
+  *pActive = xnvPwrTime[0];
+  *pDown = xnvPwrTime[1];
+#else
+  *pActive = 0;
+  *pDown = 0;
+#endif
+}
+
+#if HAL_OTA_XNV_IS_SPI
+/******************************************************************************
+ * @fn      xnvSPIWrite
+ *
+ * @brief   SPI write sequence for code size savings.
+ *
+ * @param   ch - The byte to write to the SPI.
+ *
+ * @return  None.
+ */
+static void xnvSPIWrite(uint8 ch)
+{
+  XNV_SPI_TX(ch);
+  XNV_SPI_WAIT_RXRDY();
+}
+
+/******************************************************************************
+ * @fn      xnvSPIWaitIdle
+ *
+ * @brief   Wait until the external NV has finished its current program or erase.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvSPIWaitIdle(void)
+{
+  xnvWake();
+
+  XNV_SPI_BEGIN();
+  xnvSPIWrite(XNV_STAT_CMD);
+  do
+  {
+    xnvSPIWrite(0);
+  } while (XNV_SPI_RX() & xnvChip->wipMask);
+  XNV_SPI_END();
+  asm("NOP"); asm("NOP");
+
+  xnvBusy = FALSE;
+}
+
+/******************************************************************************
+ * @fn      xnvReadStatus
+ *
+ * @brief   Read the status register of the external NV once.
+ *
+ * @param   None.
+ *
+ * @return  The status register.
+ */
+static uint8 xnvReadStatus(void)
+{
+  uint8 status;
+#if !HAL_OTA_BOOT_CODE
+  uint8 shdw = P1DIR;
+  halIntState_t his;
+  HAL_ENTER_CRITICAL_SECTION(his);
+  P1DIR |= BV(3);
+#endif
+
+  XNV_SPI_BEGIN();
+  xnvSPIWrite(XNV_STAT_CMD);
+  xnvSPIWrite(0);
+  status = XNV_SPI_RX();
+  XNV_SPI_END();
+
+#if !HAL_OTA_BOOT_CODE
+  P1DIR = (P1DIR & ~BV(3)) | (shdw & BV(3));
+  HAL_EXIT_CRITICAL_SECTION(his);
+#endif
+
+  return status;
+}
+
+#if !HAL_OTA_BOOT_CODE
+/******************************************************************************
+ * @fn      xnvWaitReady
+ *
+ * @brief   Wait until the external NV has finished its current program or erase
+ *          with interrupts enabled, a status read at a time, so that the critical
+ *          section of the access that follows does not spin through an erase.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvWaitReady(void)
+{
+  xnvWake();
+
+  while (xnvReadStatus() & xnvChip->wipMask);
+
+  xnvBusy = FALSE;
+}
+#endif
+
+/******************************************************************************
+ * @fn      xnvWake
+ *
+ * @brief   Release the external NV from deep power-down if it is in it.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvWake(void)
+{
+  if (xnvPowerDown)
+  {
+    XNV_SPI_BEGIN();
+    xnvSPIWrite(XNV_RDP_CMD);
+    XNV_SPI_END();
+    xnvDelayUs(XNV_TRES1_US);
+
+    xnvPwrState(FALSE);
+  }
+}
+
+#if HAL_OTA_XNV_PWR
+/******************************************************************************
+ * @fn      xnvSleep
+ *
+ * @brief   Put the external NV in deep power-down unless an erase or the
+ *          erase-ahead still needs it.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvSleep(void)
+{
+  if (xnvPowerDown || xnvBusy || (xnvAheadNext < xnvAheadEnd))
+  {
+    return;
+  }
+
+  // Let a page program still in progress finish.
+  xnvSPIWaitIdle();
+
+  XNV_SPI_BEGIN();
+  xnvSPIWrite(XNV_DPD_CMD);
+  XNV_SPI_END();
+
+  xnvPwrState(TRUE);
+}
+#endif
+
+/******************************************************************************
+ * @fn      xnvPwrState
+ *
+ * @brief   Record a power state change of the external NV and account the
+ *          time spent in the previous state.
+ *
+ * @param   down - TRUE when entering deep power-down.
+ *
+ * @return  None.
+ */
+static void xnvPwrState(uint8 down)
+{
+#if HAL_OTA_XNV_PWR
+  uint32 now = osal_GetSystemClock();
+
+  xnvPwrTime[xnvPowerDown ? 1 : 0] += now - xnvPwrStamp;
+  xnvPwrStamp = now;
+#endif
+  xnvPowerDown = down;
+}
+
+#if HAL_OTA_BOOT_CODE
+#if HAL_CPU_CLOCK_MHZ > 32
+#error xnvDelayUs() spends 32 cycles per microsecond.
+#endif
+#define XNV_NOP8()  asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP"); \
+                    asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP")
+#endif
+
+/******************************************************************************
+ * @fn      xnvDelayUs
+ *
+ * @brief   Busy-wait for at least the given number of microseconds. The boot
+ *          code has no MicroWait(): a NOP takes one cycle, so 32 of them are a
+ *          microsecond at 32 MHz before the loop adds its own cycles.
+ *
+ * @param   us - Microseconds to wait.
+ *
+ * @return  None.
+ */
+static void xnvDelayUs(uint16 us)
+{
+#if HAL_OTA_BOOT_CODE
+  while (us--)
+  {
+    XNV_NOP8(); XNV_NOP8(); XNV_NOP8(); XNV_NOP8();
+  }
+#else
+  MicroWait(us);
+#endif
+}
+
+/******************************************************************************
+ * @fn      xnvProbe
+ *
+ * @brief   Read the JEDEC ID of the external NV and select its command set.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvProbe(void)
+{
+  uint8 id[3];
+  uint8 i;
+
+  xnvSPIWaitIdle();
+
+  XNV_SPI_BEGIN();
+  xnvSPIWrite(XNV_RDID_CMD);
+  for (i = 0; i < 3; i++)
+  {
+    xnvSPIWrite(0);
+    id[i] = XNV_SPI_RX();
   }
-  else
+  XNV_SPI_END();
+  asm("NOP"); asm("NOP");
+
+  xnvChip = xnvChips;
+  xnvCapacity = HAL_OTA_DL_MAX;
+
+  /* The capacity comes from the ID of any part, not only of those in the table, so that the
+   * boot code, which only has the generic entry, finds the same last sector as the application.
+   */
+  if ((id[2] >= XNV_CAP_CODE_MIN) && (id[2] <= XNV_CAP_CODE_MAX))
   {
-    oset += HAL_OTA_RC_START;
+    xnvCapacity = 1UL << id[2];
   }
 
-  HalFlashRead(oset / HAL_FLASH_PAGE_SIZE, oset % HAL_FLASH_PAGE_SIZE, pBuf, len);
+  for (i = 1; i < XNV_CHIP_CNT; i++)
+  {
+    if ((xnvChips[i].jedecId[0] == id[0]) && (xnvChips[i].jedecId[1] == id[1]) &&
+        (xnvChips[i].jedecId[2] == id[2]))
+    {
+      xnvChip = &xnvChips[i];
+      break;
+    }
+  }
+
+  LREP("[FLASH] JEDEC ID %02X %02X %02X, %d KB\r\n", id[0], id[1], id[2], (uint16)(xnvCapacity >> 10));
 }
 
+#if HAL_OTA_SPI_DMA
 /******************************************************************************
- * @fn      HalOTAWrite
+ * @fn      xnvSPIBurst
  *
- * @brief   Write to the storage medium according to the image type.
- *
- *  NOTE:   Destructive write on page boundary! When writing to the first flash word
- *          of a page boundary, the page is erased without saving/restoring the bytes not written.
- *          Writes anywhere else on a page assume that the location written to has been erased.
+ * @brief   Clock a burst of bytes through USART1 by DMA while XNV_SPI_BEGIN()
+ *          is in effect. Both channels are triggered by URX1: the RX channel
+ *          (high priority) stores the byte just received and the TX channel
+ *          then loads the next one, so U1DBUF is never overrun. The first TX
+ *          byte is started by a manual trigger. Interrupts may stay enabled.
  *
- * @param   oset - Offset into the monolithic image, aligned to HAL_FLASH_WORD_SIZE.
- * @param   pBuf - Pointer to the buffer in from which to write.
- * @param   len - Number of bytes to write. If not an even multiple of HAL_FLASH_WORD_SIZE,
- *                remainder bytes are overwritten with garbage.
- * @param   type - Which image: HAL_OTA_RC or HAL_OTA_DL.
+ * @param   pTx - Bytes to send, or NULL to send dummy bytes.
+ * @param   pRx - Buffer for the bytes received, or NULL to discard them.
+ * @param   len - Number of bytes in the burst.
  *
  * @return  None.
  */
-
-void HalOTAWrite(uint32 oset, uint8 *pBuf, uint16 len, image_t type)
+static void xnvSPIBurst(uint8 *pTx, uint8 *pRx, uint16 len)
 {
-  if (HAL_OTA_RC != type)
+  while (len)
   {
-#if HAL_OTA_XNV_IS_INT
-    oset += HAL_OTA_RC_START + HAL_OTA_DL_OSET;
-#elif HAL_OTA_XNV_IS_SPI
-    
-    uint32 eraseStart = oset & ~(ERASE_SECTOR_SIZE - 1);
-    if (eraseStart != lastErased) {
-      HalSPIEraseSector4K(eraseStart);
-      uint8 raw[4];
-      osal_buffer_uint32( raw, eraseStart );
-      LREP("[FLASH] ERASE 4K at 0x%02X%02X%02X%02X\r\n", raw[3], raw[2], raw[1], raw[0]);
-      lastErased = eraseStart;
-    }  
-    
-    oset += HAL_OTA_DL_OSET;
-    HalSPIWrite(oset, pBuf, len);
-    
-    LREPMaster("HalOTAWrite\r\n");
+    uint16 cnt = (len > XNV_DMA_MAX_LEN) ? XNV_DMA_MAX_LEN : len;
 
-    return;
-#endif
-  }
-  else
-  {
-    oset += HAL_OTA_RC_START;
-  }
+    xnvSPIBurstStart(pTx, pRx, cnt);
+    xnvSPIBurstWait();
 
-  if ((oset % HAL_FLASH_PAGE_SIZE) == 0)
-  {
-    HalFlashErase(oset / HAL_FLASH_PAGE_SIZE);
+    if (pTx)
+    {
+      pTx += cnt;
+    }
+    if (pRx)
+    {
+      pRx += cnt;
+    }
+    len -= cnt;
   }
+}
+#endif
 
-  HalFlashWrite(oset / HAL_FLASH_WORD_SIZE, pBuf, len / HAL_FLASH_WORD_SIZE);
+#if HAL_OTA_SPI_DMA || HAL_OTA_BOOT_DMA
+/******************************************************************************
+ * @fn      xnvSPIBurstStart
+ *
+ * @brief   Set up and trigger the DMA of one burst for xnvSPIBurst() without
+ *          waiting for it to complete.
+ *
+ * @param   pTx - Bytes to send, or NULL to send dummy bytes.
+ * @param   pRx - Buffer for the bytes received, or NULL to discard them.
+ * @param   len - Number of bytes in the burst, at most XNV_DMA_MAX_LEN.
+ *
+ * @return  None.
+ */
+static void xnvSPIBurstStart(uint8 *pTx, uint8 *pRx, uint16 len)
+{
+  static uint8 dummy;
+  halDMADesc_t *ch;
+
+  dummy = 0;
+
+  ch = HAL_DMA_GET_DESC1234(HAL_XNV_DMA_CH_RX);
+  HAL_DMA_SET_SOURCE(ch, &X_U1DBUF);
+  HAL_DMA_SET_DEST(ch, (pRx) ? pRx : &dummy);
+  HAL_DMA_SET_VLEN(ch, HAL_DMA_VLEN_USE_LEN);
+  HAL_DMA_SET_LEN(ch, len);
+  HAL_DMA_SET_WORD_SIZE(ch, HAL_DMA_WORDSIZE_BYTE);
+  HAL_DMA_SET_TRIG_MODE(ch, HAL_DMA_TMODE_SINGLE);
+  HAL_DMA_SET_TRIG_SRC(ch, HAL_DMA_TRIG_URX1);
+  HAL_DMA_SET_SRC_INC(ch, HAL_DMA_SRCINC_0);
+  HAL_DMA_SET_DST_INC(ch, (pRx) ? HAL_DMA_DSTINC_1 : HAL_DMA_DSTINC_0);
+  HAL_DMA_SET_IRQ(ch, HAL_DMA_IRQMASK_DISABLE);
+  HAL_DMA_SET_M8(ch, HAL_DMA_M8_USE_8_BITS);
+  HAL_DMA_SET_PRIORITY(ch, HAL_DMA_PRI_HIGH);
+
+  ch = HAL_DMA_GET_DESC1234(HAL_XNV_DMA_CH_TX);
+  HAL_DMA_SET_SOURCE(ch, (pTx) ? pTx : &dummy);
+  HAL_DMA_SET_DEST(ch, &X_U1DBUF);
+  HAL_DMA_SET_VLEN(ch, HAL_DMA_VLEN_USE_LEN);
+  HAL_DMA_SET_LEN(ch, len);
+  HAL_DMA_SET_WORD_SIZE(ch, HAL_DMA_WORDSIZE_BYTE);
+  HAL_DMA_SET_TRIG_MODE(ch, HAL_DMA_TMODE_SINGLE);
+  HAL_DMA_SET_TRIG_SRC(ch, HAL_DMA_TRIG_URX1);
+  HAL_DMA_SET_SRC_INC(ch, (pTx) ? HAL_DMA_SRCINC_1 : HAL_DMA_SRCINC_0);
+  HAL_DMA_SET_DST_INC(ch, HAL_DMA_DSTINC_0);
+  HAL_DMA_SET_IRQ(ch, HAL_DMA_IRQMASK_DISABLE);
+  HAL_DMA_SET_M8(ch, HAL_DMA_M8_USE_8_BITS);
+  HAL_DMA_SET_PRIORITY(ch, HAL_DMA_PRI_LOW);
+
+  HAL_DMA_ARM_CH(HAL_XNV_DMA_CH_RX);
+  HAL_DMA_ARM_CH(HAL_XNV_DMA_CH_TX);
+  // A channel needs 9 cycles after arming before it accepts a trigger.
+  asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP");
+  asm("NOP"); asm("NOP"); asm("NOP"); asm("NOP");
+
+  HAL_DMA_MAN_TRIGGER(HAL_XNV_DMA_CH_TX);
 }
 
 /******************************************************************************
- * @fn      HalOTAAvail
+ * @fn      xnvSPIBurstWait
  *
- * @brief   Determine the space available for downloading an image.
+ * @brief   Wait for the burst started by xnvSPIBurstStart() to complete.
  *
  * @param   None.
  *
- * @return  Number of bytes available for storing an OTA image.
+ * @return  None.
  */
-uint32 HalOTAAvail(void)
+static void xnvSPIBurstWait(void)
 {
-  return HAL_OTA_DL_MAX - HAL_OTA_DL_OSET;
+  while (DMAARM & BV(HAL_XNV_DMA_CH_RX));
 }
+#endif
 
-#if HAL_OTA_XNV_IS_SPI
+#if HAL_OTA_BOOT_DMA
 /******************************************************************************
- * @fn      xnvSPIWrite
+ * @fn      xnvSPIReadStart
  *
- * @brief   SPI write sequence for code size savings.
+ * @brief   Start a read from the external NV whose data phase runs by DMA in
+ *          the background. Complete it with xnvSPIReadEnd().
  *
- * @param   ch - The byte to write to the SPI.
+ * @param   addr - Offset into the external NV.
+ * @param   pBuf - Pointer to buffer to copy the bytes read from external NV.
+ * @param   len - Number of bytes to read, at most XNV_DMA_MAX_LEN.
  *
  * @return  None.
  */
-static void xnvSPIWrite(uint8 ch)
+static void xnvSPIReadStart(uint32 addr, uint8 *pBuf, uint16 len)
 {
-  XNV_SPI_TX(ch);
-  XNV_SPI_WAIT_RXRDY();
+  xnvSPIWaitIdle();
+
+  XNV_SPI_BEGIN();
+  xnvSPIWrite(xnvChip->readCmd);
+  xnvSPIWrite(addr >> 16);
+  xnvSPIWrite(addr >> 8);
+  xnvSPIWrite(addr);
+  for (uint8 i = 0; i < xnvChip->readDummy; i++)
+  {
+    xnvSPIWrite(0);
+  }
+
+  xnvSPIBurstStart(NULL, pBuf, len);
+}
+
+/******************************************************************************
+ * @fn      xnvSPIReadEnd
+ *
+ * @brief   Wait for the read started by xnvSPIReadStart() and end the transaction.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvSPIReadEnd(void)
+{
+  xnvSPIBurstWait();
+  XNV_SPI_END();
 }
+#endif
 
 /******************************************************************************
  * @fn      HalSPIRead
@@ -496,26 +2673,38 @@ static void xnvSPIWrite(uint8 ch)
 static void HalSPIRead(uint32 addr, uint8 *pBuf, uint16 len)
 {
 #if !HAL_OTA_BOOT_CODE
-  uint8 shdw = P1DIR;
+  uint8 shdw;
   halIntState_t his;
+
+  xnvWaitReady();
+
+  shdw = P1DIR;
   HAL_ENTER_CRITICAL_SECTION(his);
   P1DIR |= BV(3);
 #endif
 
-  XNV_SPI_BEGIN();
-  do
-  {
-    xnvSPIWrite(XNV_STAT_CMD);
-  } while (XNV_SPI_RX() & XNV_STAT_WIP);
-  XNV_SPI_END();
-  asm("NOP"); asm("NOP");
+  xnvSPIWaitIdle();
 
   XNV_SPI_BEGIN();
-  xnvSPIWrite(XNV_READ_CMD);
+  xnvSPIWrite(xnvChip->readCmd);
   xnvSPIWrite(addr >> 16);
   xnvSPIWrite(addr >> 8);
   xnvSPIWrite(addr);
-  xnvSPIWrite(0); //for READ DATA BYTES at HIGHER SPEED
+  for (uint8 i = 0; i < xnvChip->readDummy; i++)
+  {
+    xnvSPIWrite(0);
+  }
+
+#if HAL_OTA_SPI_DMA
+  if (len >= XNV_DMA_MIN_LEN)
+  {
+    // The chip select keeps the transaction intact, so let interrupts run during the burst.
+    HAL_EXIT_CRITICAL_SECTION(his);
+    xnvSPIBurst(NULL, pBuf, len);
+    HAL_ENTER_CRITICAL_SECTION(his);
+    len = 0;
+  }
+#endif
 
   while (len--)
   {
@@ -525,7 +2714,7 @@ static void HalSPIRead(uint32 addr, uint8 *pBuf, uint16 len)
   XNV_SPI_END();
 
 #if !HAL_OTA_BOOT_CODE
-  P1DIR = shdw;
+  P1DIR = (P1DIR & ~BV(3)) | (shdw & BV(3));
   HAL_EXIT_CRITICAL_SECTION(his);
 #endif
 }
@@ -619,12 +2808,13 @@ static void HalSPIWrite(uint32 addr, uint8 *pBuf, uint16 len)
 
   while (len > 0)
   {
-    XNV_SPI_BEGIN();
-    do {
-      xnvSPIWrite(XNV_STAT_CMD);
-    } while (XNV_SPI_RX() & XNV_STAT_WIP);
-    XNV_SPI_END();
-    asm("NOP"); asm("NOP");
+#if !HAL_OTA_BOOT_CODE
+    // Wait out an erase or the previous page program with interrupts enabled.
+    HAL_EXIT_CRITICAL_SECTION(his);
+    xnvWaitReady();
+    HAL_ENTER_CRITICAL_SECTION(his);
+#endif
+    xnvSPIWaitIdle();
 
     XNV_SPI_BEGIN();
     xnvSPIWrite(XNV_WREN_CMD);
@@ -637,9 +2827,19 @@ static void HalSPIWrite(uint32 addr, uint8 *pBuf, uint16 len)
     xnvSPIWrite(addr >> 8);
     xnvSPIWrite(addr);
 
-    uint16 cnt = 256 - (addr & 0xFF);
+    uint16 cnt = xnvChip->pageSize - (uint16)(addr & (xnvChip->pageSize - 1));
     if (cnt > len) cnt = len;
 
+#if HAL_OTA_SPI_DMA
+    if (cnt >= XNV_DMA_MIN_LEN)
+    {
+      HAL_EXIT_CRITICAL_SECTION(his);
+      xnvSPIBurst(pBuf, NULL, cnt);
+      HAL_ENTER_CRITICAL_SECTION(his);
+      pBuf += cnt;
+    }
+    else
+#endif
     for (uint16 i = 0; i < cnt; i++) {
       xnvSPIWrite(*pBuf++);
     }
@@ -651,22 +2851,26 @@ static void HalSPIWrite(uint32 addr, uint8 *pBuf, uint16 len)
   }
 
 #if !HAL_OTA_BOOT_CODE
-  P1DIR = shdw;
+  P1DIR = (P1DIR & ~BV(3)) | (shdw & BV(3));
   HAL_EXIT_CRITICAL_SECTION(his);
 #endif
 }
 
 
+/******************************************************************************
+ * @fn      HalSPIEraseChip
+ *
+ * @brief   Start erasing the whole external NV. Returns without waiting, the
+ *          erase is complete when HalOTAPoll() returns HAL_OTA_XNV_IDLE.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ *****************************************************************************/
 void HalSPIEraseChip(void)
 {
-    XNV_SPI_BEGIN();
-    do
-    {
-      xnvSPIWrite(XNV_STAT_CMD);
-    } while (XNV_SPI_RX() & XNV_STAT_WIP);
-    XNV_SPI_END();
-    asm("NOP"); asm("NOP");
-    
+    xnvSPIWaitIdle();
+
     XNV_SPI_BEGIN();
     xnvSPIWrite(XNV_WREN_CMD);
     XNV_SPI_END();
@@ -676,60 +2880,214 @@ void HalSPIEraseChip(void)
     xnvSPIWrite(XNV_BE_CMD);
     XNV_SPI_END();
     asm("NOP"); asm("NOP");
-    
-    XNV_SPI_BEGIN();
-    do
-    {
-      xnvSPIWrite(XNV_STAT_CMD);
-    } while (XNV_SPI_RX() & XNV_STAT_WIP);
-    XNV_SPI_END();
-    asm("NOP"); asm("NOP");
-    DelayMs(5000);
+
+    xnvBusy = TRUE;
+    lastErased = 0xFFFFFFFF;
+    xnvAheadFrom = xnvAheadNext = xnvAheadEnd = 0;
 }
 
-static void HalSPIEraseSector4K(uint32 addr)
+/******************************************************************************
+ * @fn      HalSPIErase
+ *
+ * @brief   Start erasing one sector or block of the external NV. Returns without
+ *          waiting; the next SPI access or HalOTAPoll() completes the erase.
+ *
+ * @param   cmd - Sector or block erase opcode of the xnvChip.
+ * @param   addr - Address of the sector or block in the external NV.
+ *
+ * @return  None.
+ *****************************************************************************/
+static void HalSPIErase(uint8 cmd, uint32 addr)
 {
-    XNV_SPI_BEGIN();
-    do
-    {
-      xnvSPIWrite(XNV_STAT_CMD);
-    } while (XNV_SPI_RX() & XNV_STAT_WIP);
-    XNV_SPI_END();
-    asm("NOP"); asm("NOP");
-    
+    xnvSPIWaitIdle();
+
     XNV_SPI_BEGIN();
     xnvSPIWrite(XNV_WREN_CMD);
     XNV_SPI_END();
     asm("NOP"); asm("NOP");
 
     XNV_SPI_BEGIN();
-    xnvSPIWrite(XNV_SE_CMD);
+    xnvSPIWrite(cmd);
     xnvSPIWrite(addr >> 16);
     xnvSPIWrite(addr >> 8);
     xnvSPIWrite(addr);
     XNV_SPI_END();
     asm("NOP"); asm("NOP");
-    
-    XNV_SPI_BEGIN();
-    do
+
+    xnvBusy = TRUE;
+}
+
+/******************************************************************************
+ * @fn      xnvEraseAheadStep
+ *
+ * @brief   Advance the erase-ahead range by one step: skip the next sector
+ *          if it is already blank, otherwise start the largest aligned erase
+ *          that fits. The first sector is erased on its own so that the first
+ *          block written does not wait for a block erase.
+ *
+ * @param   None.
+ *
+ * @return  None.
+ */
+static void xnvEraseAheadStep(void)
+{
+  uint32 left = xnvAheadEnd - xnvAheadNext;
+  uint32 size = ERASE_SECTOR_SIZE;
+  uint8 cmd = xnvChip->seCmd;
+
+  if (xnvBlankCheck(xnvAheadNext, ERASE_SECTOR_SIZE))
+  {
+    xnvAheadNext += ERASE_SECTOR_SIZE;
+    return;
+  }
+
+  if (xnvAheadNext != xnvAheadFrom)
+  {
+    if (xnvChip->be64Cmd && ((xnvAheadNext & (ERASE_BLOCK64_SIZE - 1)) == 0) &&
+        (left >= ERASE_BLOCK64_SIZE))
     {
-      xnvSPIWrite(XNV_STAT_CMD);
-    } while (XNV_SPI_RX() & XNV_STAT_WIP);
-    XNV_SPI_END();
-    asm("NOP"); asm("NOP");
-    DelayMs(100);
+      size = ERASE_BLOCK64_SIZE;
+      cmd = xnvChip->be64Cmd;
+    }
+    else if (xnvChip->be32Cmd && ((xnvAheadNext & (ERASE_BLOCK32_SIZE - 1)) == 0) &&
+             (left >= ERASE_BLOCK32_SIZE))
+    {
+      size = ERASE_BLOCK32_SIZE;
+      cmd = xnvChip->be32Cmd;
+    }
+  }
+
+  HalSPIErase(cmd, xnvAheadNext);
+  uint8 raw[4];
+  osal_buffer_uint32( raw, xnvAheadNext );
+  LREP("[FLASH] ERASE %dK ahead at 0x%02X%02X%02X%02X\r\n", (uint16)(size >> 10), raw[3], raw[2], raw[1], raw[0]);
+  xnvAheadNext += size;
+}
+
+/******************************************************************************
+ * @fn      xnvSectorPrep
+ *
+ * @brief   Erase the sector containing addr unless it was the last one erased
+ *          or the erase-ahead has already reached it.
+ *
+ * @param   addr - Address in the external NV about to be written.
+ *
+ * @return  None.
+ */
+static void xnvSectorPrep(uint32 addr)
+{
+  uint32 eraseStart = addr & ~(ERASE_SECTOR_SIZE - 1);
+
+  if ((eraseStart >= xnvAheadFrom) && (eraseStart < xnvAheadEnd))
+  {
+    if (eraseStart < xnvAheadNext)
+    {
+      return;
+    }
+    else if (eraseStart == xnvAheadNext)
+    {
+      // The writes caught up with the erase-ahead, take this sector from it.
+      xnvAheadNext += ERASE_SECTOR_SIZE;
+    }
+    else
+    {
+      // Out of order write: leave the rest of the range to be erased on demand.
+      xnvAheadEnd = xnvAheadNext;
+    }
+  }
+
+  if (eraseStart != lastErased) {
+    // Anything still buffered belongs to another sector and must not wait behind this erase.
+    HalOTAFlush();
+    lastErased = eraseStart;
+
+    if (xnvBlankCheck(eraseStart, ERASE_SECTOR_SIZE))
+    {
+      return;
+    }
+
+    HalSPIErase(xnvChip->seCmd, eraseStart);
+    uint8 raw[4];
+    osal_buffer_uint32( raw, eraseStart );
+    LREP("[FLASH] ERASE 4K at 0x%02X%02X%02X%02X\r\n", raw[3], raw[2], raw[1], raw[0]);
+  }
 }
 
-static void DelayMs(uint16 delaytime) {
-  while(delaytime--)
+/******************************************************************************
+ * @fn      xnvBlankCheck
+ *
+ * @brief   Check whether a range of the external NV is erased, stopping at the
+ *          first programmed byte. Reading a sector takes a few milliseconds,
+ *          erasing it takes tens to hundreds.
+ *
+ * @param   addr - Address in the external NV.
+ * @param   len - Number of bytes to check.
+ *
+ * @return  TRUE if every byte reads 0xFF, FALSE otherwise.
+ */
+static uint8 xnvBlankCheck(uint32 addr, uint16 len)
+{
+  uint8 buf[XNV_BLANK_CHUNK];
+
+  while (len)
   {
-    uint16 microSecs = 1000;
-    while(microSecs--)
+    uint8 cnt = (len > XNV_BLANK_CHUNK) ? XNV_BLANK_CHUNK : (uint8)len;
+    uint8 i;
+
+    HalSPIRead(addr, buf, cnt);
+
+    for (i = 0; i < cnt; i++)
     {
-      asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop"); asm("nop");
+      if (buf[i] != 0xFF)
+      {
+        return FALSE;
+      }
     }
+
+    addr += cnt;
+    len -= cnt;
+  }
+
+  return TRUE;
+}
+
+#if HAL_OTA_XNV_PAGE_BUF
+/******************************************************************************
+ * @fn      xnvPageWrite
+ *
+ * @brief   Append bytes to the page buffer, programming it when the page is
+ *          complete or when the new bytes do not continue the buffered run.
+ *          A complete page held behind a pending erase is programmed, waiting
+ *          for the erase, before bytes of the next page are buffered.
+ *
+ * @param   addr - Address in the external NV.
+ * @param   pBuf - Pointer to the bytes to write.
+ * @param   len - Number of bytes, not crossing a page boundary.
+ *
+ * @return  None.
+ */
+static void xnvPageWrite(uint32 addr, uint8 *pBuf, uint16 len)
+{
+  if (xnvPageLen && ((addr != xnvPageAddr + xnvPageLen) || ((addr & (XNV_PAGE_SIZE - 1)) == 0)))
+  {
+    HalOTAFlush();
+  }
+
+  if (xnvPageLen == 0)
+  {
+    xnvPageAddr = addr;
+  }
+
+  osal_memcpy(xnvPageBuf + xnvPageLen, pBuf, len);
+  xnvPageLen += len;
+
+  // A complete page waits in the buffer for a pending erase, see HalOTAPoll().
+  if (!xnvBusy && (((xnvPageAddr + xnvPageLen) & (XNV_PAGE_SIZE - 1)) == 0))
+  {
+    HalOTAFlush();
   }
 }
+#endif
 
 #elif !HAL_OTA_XNV_IS_INT
 #error Invalid Xtra-NV for OTA.
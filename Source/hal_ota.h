@@ -67,6 +67,26 @@
 #define HAL_OTA_CRC_ADDR           0x0888
 #define HAL_OTA_CRC_OSET          (HAL_OTA_CRC_ADDR - HAL_OTA_RC_START)
 
+/* The top byte of the program size in the CRC control block selects the checksum type so that
+ * images made by OtaConverter (type 0) keep working; ota_crc.py re-stamps an image as type 1.
+ * The boot code checks the image again before it runs it, and stock boot code only knows type 0:
+ * set HAL_OTA_BOOT_CRC_HW only once the devices run boot code built from this tree, or a type 1
+ * image passes the download and then never boots.
+ */
+#define HAL_OTA_CRC_SIZE_MASK      0x00FFFFFF
+#define HAL_OTA_CRC_TYPE(size)    ((uint8)((size) >> 24))
+#define HAL_OTA_CRC_TYPE_1021      0x00  // Software CRC16, polynomial 0x1021 (runPoly).
+#define HAL_OTA_CRC_TYPE_HW        0x01  // CC2530 RNDL/RNDH CRC16, polynomial 0x8005.
+
+#if !defined HAL_OTA_BOOT_CRC_HW
+#define HAL_OTA_BOOT_CRC_HW        HAL_OTA_BOOT_CODE
+#endif
+#if HAL_OTA_BOOT_CRC_HW
+#define HAL_OTA_CRC_TYPE_MAX       HAL_OTA_CRC_TYPE_HW
+#else
+#define HAL_OTA_CRC_TYPE_MAX       HAL_OTA_CRC_TYPE_1021
+#endif
+
 /* Note that corresponding changes must be made to ota.xcl when changing the source of Xtra-NV.
  * When using internal flash for XNV, (HAL_OTA_BOOT_PG_CNT + HAL_NV_PAGE_CNT) must be even.
  */
@@ -95,6 +115,65 @@
 
 #define PREAMBLE_OFFSET            0x8C
 
+/* The boot code leaves a record of the last image instantiation in the last 4 KB sector of
+ * the external NV, sized by its JEDEC ID, past the end of any DL image. HalOTABootStatus()
+ * returns it.
+ */
+#if HAL_OTA_XNV_IS_SPI
+#define HAL_OTA_BOOT_STATUS_MAGIC  0xB057
+#endif
+#define HAL_OTA_BOOT_STATUS_NONE   0xFFFF
+
+/* Chunk size of the streaming image reader; every chunk costs one HalOTARead() transaction.
+ * dl2rc() programs a chunk at a time, so it must divide HAL_FLASH_PAGE_SIZE.
+ */
+#if !defined HAL_OTA_STREAM_LEN
+#if HAL_OTA_BOOT_CODE
+#define HAL_OTA_STREAM_LEN         64
+#else
+#define HAL_OTA_STREAM_LEN         128
+#endif
+#endif
+
+/* Largest block the OTA client writes at a time. HalOTAPoll() reports HAL_OTA_XNV_STALL unless
+ * the page buffer has room for one more behind a pending erase. A block that fits in one frame
+ * is shorter than an 802.15.4 frame, larger ones (up to 241 bytes) need fragmentation.
+ */
+#if !defined HAL_OTA_BLOCK_MAX
+#if defined ZIGBEE_FRAGMENTATION
+#define HAL_OTA_BLOCK_MAX          241
+#else
+#define HAL_OTA_BLOCK_MAX          127
+#endif
+#endif
+
+// HalOTAPoll() results.
+#define HAL_OTA_XNV_IDLE           0  // No erase pending.
+#define HAL_OTA_XNV_BUSY           1  // Erase pending, writes are queued behind it.
+#define HAL_OTA_XNV_STALL          2  // Erase pending, the next write would wait for it.
+
+/* Payload of a delta image element, little-endian: a halOtaDeltaHdr_t followed by ops
+ * that rebuild the program image from the running one, up to HAL_OTA_DELTA_END.
+ *   HAL_OTA_DELTA_COPY    uint32 src, uint16 len: bytes of the running program image.
+ *   HAL_OTA_DELTA_INSERT  uint16 len, then len literal bytes.
+ * ota_delta.py makes the element.
+ */
+#define HAL_OTA_DELTA_MAGIC        0xDE17
+#define HAL_OTA_DELTA_END          0x00
+#define HAL_OTA_DELTA_COPY         0x01
+#define HAL_OTA_DELTA_INSERT       0x02
+
+/* Payload of a compressed image element: the uint32 length of the program image, little-endian,
+ * then the program image as one LZ4 block (no frame). ota_lz4.py makes the element.
+ */
+#define HAL_OTA_LZ4_MIN_MATCH      4
+
+// HalOTADeltaStep() and HalOTALz4Feed() results.
+#define HAL_OTA_BUILD_BUSY         0  // More to do, call again.
+#define HAL_OTA_BUILD_DONE         1  // The upgrade image element is complete, see HalOTACrcCheck().
+#define HAL_OTA_BUILD_FAIL         2  // The element is corrupt or does not fit.
+#define HAL_OTA_BUILD_WAIT         3  // Yielded to the flash with the input taken, see HalOTALz4Resume().
+
 /*********************************************************************
  * TYPEDEFS
  */
@@ -117,15 +196,75 @@ typedef struct {
   uint32 imageVersion;
 } preamble_t;
 
+typedef struct {
+  uint32 oset;      // Image offset of the next chunk to fetch.
+  uint32 left;      // Bytes not fetched yet.
+  uint16 pos;       // Next unconsumed byte in buf.
+  uint16 cnt;       // Valid bytes in buf.
+  image_t type;
+  uint8 buf[HAL_OTA_STREAM_LEN];
+} halOtaStream_t;
+
+typedef struct {
+  uint16 magic;     // HAL_OTA_BOOT_STATUS_MAGIC
+  uint8 written;    // Flash pages erased and programmed by dl2rc().
+  uint8 skipped;    // Flash pages that already matched the DL image and were left alone.
+} halOtaBootStatus_t;
+
+typedef struct {
+  uint16 magic;     // HAL_OTA_DELTA_MAGIC
+  uint16 srcCrc;    // CRC of the running image the patch was made against.
+  uint32 targetLen; // Length of the program image it rebuilds.
+} halOtaDeltaHdr_t;
+
+// Running CRC and LZ4 expansion state of a download, see HalOTABuildSave().
+typedef struct {
+  uint32 crcPos;
+  uint16 crcRun[2];
+  uint16 crc[2];
+  uint32 programSize;
+  uint32 lz4RawLen;
+  uint32 lz4Produced;
+  uint32 lz4RunLen;
+  uint16 lz4MatchOset;
+  uint8 lz4Token;
+  uint8 lz4State;
+} halOtaBuildState_t;
+
 /*********************************************************************
  * FUNCTIONS
  */
 
+void HalOTAInit(void);
 uint8 HalOTAChkDL(uint8 dlImagePreambleOffset);
+void HalOTACrcStart(void);
+void HalOTACrcUpdate(uint8 *pBuf, uint16 len);
+uint8 HalOTACrcCheck(void);
 void HalOTAInvRC(void);
 uint32 HalOTAAvail(void);
 void HalOTARead(uint32 oset, uint8 *pBuf, uint16 len, image_t type);
 void HalOTAWrite(uint32 oset, uint8 *pBuf, uint16 len, image_t type);
+void HalOTAStreamOpen(halOtaStream_t *pStream, uint32 oset, uint32 len, image_t type);
+uint16 HalOTAStreamSpan(halOtaStream_t *pStream, uint8 **ppBuf, uint16 max);
+uint16 HalOTAStreamGet(halOtaStream_t *pStream, uint8 *pBuf, uint16 len);
+void HalOTAFlush(void);
+uint8 HalOTAPoll(void);
+uint16 HalOTARoom(void);
+uint8 HalOTAReady(void);
+void HalOTAEraseAhead(uint32 oset, uint32 len);
+void HalOTAAcquire(void);
+void HalOTARelease(void);
+void HalOTAPwrStats(uint32 *pActive, uint32 *pDown);
+uint16 HalOTABootStatus(void);
+uint8 HalOTADeltaStart(uint32 patchOset, uint32 patchLen, uint32 outOset);
+uint8 HalOTADeltaStep(void);
+void HalOTADeltaStop(void);
+void HalOTALz4Start(void);
+uint8 HalOTALz4Feed(uint8 *pBuf, uint16 len, uint32 *pOset);
+uint8 HalOTALz4Resume(uint32 *pOset);
+void HalOTALz4Stop(void);
+void HalOTABuildSave(halOtaBuildState_t *pState);
+void HalOTABuildLoad(halOtaBuildState_t *pState);
 
 void HalSPIEraseChip(void);
 #endif
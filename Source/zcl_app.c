@@ -364,19 +364,23 @@ void DelayMs(unsigned int delaytime) {
  */
 static void zclApp_ProcessOTAMsgs( zclOTA_CallbackMsg_t* pMsg )
 {
+#if !OTA_FAST_POLL
   uint8 RxOnIdle;
+#endif
 
   switch(pMsg->ota_event)
   {
   case ZCL_OTA_START_CALLBACK:
+#if !OTA_FAST_POLL
     if (pMsg->hdr.status == ZSuccess)
     {
       // Speed up the poll rate
       RxOnIdle = TRUE;
       ZMacSetReq( ZMacRxOnIdle, &RxOnIdle );
-//      NLME_SetPollRate( 2000 );
       NLME_SetPollRate(DEVICE_POLL_RATE_DL);
     }
+#endif
+    // Otherwise the OTA client polls fast around each block request itself
     break;
 
   case ZCL_OTA_DL_COMPLETE_CALLBACK:
@@ -391,8 +395,10 @@ static void zclApp_ProcessOTAMsgs( zclOTA_CallbackMsg_t* pMsg )
     {
 #if (ZG_BUILD_ENDDEVICE_TYPE)    
       // slow the poll rate back down.
+#if !OTA_FAST_POLL
       RxOnIdle = FALSE;
       ZMacSetReq( ZMacRxOnIdle, &RxOnIdle );
+#endif
       NLME_SetPollRate(DEVICE_POLL_RATE);
 #endif
     }
@@ -54,6 +54,10 @@
 #include "MT_OTA.h"
 #include "ZDProfile.h"
 #include "ZDObject.h"
+#include "ZDApp.h"
+#include "nwk.h"
+
+#include "Debug.h"
 
 #if defined ( INTER_PAN )
 #include "stub_aps.h"
@@ -73,10 +77,67 @@
 #define OTA_MAX_TRANSACTIONS        4
 #define OTA_TRANSACTION_EXPIRATION  1500
 
+// The flash only keeps room behind an erase for blocks up to HAL_OTA_BLOCK_MAX
+#if OTA_BLOCK_SIZE > HAL_OTA_BLOCK_MAX
+#error "OTA_BLOCK_SIZE is larger than HAL_OTA_BLOCK_MAX."
+#endif
+
 #define ZCL_OTA_HDR_LEN_OFFSET      6  // Header length location in OTA upgrade image
 #define ZCL_OTA_STK_VER_OFFSET      18 // Stack version location in OTA upgrade image
 
 #define OTA_NEW_IMAGE_QUERY_RATE    30000 // ms - 5 minutes
+
+#define ZCL_OTA_ZCL_HDR_LEN         3  // Frame control, sequence number, command ID
+#define ZCL_OTA_CKPT_MAGIC          0xC4E7
+#define OTA_FRAG_BLOCK_SIZE         ( 0xFF - PAYLOAD_MAX_LEN_IMAGE_BLOCK_RSP )
+
+/******************************************************************************
+ * TYPEDEFS
+ */
+#if (defined OTA_CLIENT) && (OTA_CLIENT == TRUE) && OTA_RESUME
+// Download state saved in NV, everything zclOTA_ProcessImageData() carries from block to block
+typedef struct
+{
+  uint16 magic;                 // ZCL_OTA_CKPT_MAGIC
+  zclOTA_FileID_t fileId;
+  uint32 imageSize;
+  uint32 fileOffset;
+  uint32 dlOffset;
+  uint32 elementLen;
+  uint32 elementPos;
+  uint32 deltaOset;
+  uint32 deltaLen;
+  uint16 headerLen;
+  uint16 elementTag;
+  uint16 stackVersion;
+  uint8 pdState;
+  halOtaBuildState_t build;
+} zclOTA_Checkpoint_t;
+#endif
+
+#if (defined OTA_CLIENT) && (OTA_CLIENT == TRUE) && ( OTA_WINDOW > 1 )
+// Outstanding Image Block Request, then the block it brought in ahead of order
+typedef struct
+{
+  uint32 offset;                // File offset asked for
+  uint32 sent;                  // osal_GetSystemClock() when asked for
+  uint8 len;                    // Bytes asked for, bytes held once received
+} zclOTA_WinSlot_t;
+#endif
+
+#if (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+// Image Page Request being streamed, one client at a time
+typedef struct
+{
+  afAddrType_t addr;
+  zclOTA_FileID_t fileId;
+  uint32 offset;                // Next block read from the OTA Console
+  uint32 end;                   // End of the page, 0 if none is being streamed
+  uint16 spacing;               // ms between block responses
+  uint8 blockLen;
+} zclOTA_PageStream_t;
+#endif // (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+
 /******************************************************************************
  * GLOBAL VARIABLES
  */
@@ -131,6 +192,10 @@ uint16 zclOTA_ManufacturerID;
 uint16 zclOTA_ImageTypeID;
 uint16 zclOTA_MinBlockReqDelay = 0;
 uint32 zclOTA_ImageStamp;
+uint16 zclOTA_BootStatus = HAL_OTA_BOOT_STATUS_NONE;
+uint16 zclOTA_DownloadRate;
+uint16 zclOTA_BlockLosses;
+uint8 zclOTA_DelayHistory[1 + OTA_DELAY_HISTORY_LEN * 2];  // length, then one uint16 per OTA_RATE_PERIOD
 
 // Other OTA variables
 uint16 zclOTA_ManufacturerId;                           // Manufacturer ID
@@ -164,9 +229,38 @@ static uint8 zclOTA_SignatureData[OTA_SIGNATURE_LEN];
 static uint8 zclOTA_Certificate[OTA_CERTIFICATE_LEN];
 #endif // OTA_MMO_SIGN
 
+#if (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+static zclOTA_PageStream_t zclOTA_SrvPage;
+#endif // (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+
 #if (defined OTA_CLIENT) && (OTA_CLIENT == TRUE)
 static uint32 zclOTA_DownloadedImageSize;  // Downloaded image size
+static uint32 zclOTA_DlOffset;             // DL image offset of the next byte written
 static uint16 zclOTA_HeaderLen;            // Image header length
+static uint8 zclOTA_BlockSize;             // maxDataSize asked for, halved when blocks get lost
+static uint8 zclOTA_BlockSizeMax;
+static uint8 zclOTA_BlockRun;              // Blocks received in a row at zclOTA_BlockSize
+
+// Block round trip time estimate (Jacobson/Karels), sets the block response timeout
+static uint16 zclOTA_Srtt8;                // Smoothed RTT in ms, times 8, 0 before the first sample
+static uint16 zclOTA_Rttvar4;              // RTT mean deviation in ms, times 4
+static uint32 zclOTA_ReqTime;              // osal_GetSystemClock() when the last request went out
+static uint8 zclOTA_RttPending;            // The answer to that request times the round trip
+
+// Delay between block requests, paced by zclOTA_RateUp() and zclOTA_RateDown()
+static uint16 zclOTA_BlockReqDelay;        // Never below zclOTA_MinBlockReqDelay, the server's minimum
+static uint32 zclOTA_RateTime;             // osal_GetSystemClock() at the last rate sample
+static uint32 zclOTA_RateOffset;           // zclOTA_FileOffset at the last rate sample
+
+#if OTA_RESUME
+static uint32 zclOTA_CkptOffset;           // zclOTA_FileOffset at the last checkpoint
+#endif
+#if OTA_WINDOW > 1
+static zclOTA_WinSlot_t zclOTA_Win[OTA_WINDOW];
+static uint8 zclOTA_WinBusy;               // Bitmap of the slots in use
+static uint8 zclOTA_WinRx;                 // Bitmap of the slots holding their block
+static uint8 *zclOTA_WinBuf;               // OTA_WINDOW blocks of zclOTA_BlockSizeMax, NULL if no window
+#endif
 
 static uint16 zclOTA_UpdateDelay;
 static zclOTA_FileID_t zclOTA_CurrentDlFileId;
@@ -181,6 +275,32 @@ static uint8 zclOTA_UpgradeEndRetry;
 
 static uint8 zclOTA_ClientPdState;
 
+// Next Image Block Request is held back until the external flash can take the block
+static uint8 zclOTA_XnvStalled = FALSE;
+
+// The download holds the external flash out of deep power-down
+static uint8 zclOTA_XnvHeld = FALSE;
+
+// The Upgrade End Request waits for the external flash to settle
+static uint8 zclOTA_XnvFinish = FALSE;
+static uint32 zclOTA_CompleteTime;         // osal_GetSystemClock() when the last block arrived
+
+// Rest of the block held back while a compressed image element expands on ZCL_OTA_LZ4_EVT
+static uint8 zclOTA_Lz4Wait = FALSE;
+static uint8 *zclOTA_Lz4Rest;
+static uint8 zclOTA_Lz4RestLen;
+
+// Delta image element of the download, rebuilt into an upgrade image once it is complete
+static uint32 zclOTA_DeltaOset;
+static uint32 zclOTA_DeltaLen;             // 0 if the download carries no delta image
+
+#if OTA_PAGE_REQ
+static uint8 zclOTA_PageReq;               // FALSE once the server turned down an Image Page Request
+static uint8 zclOTA_PageReqTransSeq;
+static uint32 zclOTA_PageEnd;              // End of the page being streamed, zclOTA_FileOffset if none
+static uint16 zclOTA_PageSpacing;          // Response spacing asked of the server for that page
+#endif
+
 // OTA Header Magic Number Bytes
 static const uint8 zclOTA_HdrMagic[] = {0x1E, 0xF1, 0xEE, 0x0B};
 
@@ -200,18 +320,57 @@ static uint8 zclOta_OtaUpgradeEndReqTransSeq;
 static ZStatus_t zclOTA_HdlIncoming ( zclIncoming_t *pInMsg );
 static void zclOTA_ProcessUnhandledFoundationZCLMsgs ( zclIncomingMsg_t *pMsg );
 static void zclOTA_ProcessInDefaultRspCmd( zclIncomingMsg_t *pInMsg );
+static uint8 zclOTA_FrameBlockSize ( void );
 
 #if (defined OTA_CLIENT) && (OTA_CLIENT == TRUE)
 static void zclOTA_StartTimer ( uint16 eventId, uint32 minutes );
 static ZStatus_t sendImageBlockReq ( afAddrType_t *dstAddr );
+#if OTA_PAGE_REQ
+static ZStatus_t sendImagePageReq ( afAddrType_t *dstAddr );
+#endif
 static void zclOTA_ProcessZDOMsgs ( zdoIncomingMsg_t *pMsg );
 static void zclOTA_ImageBlockWaitExpired ( void );
 static void zclOTA_UpgradeComplete ( uint8 status );
 static uint8 zclOTA_CmpFileId ( zclOTA_FileID_t *f1, zclOTA_FileID_t *f2 );
 static uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len );
+static void zclOTA_ReleaseXnv ( void );
+static void zclOTA_FinishDownload ( void );
+static uint8 zclOTA_DownloadDone ( void );
+static void zclOTA_DeltaStep ( void );
+static void zclOTA_Lz4Step ( void );
+static void zclOTA_Lz4Stop ( void );
+static void zclOTA_AbortDownload ( uint8 status );
+static void zclOTA_WriteDl ( uint8 *pBuf, uint16 len );
+static void zclOTA_RttSample ( uint32 sent );
+static uint16 zclOTA_RspTimeout ( void );
+static void zclOTA_RateStart ( void );
+static void zclOTA_RateUp ( void );
+static void zclOTA_RateDown ( void );
+static void zclOTA_RateSample ( void );
+#if OTA_FAST_POLL
+static void zclOTA_PollFast ( void );
+static void zclOTA_PollSlow ( void );
+#endif
+#if OTA_RESUME
+static void zclOTA_InitCheckpoint ( OTA_ImageHeader_t *pHeader );
+static void zclOTA_SaveCheckpoint ( void );
+static void zclOTA_LoadCheckpoint ( zclOTA_FileID_t *pFileId, uint32 imageSize );
+static void zclOTA_ClearCheckpoint ( void );
+#endif
+#if OTA_WINDOW > 1
+static void zclOTA_WinOpen ( void );
+static void zclOTA_WinClose ( void );
+static void zclOTA_WinFill ( void );
+static uint8 zclOTA_WinPlace ( uint32 oset, uint8 *pData, uint8 len );
+static uint8 zclOTA_WinDrain ( void );
+static void zclOTA_WinResume ( void );
+#endif
 
 static ZStatus_t zclOTA_SendQueryNextImageReq ( afAddrType_t *dstAddr, zclOTA_QueryNextImageReqParams_t *pParams );
 static ZStatus_t zclOTA_SendImageBlockReq ( afAddrType_t *dstAddr, zclOTA_ImageBlockReqParams_t *pParams );
+#if OTA_PAGE_REQ
+static ZStatus_t zclOTA_SendImagePageReq ( afAddrType_t *dstAddr, zclOTA_ImagePageReqParams_t *pParams );
+#endif
 static ZStatus_t zclOTA_SendUpgradeEndReq ( afAddrType_t *dstAddr, zclOTA_UpgradeEndReqParams_t *pParams );
 
 static ZStatus_t zclOTA_ClientHdlIncoming ( zclIncoming_t *pInMsg );
@@ -232,6 +391,8 @@ static ZStatus_t zclOTA_Srv_QuerySpecificFileReq ( afAddrType_t *pSrcAddr, zclOT
 static void zclOTA_ProcessNextImgRsp ( uint8* pMSGpkt, zclOTA_FileID_t *pFileId, afAddrType_t *pAddr );
 static void zclOTA_ProcessFileReadRsp ( uint8* pMSGpkt, zclOTA_FileID_t *pFileId, afAddrType_t *pAddr );
 static void zclOTA_ServerHandleFileSysCb ( OTA_MtMsg_t* pMSGpkt );
+static void zclOTA_SrvPageRead ( void );
+static uint8 zclOTA_SrvBlockSize ( void );
 
 static ZStatus_t zclOTA_ServerHdlIncoming ( zclIncoming_t *pInMsg );
 
@@ -241,7 +402,7 @@ static void zclOTA_InitBlockReqDelay ( void );
 /******************************************************************************
  * OTA ATTRIBUTE DEFINITIONS - Uses REAL cluster IDs
  */
-#define ZCL_OTA_MAX_ATTRIBUTES          11
+#define ZCL_OTA_MAX_ATTRIBUTES          15
 CONST zclAttrRec_t zclOTA_Attrs[ZCL_OTA_MAX_ATTRIBUTES] =
 {
   {
@@ -342,6 +503,42 @@ CONST zclAttrRec_t zclOTA_Attrs[ZCL_OTA_MAX_ATTRIBUTES] =
       ACCESS_CONTROL_READ | ACCESS_CLIENT,
       ( void * ) &zclOTA_ImageStamp
     }
+  },
+  {
+    ZCL_CLUSTER_ID_OTA,
+    { // Attribute record
+      ATTRID_BOOT_STATUS,
+      ZCL_DATATYPE_UINT16,
+      ACCESS_CONTROL_READ | ACCESS_CLIENT,
+      ( void * ) &zclOTA_BootStatus
+    }
+  },
+  {
+    ZCL_CLUSTER_ID_OTA,
+    { // Attribute record
+      ATTRID_DOWNLOAD_RATE,
+      ZCL_DATATYPE_UINT16,
+      ACCESS_CONTROL_READ | ACCESS_CLIENT,
+      ( void * ) &zclOTA_DownloadRate
+    }
+  },
+  {
+    ZCL_CLUSTER_ID_OTA,
+    { // Attribute record
+      ATTRID_BLOCK_LOSSES,
+      ZCL_DATATYPE_UINT16,
+      ACCESS_CONTROL_READ | ACCESS_CLIENT,
+      ( void * ) &zclOTA_BlockLosses
+    }
+  },
+  {
+    ZCL_CLUSTER_ID_OTA,
+    { // Attribute record
+      ATTRID_DELAY_HISTORY,
+      ZCL_DATATYPE_OCTET_STR,
+      ACCESS_CONTROL_READ | ACCESS_CLIENT,
+      ( void * ) zclOTA_DelayHistory
+    }
   }
 };
 
@@ -524,7 +721,14 @@ void zclOTA_Init ( uint8 task_id )
 
   preamble_t preamble;
 
+  // Identify the external flash before the first access
+  HalOTAInit();
 
+  zclOTA_BootStatus = HalOTABootStatus();
+  if ( zclOTA_BootStatus != HAL_OTA_BOOT_STATUS_NONE )
+  {
+    LREP ( "[OTA] boot copy: %d pages written, %d skipped\r\n", HI_UINT16 ( zclOTA_BootStatus ), LO_UINT16 ( zclOTA_BootStatus ) );
+  }
 
   // Read the OTA File Header
 
@@ -542,6 +746,10 @@ void zclOTA_Init ( uint8 task_id )
 
   }
 
+#if OTA_RESUME
+  zclOTA_InitCheckpoint ( &header );
+#endif
+
   // Load the OTA Attributes from the constant values in NV
 
   HalOTARead ( PREAMBLE_OFFSET, ( uint8 * ) &preamble, sizeof ( preamble_t ), HAL_OTA_RC );
@@ -712,6 +920,19 @@ uint16 zclOTA_event_loop ( uint8 task_id, uint16 events )
 
   if ( events & ZCL_OTA_BLOCK_RSP_TO_EVT )
   {
+#if OTA_PAGE_REQ
+    // A page that stops part way after its first block breaks the page, but says
+    // nothing about the request rate: it is not counted or backed off from
+    uint8 congested = ( zclOTA_FileOffset >= zclOTA_PageEnd ) || zclOTA_RttPending;
+#else
+    uint8 congested = TRUE;
+#endif
+
+    if ( congested && ( zclOTA_BlockLosses < 0xFFFF ) )
+    {
+      zclOTA_BlockLosses++;
+    }
+
     // We timed out waiting for a Block Response
     if ( ++zclOTA_BlockRetry > OTA_MAX_BLOCK_RETRIES )
     {
@@ -727,6 +948,35 @@ uint16 zclOTA_event_loop ( uint8 task_id, uint16 events )
     }
     else
     {
+#if OTA_PAGE_REQ
+      // Give up on the rest of the page, ask for the missing block on its own
+      zclOTA_PageEnd = zclOTA_FileOffset;
+#endif
+      // Requests further apart and smaller blocks may get through where large ones,
+      // fragmented or not, do not
+      if ( congested )
+      {
+        zclOTA_RateDown();
+        zclOTA_BlockRun = 0;
+        if ( zclOTA_BlockSize / 2 >= OTA_MAX_MTU )
+        {
+          zclOTA_BlockSize /= 2;
+        }
+        else if ( zclOTA_BlockSize > OTA_MAX_MTU )
+        {
+          zclOTA_BlockSize = OTA_MAX_MTU;
+        }
+      }
+
+#if OTA_WINDOW > 1
+      if ( zclOTA_WinBuf != NULL )
+      {
+        // Ask again for everything still missing, keep the blocks already in
+        zclOTA_WinBusy &= zclOTA_WinRx;
+        zclOTA_WinFill();
+      }
+      else
+#endif
       // Send another block request
       sendImageBlockReq(&zclOTA_serverAddr);
     }
@@ -755,12 +1005,88 @@ uint16 zclOTA_event_loop ( uint8 task_id, uint16 events )
 
   if ( events & ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT )
   {
-
-    sendImageBlockReq ( &zclOTA_serverAddr );
+    if ( zclOTA_Lz4Wait )
+    {
+      // ZCL_OTA_LZ4_EVT asks again once the last block has expanded
+    }
+    // Don't ask for a block the flash can only take by stalling behind an erase
+    else if ( HalOTAPoll() == HAL_OTA_XNV_STALL )
+    {
+      zclOTA_XnvStalled = TRUE;
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+    }
+#if OTA_WINDOW > 1
+    else if ( zclOTA_WinBuf != NULL )
+    {
+      zclOTA_WinResume();
+    }
+#endif
+#if OTA_PAGE_REQ
+    else if ( zclOTA_PageReq )
+    {
+      sendImagePageReq ( &zclOTA_serverAddr );
+    }
+#endif
+    else
+    {
+      sendImageBlockReq ( &zclOTA_serverAddr );
+    }
 
     return ( events ^ ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT );
   }
 
+  if ( events & ZCL_OTA_XNV_POLL_EVT )
+  {
+    // Complete a pending flash erase in the background
+    uint8 xnv = HalOTAPoll();
+
+    if ( xnv != HAL_OTA_XNV_IDLE )
+    {
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+    }
+
+    if ( zclOTA_XnvStalled && ( xnv != HAL_OTA_XNV_STALL ) )
+    {
+      zclOTA_XnvStalled = FALSE;
+
+      if ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS )
+      {
+        osal_set_event ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT );
+      }
+    }
+
+    if ( zclOTA_XnvFinish && ( xnv == HAL_OTA_XNV_IDLE ) )
+    {
+      zclOTA_FinishDownload();
+    }
+
+    return ( events ^ ZCL_OTA_XNV_POLL_EVT );
+  }
+
+#if OTA_FAST_POLL
+  if ( events & ZCL_OTA_FAST_POLL_EVT )
+  {
+    // The block did not turn up in time, the block response timer takes it from here
+    zclOTA_PollSlow();
+
+    return ( events ^ ZCL_OTA_FAST_POLL_EVT );
+  }
+#endif
+
+  if ( events & ZCL_OTA_DELTA_EVT )
+  {
+    zclOTA_DeltaStep();
+
+    return ( events ^ ZCL_OTA_DELTA_EVT );
+  }
+
+  if ( events & ZCL_OTA_LZ4_EVT )
+  {
+    zclOTA_Lz4Step();
+
+    return ( events ^ ZCL_OTA_LZ4_EVT );
+  }
+
   if ( events & ZCL_OTA_SEND_MATCH_DESCRIPTOR_EVT )
   {
     zAddrType_t dstAddr;
@@ -798,6 +1124,16 @@ uint16 zclOTA_event_loop ( uint8 task_id, uint16 events )
   }
 #endif // (defined OTA_CLIENT) && (OTA_CLIENT == TRUE)
 
+#if (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+  if ( events & ZCL_OTA_PAGE_RSP_EVT )
+  {
+    // Next block of an Image Page Request
+    zclOTA_SrvPageRead();
+
+    return ( events ^ ZCL_OTA_PAGE_RSP_EVT );
+  }
+#endif // (defined OTA_SERVER) && (OTA_SERVER == TRUE)
+
   // Discard unknown events
   return 0;
 }
@@ -939,6 +1275,20 @@ static void zclOTA_ProcessInDefaultRspCmd( zclIncomingMsg_t *pInMsg )
       }
       break;
       
+#if (defined OTA_CLIENT) && (OTA_CLIENT == TRUE) && OTA_PAGE_REQ
+    case ( ZCL_STATUS_UNSUP_CLUSTER_COMMAND ) :
+
+      if ( ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS ) && zclOTA_PageReq &&
+           ( pInMsg->zclHdr.transSeqNum == zclOTA_PageReqTransSeq ) )
+      {
+        // The server does not stream pages, carry on with Image Block Requests
+        zclOTA_PageReq = FALSE;
+        zclOTA_PageEnd = zclOTA_FileOffset;
+        sendImageBlockReq ( &zclOTA_serverAddr );
+      }
+      break;
+#endif
+
     // Handling for other Defautl Response status codes and OTA states can 
     // be added here.
     default :
@@ -946,6 +1296,41 @@ static void zclOTA_ProcessInDefaultRspCmd( zclIncomingMsg_t *pInMsg )
   }           
 }
 
+/******************************************************************************
+ * @fn      zclOTA_FrameBlockSize
+ *
+ * @brief   Largest image block an Image Block Response carries in one frame:
+ *          the APS payload left by the NWK and APS headers and security, less
+ *          the ZCL header, the response fields and OTA_FRAME_RESERVE.
+ *
+ * @param   none
+ *
+ * @return  block size, at least OTA_MAX_MTU and at most HAL_OTA_BLOCK_MAX
+ */
+static uint8 zclOTA_FrameBlockSize ( void )
+{
+  afDataReqMTU_t mtu;
+  uint8 size;
+
+  mtu.kvp = FALSE;
+#if defined OTA_HA
+  mtu.aps.secure = FALSE;
+#else
+  mtu.aps.secure = TRUE;  // zclOta_Options: AF_EN_SECURITY
+#endif
+
+  size = afDataReqMTU ( &mtu );
+
+  if ( size < ZCL_OTA_ZCL_HDR_LEN + PAYLOAD_MAX_LEN_IMAGE_BLOCK_RSP + OTA_FRAME_RESERVE + OTA_MAX_MTU )
+  {
+    return OTA_MAX_MTU;
+  }
+
+  size -= ZCL_OTA_ZCL_HDR_LEN + PAYLOAD_MAX_LEN_IMAGE_BLOCK_RSP + OTA_FRAME_RESERVE;
+
+  return ( size < HAL_OTA_BLOCK_MAX ) ? size : HAL_OTA_BLOCK_MAX;
+}
+
 #if (defined OTA_SERVER) && (OTA_SERVER == TRUE)
 /******************************************************************************
  * @fn      zclOTA_SendImageNotify
@@ -1249,6 +1634,54 @@ ZStatus_t zclOTA_SendImageBlockReq ( afAddrType_t *dstAddr,
   return status;
 }
 
+#if OTA_PAGE_REQ
+/******************************************************************************
+ * @fn      zclOTA_SendImagePageReq
+ *
+ * @brief   Send an OTA Image Page Request mesage.
+ *
+ * @param   dstAddr - where you want the message to go
+ * @param   pParams - message parameters
+ *
+ * @return  ZStatus_t
+ */
+ZStatus_t zclOTA_SendImagePageReq ( afAddrType_t *dstAddr,
+                                    zclOTA_ImagePageReqParams_t *pParams )
+{
+  ZStatus_t status;
+  uint8 buf[PAYLOAD_MAX_LEN_IMAGE_PAGE_REQ];
+  uint8 *pBuf = buf;
+
+  *pBuf++ = pParams->fieldControl;
+  *pBuf++ = LO_UINT16 ( pParams->fileId.manufacturer );
+  *pBuf++ = HI_UINT16 ( pParams->fileId.manufacturer );
+  *pBuf++ = LO_UINT16 ( pParams->fileId.type );
+  *pBuf++ = HI_UINT16 ( pParams->fileId.type );
+  pBuf = osal_buffer_uint32 ( pBuf, pParams->fileId.version );
+  pBuf = osal_buffer_uint32 ( pBuf, pParams->fileOffset );
+  *pBuf++ = pParams->maxDataSize;
+  *pBuf++ = LO_UINT16 ( pParams->pageSize );
+  *pBuf++ = HI_UINT16 ( pParams->pageSize );
+  *pBuf++ = LO_UINT16 ( pParams->responseSpacing );
+  *pBuf++ = HI_UINT16 ( pParams->responseSpacing );
+
+  if ( ( pParams->fieldControl & OTA_BLOCK_FC_NODES_IEEE_PRESENT ) != 0 )
+  {
+    osal_cpyExtAddr ( pBuf, pParams->nodeAddr );
+    pBuf += Z_EXTADDR_LEN;
+  }
+
+  zclOTA_PageReqTransSeq = zclOTA_SeqNo++;
+
+  status = zcl_SendCommand ( ZCL_OTA_ENDPOINT, dstAddr, ZCL_CLUSTER_ID_OTA,
+                             COMMAND_IMAGE_PAGE_REQ, TRUE,
+                             ZCL_FRAME_CLIENT_SERVER_DIR, FALSE, 0,
+                             zclOTA_PageReqTransSeq, ( uint16 ) ( pBuf - buf ), buf );
+
+  return status;
+}
+#endif // OTA_PAGE_REQ
+
 /******************************************************************************
  * @fn      zclOTA_SendUpgradeEndReq
  *
@@ -1321,81 +1754,704 @@ static ZStatus_t sendImageBlockReq ( afAddrType_t *dstAddr )
   req.fileId.version = zclOTA_DownloadedFileVersion;
   req.fileOffset = zclOTA_FileOffset;
 
-  if ( zclOTA_DownloadedImageSize - zclOTA_FileOffset < OTA_MAX_MTU )
+  if ( zclOTA_DownloadedImageSize - zclOTA_FileOffset < zclOTA_BlockSize )
   {
     req.maxDataSize = zclOTA_DownloadedImageSize - zclOTA_FileOffset;
   }
   else
   {
-    req.maxDataSize = OTA_MAX_MTU;
+    req.maxDataSize = zclOTA_BlockSize;
   }
 
   req.blockReqDelay = zclOTA_MinBlockReqDelay;
 
   // Start a timer waiting for a response
-  osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT, OTA_MAX_BLOCK_RSP_WAIT_TIME );
+  zclOTA_ReqTime = osal_GetSystemClock();
+  zclOTA_RttPending = TRUE;
+  osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT, zclOTA_RspTimeout() );
+#if OTA_FAST_POLL
+  zclOTA_PollFast();
+#endif
 
   return zclOTA_SendImageBlockReq ( dstAddr, &req );
 }
 
+#if OTA_PAGE_REQ
 /******************************************************************************
- * @fn      zclOTA_ProcessImageData
+ * @fn      sendImagePageReq
  *
- * @brief   Process image data as it is received from the host.
+ * @brief   Send an Image Page Request for the next OTA_PAGE_SIZE bytes of the
+ *          image, or as many as the flash takes in front of a pending erase.
+ *          The server streams the page as Image Block Responses.
  *
- * @param   pData - pointer to the data
- * @param   len - length of the data
+ * @param   dstAddr - where you want the message to go
  *
- * @return  status of the operation
+ * @return  ZStatus_t
  */
-uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
+static ZStatus_t sendImagePageReq ( afAddrType_t *dstAddr )
 {
-  int8 i;
-#if defined OTA_MMO_SIGN
-  uint8 skipHash = FALSE;
-#endif
-
-  if ( zclOTA_ImageUpgradeStatus != OTA_STATUS_IN_PROGRESS )
+  zclOTA_ImagePageReqParams_t req;
+  uint32 left = zclOTA_DownloadedImageSize - zclOTA_FileOffset;
+  uint16 room;
+
+  // Don't stream more than the flash takes without stalling behind an erase
+  HalOTAPoll();
+  room = HalOTARoom();
+  if ( left > room )
   {
-    return ZCL_STATUS_ABORT;
+    left = room;
   }
 
-#if (defined HAL_LED) && (HAL_LED == TRUE)
-  // Toggle an LED to indicate we received a new block
-  HalLedSet ( HAL_LED_2, HAL_LED_MODE_TOGGLE );
+  req.fieldControl = OTA_BLOCK_FC_GENERIC;
+  req.fileId.manufacturer = zclOTA_ManufacturerId;
+  req.fileId.type = zclOTA_ImageType;
+  req.fileId.version = zclOTA_DownloadedFileVersion;
+  req.fileOffset = zclOTA_FileOffset;
+  req.maxDataSize = ( left < zclOTA_BlockSize ) ? ( uint8 ) left : zclOTA_BlockSize;
+  req.pageSize = ( left < OTA_PAGE_SIZE ) ? ( uint16 ) left : OTA_PAGE_SIZE;
+
+  // The server's rate limit still applies between the blocks of a page
+  zclOTA_PageSpacing = MAX ( zclOTA_BlockReqDelay, OTA_PAGE_RSP_SPACING );
+  zclOTA_PageSpacing = MAX ( zclOTA_PageSpacing, zclOTA_MinBlockReqDelay );
+  req.responseSpacing = zclOTA_PageSpacing;
+
+  zclOTA_PageEnd = zclOTA_FileOffset + req.pageSize;
+
+  // Start a timer waiting for the first block
+  zclOTA_ReqTime = osal_GetSystemClock();
+  zclOTA_RttPending = TRUE;
+  osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT, zclOTA_RspTimeout() );
+#if OTA_FAST_POLL
+  zclOTA_PollFast();
 #endif
 
-  // write data to secondary storage
-  HalOTAWrite ( zclOTA_FileOffset, pData, len, HAL_OTA_DL );
+  return zclOTA_SendImagePageReq ( dstAddr, &req );
+}
+#endif // OTA_PAGE_REQ
 
-  for ( i=0; i<len; i++ )
+/******************************************************************************
+ * @fn      zclOTA_RttSample
+ *
+ * @brief   Fold the round trip of an answered block request into the smoothed
+ *          RTT and its mean deviation, as TCP does (RFC 6298).
+ *
+ * @param   sent - osal_GetSystemClock() when the request went out
+ *
+ * @return  none
+ */
+static void zclOTA_RttSample ( uint32 sent )
+{
+  uint32 elapsed = osal_GetSystemClock() - sent;
+  uint16 rtt;
+  int16 err;
+
+  rtt = ( elapsed < OTA_MAX_BLOCK_RSP_WAIT_TIME ) ? ( uint16 ) elapsed : OTA_MAX_BLOCK_RSP_WAIT_TIME;
+  if ( rtt == 0 )
   {
-    switch ( zclOTA_ClientPdState )
-    {
-        // verify header magic number
-      case ZCL_OTA_PD_MAGIC_0_STATE:
-        // Initialize control variables
-#if defined OTA_MMO_SIGN
-        osal_memset ( &zclOTA_MmoHash, 0, sizeof ( zclOTA_MmoHash ) );
-        zclOTA_HashPos = 0;
-#endif
+    rtt = 1;
+  }
 
-        // Missing break intended
-      case ZCL_OTA_PD_MAGIC_1_STATE:
-      case ZCL_OTA_PD_MAGIC_2_STATE:
-      case ZCL_OTA_PD_MAGIC_3_STATE:
-        if ( pData[i] != zclOTA_HdrMagic[zclOTA_ClientPdState] )
-        {
-          return ZCL_STATUS_INVALID_IMAGE;
-        }
-        zclOTA_ClientPdState++;
-        break;
+  if ( zclOTA_Srtt8 == 0 )
+  {
+    // SRTT = R, RTTVAR = R / 2
+    zclOTA_Srtt8 = rtt << 3;
+    zclOTA_Rttvar4 = rtt << 1;
+  }
+  else
+  {
+    // SRTT += ( R - SRTT ) / 8, RTTVAR += ( |R - SRTT| - RTTVAR ) / 4
+    err = ( int16 ) rtt - ( int16 ) ( zclOTA_Srtt8 >> 3 );
+    zclOTA_Srtt8 += err;
+    if ( err < 0 )
+    {
+      err = -err;
+    }
+    zclOTA_Rttvar4 += err - ( zclOTA_Rttvar4 >> 2 );
+  }
+}
 
-      case ZCL_OTA_PD_HDR_LEN1_STATE:
-        // get header length
-        if ( zclOTA_FileOffset == ZCL_OTA_HDR_LEN_OFFSET )
-        {
-          zclOTA_HeaderLen = pData[i];
+/******************************************************************************
+ * @fn      zclOTA_RspTimeout
+ *
+ * @brief   Block response timeout: SRTT + 4 * RTTVAR, doubled for every block
+ *          request lost in a row, within OTA_MIN_BLOCK_RSP_WAIT_TIME and
+ *          OTA_MAX_BLOCK_RSP_WAIT_TIME.
+ *
+ * @param   none
+ *
+ * @return  timeout in ms
+ */
+static uint16 zclOTA_RspTimeout ( void )
+{
+  uint16 rto;
+  uint8 i;
+
+  if ( zclOTA_Srtt8 == 0 )
+  {
+    return OTA_MAX_BLOCK_RSP_WAIT_TIME;
+  }
+
+  rto = MAX ( ( zclOTA_Srtt8 >> 3 ) + zclOTA_Rttvar4, OTA_MIN_BLOCK_RSP_WAIT_TIME );
+
+  for ( i = 0; ( i < zclOTA_BlockRetry ) && ( rto < OTA_MAX_BLOCK_RSP_WAIT_TIME ); i++ )
+  {
+    rto <<= 1;
+  }
+
+  return MIN ( rto, OTA_MAX_BLOCK_RSP_WAIT_TIME );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_RateStart
+ *
+ * @brief   Pace a new download at the server's minimum and clear the rate
+ *          diagnostics.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_RateStart ( void )
+{
+  zclOTA_BlockReqDelay = zclOTA_MinBlockReqDelay;
+  zclOTA_RateTime = osal_GetSystemClock();
+  zclOTA_RateOffset = zclOTA_FileOffset;
+  zclOTA_DownloadRate = 0;
+  zclOTA_BlockLosses = 0;
+  zclOTA_DelayHistory[0] = 0;
+}
+
+/******************************************************************************
+ * @fn      zclOTA_RateUp
+ *
+ * @brief   Additive increase: shorten the delay between block requests by
+ *          OTA_RATE_STEP, down to the server's minimum.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_RateUp ( void )
+{
+  if ( zclOTA_BlockReqDelay > zclOTA_MinBlockReqDelay + OTA_RATE_STEP )
+  {
+    zclOTA_BlockReqDelay -= OTA_RATE_STEP;
+  }
+  else
+  {
+    zclOTA_BlockReqDelay = zclOTA_MinBlockReqDelay;
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_RateDown
+ *
+ * @brief   Multiplicative decrease: double the delay between block requests,
+ *          to at least OTA_RATE_BACKOFF_MIN and at most OTA_RATE_MAX_DELAY.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_RateDown ( void )
+{
+  if ( zclOTA_BlockReqDelay < OTA_RATE_BACKOFF_MIN / 2 )
+  {
+    zclOTA_BlockReqDelay = OTA_RATE_BACKOFF_MIN;
+  }
+  else if ( zclOTA_BlockReqDelay < OTA_RATE_MAX_DELAY / 2 )
+  {
+    zclOTA_BlockReqDelay *= 2;
+  }
+  else
+  {
+    zclOTA_BlockReqDelay = OTA_RATE_MAX_DELAY;
+  }
+
+  zclOTA_BlockReqDelay = MAX ( zclOTA_BlockReqDelay, zclOTA_MinBlockReqDelay );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_RateSample
+ *
+ * @brief   Every OTA_RATE_PERIOD, update ATTRID_DOWNLOAD_RATE and push the
+ *          block request delay into ATTRID_DELAY_HISTORY.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_RateSample ( void )
+{
+  uint32 now = osal_GetSystemClock();
+  uint32 elapsed = now - zclOTA_RateTime;
+  uint32 rate;
+  uint8 i;
+
+  if ( elapsed < OTA_RATE_PERIOD )
+  {
+    return;
+  }
+
+  rate = ( zclOTA_FileOffset - zclOTA_RateOffset ) * 1000 / elapsed;
+  zclOTA_DownloadRate = ( rate < 0xFFFF ) ? ( uint16 ) rate : 0xFFFF;
+  zclOTA_RateTime = now;
+  zclOTA_RateOffset = zclOTA_FileOffset;
+
+  for ( i = OTA_DELAY_HISTORY_LEN * 2; i > 2; i-- )
+  {
+    zclOTA_DelayHistory[i] = zclOTA_DelayHistory[i - 2];
+  }
+  zclOTA_DelayHistory[1] = LO_UINT16 ( zclOTA_BlockReqDelay );
+  zclOTA_DelayHistory[2] = HI_UINT16 ( zclOTA_BlockReqDelay );
+  if ( zclOTA_DelayHistory[0] < OTA_DELAY_HISTORY_LEN * 2 )
+  {
+    zclOTA_DelayHistory[0] += 2;
+  }
+
+  LREP ( "[OTA] %d B/s, block req delay %d ms, %d lost\r\n",
+         zclOTA_DownloadRate, zclOTA_BlockReqDelay, zclOTA_BlockLosses );
+}
+
+#if OTA_FAST_POLL
+/******************************************************************************
+ * @fn      zclOTA_PollFast
+ *
+ * @brief   Poll the parent at once, then every OTA_FAST_POLL_RATE ms for the
+ *          block just asked for, for up to OTA_FAST_POLL_TIME. Called again,
+ *          it starts the deadline over. The rate is set on every call, whatever
+ *          else changed it in the meantime.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_PollFast ( void )
+{
+  NLME_SetPollRate ( OTA_FAST_POLL_RATE );
+  NwkPollReq ( FALSE );
+
+  osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_FAST_POLL_EVT, OTA_FAST_POLL_TIME );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_PollSlow
+ *
+ * @brief   Drop to OTA_SLOW_POLL_RATE until the next block request, unless
+ *          requests of the window are still out.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_PollSlow ( void )
+{
+#if OTA_WINDOW > 1
+  if ( ( zclOTA_WinBusy & ~zclOTA_WinRx ) && osal_get_timeoutEx ( zclOTA_TaskID, ZCL_OTA_FAST_POLL_EVT ) )
+  {
+    return;
+  }
+#endif
+
+  osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_FAST_POLL_EVT );
+  NLME_SetPollRate ( OTA_SLOW_POLL_RATE );
+}
+#endif // OTA_FAST_POLL
+
+#if OTA_WINDOW > 1
+/******************************************************************************
+ * @fn      zclOTA_WinOpen
+ *
+ * @brief   Set up the window of outstanding Image Block Requests for a new
+ *          download. Without the RAM for it the download goes on without.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_WinOpen ( void )
+{
+  zclOTA_WinClose();
+  zclOTA_WinBuf = osal_mem_alloc ( ( uint16 ) OTA_WINDOW * zclOTA_BlockSizeMax );
+
+#if OTA_PAGE_REQ
+  // The window pipelines Image Block Requests instead
+  zclOTA_PageReq = ( zclOTA_WinBuf == NULL );
+#endif
+}
+
+/******************************************************************************
+ * @fn      zclOTA_WinClose
+ *
+ * @brief   Drop the window and whatever blocks it still holds.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_WinClose ( void )
+{
+  if ( zclOTA_WinBuf != NULL )
+  {
+    osal_mem_free ( zclOTA_WinBuf );
+    zclOTA_WinBuf = NULL;
+  }
+
+  zclOTA_WinBusy = 0;
+  zclOTA_WinRx = 0;
+}
+
+/******************************************************************************
+ * @fn      zclOTA_WinFill
+ *
+ * @brief   Ask for the first range of the image no slot covers, if a slot is
+ *          free and the range is within OTA_WINDOW blocks of zclOTA_FileOffset.
+ *          Comes back through ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT for the next
+ *          one, so the server's rate limit holds between requests. The block
+ *          response timer runs for the oldest request. Holds off while the
+ *          blocks outstanding would not fit in front of a pending erase.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_WinFill ( void )
+{
+  zclOTA_ImageBlockReqParams_t req;
+  uint32 oset = zclOTA_FileOffset;
+  uint32 end = zclOTA_DownloadedImageSize;
+  uint16 pending;
+  uint8 slot = OTA_WINDOW;
+  uint8 moved;
+  uint8 len;
+  uint8 i;
+
+  // Skip what the slots already cover
+  do
+  {
+    moved = FALSE;
+    for ( i = 0; i < OTA_WINDOW; i++ )
+    {
+      if ( ( zclOTA_WinBusy & BV ( i ) ) && ( zclOTA_Win[i].offset <= oset ) &&
+           ( oset < zclOTA_Win[i].offset + zclOTA_Win[i].len ) )
+      {
+        oset = zclOTA_Win[i].offset + zclOTA_Win[i].len;
+        moved = TRUE;
+      }
+    }
+  } while ( moved );
+
+  // up to the next slot, in a free one
+  for ( i = 0; i < OTA_WINDOW; i++ )
+  {
+    if ( zclOTA_WinBusy & BV ( i ) )
+    {
+      if ( ( zclOTA_Win[i].offset > oset ) && ( zclOTA_Win[i].offset < end ) )
+      {
+        end = zclOTA_Win[i].offset;
+      }
+    }
+    else if ( slot == OTA_WINDOW )
+    {
+      slot = i;
+    }
+  }
+
+  if ( ( slot < OTA_WINDOW ) && ( oset < end ) &&
+       ( oset - zclOTA_FileOffset < ( uint32 ) OTA_WINDOW * zclOTA_BlockSize ) )
+  {
+    len = ( end - oset < zclOTA_BlockSize ) ? ( uint8 ) ( end - oset ) : zclOTA_BlockSize;
+
+    // Everything asked for and not yet written has to fit in front of the erase
+    pending = len;
+    for ( i = 0; i < OTA_WINDOW; i++ )
+    {
+      if ( zclOTA_WinBusy & BV ( i ) )
+      {
+        pending += zclOTA_Win[i].len;
+      }
+    }
+
+    HalOTAPoll();
+    if ( pending > HalOTARoom() )
+    {
+      slot = OTA_WINDOW;
+      zclOTA_XnvStalled = TRUE;
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+    }
+  }
+
+  if ( slot < OTA_WINDOW )
+  {
+    zclOTA_Win[slot].offset = oset;
+    zclOTA_Win[slot].sent = osal_GetSystemClock();
+    zclOTA_Win[slot].len = len;
+    zclOTA_WinBusy |= BV ( slot );
+
+    req.fieldControl = zclOTA_ImageBlockFC;
+    req.fileId.manufacturer = zclOTA_ManufacturerId;
+    req.fileId.type = zclOTA_ImageType;
+    req.fileId.version = zclOTA_DownloadedFileVersion;
+    req.fileOffset = oset;
+    req.maxDataSize = zclOTA_Win[slot].len;
+    req.blockReqDelay = zclOTA_MinBlockReqDelay;
+
+    zclOTA_SendImageBlockReq ( &zclOTA_serverAddr, &req );
+#if OTA_FAST_POLL
+    zclOTA_PollFast();
+#endif
+
+    // Then the next one
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_BlockReqDelay );
+  }
+
+  if ( ( zclOTA_WinBusy & ~zclOTA_WinRx ) &&
+       ( osal_get_timeoutEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT ) == 0 ) )
+  {
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT, zclOTA_RspTimeout() );
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_WinPlace
+ *
+ * @brief   Keep a block that arrived ahead of zclOTA_FileOffset in the slot
+ *          that asked for it. A block shorter than asked for leaves a gap
+ *          zclOTA_WinFill() asks for again, and the size the server serves
+ *          becomes the block size. The next block in order is kept too while
+ *          the flash is stalled behind an erase, for zclOTA_WinResume().
+ *
+ * @param   oset - file offset of the block
+ * @param   pData - the block
+ * @param   len - its length
+ *
+ * @return  TRUE if the block is the next one in order and the flash takes
+ *          it, for the caller to process, FALSE if it was kept or dropped
+ */
+static uint8 zclOTA_WinPlace ( uint32 oset, uint8 *pData, uint8 len )
+{
+  uint8 i;
+
+  for ( i = 0; i < OTA_WINDOW; i++ )
+  {
+    if ( ( ( zclOTA_WinBusy & ~zclOTA_WinRx ) & BV ( i ) ) && ( zclOTA_Win[i].offset == oset ) )
+    {
+      break;
+    }
+  }
+
+  if ( i < OTA_WINDOW )
+  {
+    if ( zclOTA_BlockRetry == 0 )
+    {
+      zclOTA_RttSample ( zclOTA_Win[i].sent );
+    }
+
+    if ( ( len < zclOTA_Win[i].len ) && ( len >= OTA_MAX_MTU ) )
+    {
+      zclOTA_BlockSize = len;
+    }
+  }
+
+  if ( ( oset == zclOTA_FileOffset ) && !zclOTA_Lz4Wait && ( HalOTAPoll() != HAL_OTA_XNV_STALL ) )
+  {
+    return TRUE;
+  }
+
+  // Keep it, unless it answers a request already given up on
+  if ( ( i < OTA_WINDOW ) && ( len != 0 ) && ( len <= zclOTA_Win[i].len ) )
+  {
+    osal_memcpy ( zclOTA_WinBuf + ( uint16 ) i * zclOTA_BlockSizeMax, pData, len );
+    zclOTA_Win[i].len = len;
+    zclOTA_WinRx |= BV ( i );
+  }
+
+  if ( oset == zclOTA_FileOffset )
+  {
+    // The oldest request is answered, the rest waits for the flash
+    zclOTA_BlockRetry = 0;
+    osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT );
+    if ( !zclOTA_Lz4Wait )
+    {
+      zclOTA_XnvStalled = TRUE;
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+    }
+  }
+
+  return FALSE;
+}
+
+/******************************************************************************
+ * @fn      zclOTA_WinDrain
+ *
+ * @brief   Process the blocks held in the window as zclOTA_FileOffset reaches
+ *          them and free the slots it has passed. Stops at a block the flash
+ *          could only take by stalling behind an erase, or while the last one
+ *          is still expanding, leaving it in its slot.
+ *
+ * @param   none
+ *
+ * @return  status of zclOTA_ProcessImageData()
+ */
+static uint8 zclOTA_WinDrain ( void )
+{
+  uint8 status = ZSuccess;
+  uint8 more = TRUE;
+  uint8 skip;
+  uint8 i;
+
+  while ( more && ( status == ZSuccess ) && ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS ) )
+  {
+    more = FALSE;
+
+    for ( i = 0; i < OTA_WINDOW; i++ )
+    {
+      if ( !( zclOTA_WinBusy & BV ( i ) ) || ( zclOTA_Win[i].offset > zclOTA_FileOffset ) )
+      {
+        continue;
+      }
+
+      if ( ( zclOTA_WinRx & BV ( i ) ) && ( zclOTA_Win[i].offset + zclOTA_Win[i].len > zclOTA_FileOffset ) )
+      {
+        if ( zclOTA_Lz4Wait )
+        {
+          break;
+        }
+        if ( HalOTAPoll() == HAL_OTA_XNV_STALL )
+        {
+          zclOTA_XnvStalled = TRUE;
+          osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+          break;
+        }
+
+        zclOTA_WinBusy &= ~BV ( i );
+        zclOTA_WinRx &= ~BV ( i );
+        skip = ( uint8 ) ( zclOTA_FileOffset - zclOTA_Win[i].offset );
+        status = zclOTA_ProcessImageData ( zclOTA_WinBuf + ( uint16 ) i * zclOTA_BlockSizeMax + skip,
+                                           zclOTA_Win[i].len - skip );
+        more = TRUE;
+        break;
+      }
+
+      // Passed, or the request answered in order
+      zclOTA_WinBusy &= ~BV ( i );
+      zclOTA_WinRx &= ~BV ( i );
+    }
+  }
+
+  return status;
+}
+
+/******************************************************************************
+ * @fn      zclOTA_WinResume
+ *
+ * @brief   Process the blocks the window held while the flash was stalled,
+ *          then carry on asking for more.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_WinResume ( void )
+{
+  uint8 status;
+
+  status = zclOTA_WinDrain();
+
+  if ( ( status == ZSuccess ) && !zclOTA_Lz4Wait &&
+       ( zclOTA_ImageUpgradeStatus == OTA_STATUS_COMPLETE ) )
+  {
+    status = zclOTA_DownloadDone();
+  }
+
+  if ( status != ZSuccess )
+  {
+    zclOTA_AbortDownload ( status );
+    return;
+  }
+
+  if ( !zclOTA_Lz4Wait && ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS ) )
+  {
+#if OTA_RESUME
+    if ( zclOTA_FileOffset - zclOTA_CkptOffset >= OTA_CKPT_INTERVAL )
+    {
+      zclOTA_SaveCheckpoint();
+    }
+#endif
+    zclOTA_WinFill();
+  }
+}
+#endif // OTA_WINDOW > 1
+
+/******************************************************************************
+ * @fn      zclOTA_ProcessImageData
+ *
+ * @brief   Process image data as it is received from the host.
+ *
+ * @param   pData - pointer to the data
+ * @param   len - length of the data
+ *
+ * @return  status of the operation
+ */
+uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
+{
+  uint8 i;
+  uint8 spanEnd = 0;
+  uint8 rawStart = 0;
+  uint8 build = HAL_OTA_BUILD_BUSY;
+#if defined OTA_MMO_SIGN
+  uint8 skipHash = FALSE;
+#endif
+
+  if ( zclOTA_ImageUpgradeStatus != OTA_STATUS_IN_PROGRESS )
+  {
+    return ZCL_STATUS_ABORT;
+  }
+
+#if (defined HAL_LED) && (HAL_LED == TRUE)
+  // Toggle an LED to indicate we received a new block
+  HalLedSet ( HAL_LED_2, HAL_LED_MODE_TOGGLE );
+#endif
+
+  for ( i=0; i<len; i++ )
+  {
+    // Write data to secondary storage, except for element headers, written once parsed,
+    // and compressed elements, written as they expand
+    if ( ( ( zclOTA_ClientPdState >= ZCL_OTA_PD_ELEM_TAG1_STATE ) &&
+           ( zclOTA_ClientPdState <= ZCL_OTA_PD_ELEM_LEN4_STATE ) ) ||
+         ( ( zclOTA_ClientPdState == ZCL_OTA_PD_ELEMENT_STATE ) &&
+           ( zclOTA_ElementTag == OTA_LZ4_IMAGE_TAG_ID ) ) )
+    {
+      zclOTA_WriteDl ( pData + rawStart, i - rawStart );
+      rawStart = i + 1;
+    }
+
+    switch ( zclOTA_ClientPdState )
+    {
+        // verify header magic number
+      case ZCL_OTA_PD_MAGIC_0_STATE:
+        // Initialize control variables
+#if defined OTA_MMO_SIGN
+        osal_memset ( &zclOTA_MmoHash, 0, sizeof ( zclOTA_MmoHash ) );
+        zclOTA_HashPos = 0;
+#endif
+
+        // Missing break intended
+      case ZCL_OTA_PD_MAGIC_1_STATE:
+      case ZCL_OTA_PD_MAGIC_2_STATE:
+      case ZCL_OTA_PD_MAGIC_3_STATE:
+        if ( pData[i] != zclOTA_HdrMagic[zclOTA_ClientPdState] )
+        {
+          return ZCL_STATUS_INVALID_IMAGE;
+        }
+        zclOTA_ClientPdState++;
+        break;
+
+      case ZCL_OTA_PD_HDR_LEN1_STATE:
+        // get header length
+        if ( zclOTA_FileOffset == ZCL_OTA_HDR_LEN_OFFSET )
+        {
+          zclOTA_HeaderLen = pData[i];
           zclOTA_ClientPdState = ZCL_OTA_PD_HDR_LEN2_STATE;
         }
         break;
@@ -1468,6 +2524,32 @@ uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
           return ZCL_STATUS_INVALID_IMAGE;
         }
 
+        if ( zclOTA_ElementTag == OTA_LZ4_IMAGE_TAG_ID )
+        {
+          // Goes in as the upgrade image element it expands to
+          HalOTALz4Start();
+        }
+        else
+        {
+          uint8 hdr[OTA_SUB_ELEMENT_HDR_LEN];
+
+          hdr[0] = LO_UINT16 ( zclOTA_ElementTag );
+          hdr[1] = HI_UINT16 ( zclOTA_ElementTag );
+          osal_buffer_uint32 ( &hdr[2], zclOTA_ElementLen );
+          zclOTA_WriteDl ( hdr, OTA_SUB_ELEMENT_HDR_LEN );
+        }
+
+        if ( zclOTA_ElementTag == OTA_UPGRADE_IMAGE_TAG_ID )
+        {
+          HalOTACrcStart();
+        }
+        else if ( zclOTA_ElementTag == OTA_DELTA_IMAGE_TAG_ID )
+        {
+          // Applied to the running image once the download is complete
+          zclOTA_DeltaOset = zclOTA_DlOffset;
+          zclOTA_DeltaLen = zclOTA_ElementLen;
+        }
+
 #if defined OTA_MMO_SIGN
         if ( zclOTA_ElementTag == OTA_ECDSA_SIGNATURE_TAG_ID )
         {
@@ -1487,6 +2569,27 @@ uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
         break;
 
       case ZCL_OTA_PD_ELEMENT_STATE:
+        // Run the image CRC, or expand a compressed image, over the rest of the element in this block in one go
+        if ( ( ( zclOTA_ElementTag == OTA_UPGRADE_IMAGE_TAG_ID ) ||
+               ( zclOTA_ElementTag == OTA_LZ4_IMAGE_TAG_ID ) ) && ( i >= spanEnd ) )
+        {
+          spanEnd = len - i;
+          if ( spanEnd > zclOTA_ElementLen - zclOTA_ElementPos )
+          {
+            spanEnd = ( uint8 ) ( zclOTA_ElementLen - zclOTA_ElementPos );
+          }
+
+          if ( zclOTA_ElementTag == OTA_UPGRADE_IMAGE_TAG_ID )
+          {
+            HalOTACrcUpdate ( pData + i, spanEnd );
+          }
+          else if ( ( build = HalOTALz4Feed ( pData + i, spanEnd, &zclOTA_DlOffset ) ) == HAL_OTA_BUILD_FAIL )
+          {
+            return ZCL_STATUS_INVALID_IMAGE;
+          }
+          spanEnd += i;
+        }
+
 #if defined OTA_MMO_SIGN
         if ( zclOTA_ElementTag == OTA_ECDSA_SIGNATURE_TAG_ID )
         {
@@ -1508,17 +2611,14 @@ uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
         if ( ++zclOTA_ElementPos == zclOTA_ElementLen )
         {
           // Element is complete
-          if ( zclOTA_ElementTag == OTA_UPGRADE_IMAGE_TAG_ID )
+          if ( ( zclOTA_ElementTag == OTA_UPGRADE_IMAGE_TAG_ID ) ||
+               ( zclOTA_ElementTag == OTA_LZ4_IMAGE_TAG_ID ) )
           {
-            // The serial flash can take up to 25 ms before it is ready for a read
-            uint32 k;
-            for ( k=0; k<0xffff; k++ )
-            {
-              asm ( "NOP" );
-            }
-
             // When the image is complete, verify CRC
-            if ( HalOTAChkDL ( HAL_OTA_CRC_OSET ) != SUCCESS )
+            // unless it is still expanding, zclOTA_Lz4Step() checks it then
+            if ( ( build != HAL_OTA_BUILD_WAIT ) &&
+                 ( ( ( zclOTA_ElementTag == OTA_LZ4_IMAGE_TAG_ID ) && ( build != HAL_OTA_BUILD_DONE ) ) ||
+                   ( HalOTACrcCheck() != SUCCESS ) ) )
             {
 #if (defined HAL_LCD) && (HAL_LCD == TRUE)
               HalLcdWriteString ( "OTA CRC Fail", HAL_LCD_LINE_3 );
@@ -1553,6 +2653,7 @@ uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
     // Check if the download is complete
     if ( ++zclOTA_FileOffset >= zclOTA_DownloadedImageSize )
     {
+      zclOTA_WriteDl ( pData + rawStart, i + 1 - rawStart );
       zclOTA_ImageUpgradeStatus = OTA_STATUS_COMPLETE;
 
 #if defined OTA_MMO_SIGN
@@ -1567,11 +2668,207 @@ uint8 zclOTA_ProcessImageData ( uint8 *pData, uint8 len )
 
       return ZSuccess;
     }
+
+    // The rest of the block waits until the element has expanded
+    if ( ( build == HAL_OTA_BUILD_WAIT ) && ( i + 1 == spanEnd ) )
+    {
+      zclOTA_Lz4RestLen = len - spanEnd;
+      if ( zclOTA_Lz4RestLen )
+      {
+        if ( ( zclOTA_Lz4Rest = osal_mem_alloc ( zclOTA_Lz4RestLen ) ) == NULL )
+        {
+          return ZCL_STATUS_ABORT;
+        }
+        osal_memcpy ( zclOTA_Lz4Rest, pData + spanEnd, zclOTA_Lz4RestLen );
+      }
+
+      zclOTA_Lz4Wait = TRUE;
+      osal_set_event ( zclOTA_TaskID, ZCL_OTA_LZ4_EVT );
+      return ZSuccess;
+    }
   }
 
+  zclOTA_WriteDl ( pData + rawStart, len - rawStart );
+
   return ZSuccess;
 }
 
+/******************************************************************************
+ * @fn      zclOTA_WriteDl
+ *
+ * @brief   Write the next bytes of the DL image: the OTA file as downloaded, but
+ *          for compressed image elements, which go in expanded.
+ *
+ * @param   pBuf - pointer to the data
+ * @param   len - length of the data
+ *
+ * @return  none
+ */
+static void zclOTA_WriteDl ( uint8 *pBuf, uint16 len )
+{
+  if ( len )
+  {
+    HalOTAWrite ( zclOTA_DlOffset, pBuf, len, HAL_OTA_DL );
+    zclOTA_DlOffset += len;
+  }
+
+  // An erase may have been started for this block, complete it in the background
+  if ( HalOTAPoll() != HAL_OTA_XNV_IDLE )
+  {
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+  }
+}
+
+#if OTA_RESUME
+/******************************************************************************
+ * @fn      zclOTA_InitCheckpoint
+ *
+ * @brief   Check the download checkpoint left in NV against the OTA file header
+ *          in the DL image, and drop it if the image no longer holds that file.
+ *
+ * @param   pHeader - OTA file header read from the DL image
+ *
+ * @return  none
+ */
+static void zclOTA_InitCheckpoint ( OTA_ImageHeader_t *pHeader )
+{
+  zclOTA_Checkpoint_t ckpt;
+
+  // A new item is created erased and so holds no checkpoint
+  if ( osal_nv_item_init ( ZCD_NV_OTA_CHECKPOINT, sizeof ( ckpt ), NULL ) != ZSuccess )
+  {
+    return;
+  }
+
+  if ( ( osal_nv_read ( ZCD_NV_OTA_CHECKPOINT, 0, sizeof ( ckpt ), &ckpt ) != ZSuccess ) ||
+       ( ckpt.magic != ZCL_OTA_CKPT_MAGIC ) )
+  {
+    return;
+  }
+
+  if ( ( pHeader->magicNumber == OTA_HDR_MAGIC_NUMBER ) &&
+       osal_memcmp ( &pHeader->fileId, &ckpt.fileId, sizeof ( zclOTA_FileID_t ) ) &&
+       ( ckpt.dlOffset >= sizeof ( OTA_ImageHeader_t ) ) &&
+       ( ckpt.fileOffset < ckpt.imageSize ) &&
+       ( ckpt.dlOffset < HalOTAAvail() ) )
+  {
+    LREP ( "[OTA] download can resume at %d of %d KB\r\n",
+           ( uint16 ) ( ckpt.fileOffset >> 10 ), ( uint16 ) ( ckpt.imageSize >> 10 ) );
+  }
+  else
+  {
+    zclOTA_ClearCheckpoint();
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_SaveCheckpoint
+ *
+ * @brief   Save the download state in NV. The DL image is programmed up to
+ *          zclOTA_DlOffset first, which waits for a pending erase, so nothing
+ *          is saved while one is: the next block tries again.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_SaveCheckpoint ( void )
+{
+  zclOTA_Checkpoint_t ckpt;
+
+  // Nor while a block is still expanding: the input it holds isn't saved
+  if ( zclOTA_Lz4Wait || ( HalOTAPoll() != HAL_OTA_XNV_IDLE ) )
+  {
+    return;
+  }
+
+  HalOTAFlush();
+
+  ckpt.magic = ZCL_OTA_CKPT_MAGIC;
+  osal_memcpy ( &ckpt.fileId, &zclOTA_CurrentDlFileId, sizeof ( zclOTA_FileID_t ) );
+  ckpt.imageSize = zclOTA_DownloadedImageSize;
+  ckpt.fileOffset = zclOTA_FileOffset;
+  ckpt.dlOffset = zclOTA_DlOffset;
+  ckpt.elementLen = zclOTA_ElementLen;
+  ckpt.elementPos = zclOTA_ElementPos;
+  ckpt.deltaOset = zclOTA_DeltaOset;
+  ckpt.deltaLen = zclOTA_DeltaLen;
+  ckpt.headerLen = zclOTA_HeaderLen;
+  ckpt.elementTag = zclOTA_ElementTag;
+  ckpt.stackVersion = zclOTA_DownloadedZigBeeStackVersion;
+  ckpt.pdState = zclOTA_ClientPdState;
+  HalOTABuildSave ( &ckpt.build );
+
+  if ( osal_nv_write ( ZCD_NV_OTA_CHECKPOINT, 0, sizeof ( ckpt ), &ckpt ) == ZSuccess )
+  {
+    zclOTA_CkptOffset = zclOTA_FileOffset;
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_LoadCheckpoint
+ *
+ * @brief   Restore the download state from NV if it is for the file the
+ *          server offers, otherwise drop it: the download starts over.
+ *
+ * @param   pFileId - file offered by the server
+ * @param   imageSize - its size
+ *
+ * @return  none
+ */
+static void zclOTA_LoadCheckpoint ( zclOTA_FileID_t *pFileId, uint32 imageSize )
+{
+  zclOTA_Checkpoint_t ckpt;
+
+  zclOTA_CkptOffset = 0;
+
+  if ( ( osal_nv_read ( ZCD_NV_OTA_CHECKPOINT, 0, sizeof ( ckpt ), &ckpt ) != ZSuccess ) ||
+       ( ckpt.magic != ZCL_OTA_CKPT_MAGIC ) )
+  {
+    return;
+  }
+
+  if ( !osal_memcmp ( pFileId, &ckpt.fileId, sizeof ( zclOTA_FileID_t ) ) ||
+       ( ckpt.imageSize != imageSize ) || ( ckpt.fileOffset >= imageSize ) )
+  {
+    zclOTA_ClearCheckpoint();
+    return;
+  }
+
+  zclOTA_FileOffset = ckpt.fileOffset;
+  zclOTA_DlOffset = ckpt.dlOffset;
+  zclOTA_ElementLen = ckpt.elementLen;
+  zclOTA_ElementPos = ckpt.elementPos;
+  zclOTA_DeltaOset = ckpt.deltaOset;
+  zclOTA_DeltaLen = ckpt.deltaLen;
+  zclOTA_HeaderLen = ckpt.headerLen;
+  zclOTA_ElementTag = ckpt.elementTag;
+  zclOTA_DownloadedZigBeeStackVersion = ckpt.stackVersion;
+  zclOTA_ClientPdState = ckpt.pdState;
+  HalOTABuildLoad ( &ckpt.build );
+  zclOTA_CkptOffset = zclOTA_FileOffset;
+
+  LREP ( "[OTA] resuming download at %d KB\r\n", ( uint16 ) ( zclOTA_FileOffset >> 10 ) );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_ClearCheckpoint
+ *
+ * @brief   Drop the download checkpoint.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_ClearCheckpoint ( void )
+{
+  uint16 magic = 0;
+
+  zclOTA_CkptOffset = 0;
+  osal_nv_write ( ZCD_NV_OTA_CHECKPOINT, 0, sizeof ( magic ), &magic );
+}
+#endif // OTA_RESUME
+
 /******************************************************************************
  * @fn      zclOTA_ProcessImageNotify
  *
@@ -1709,11 +3006,40 @@ static ZStatus_t zclOTA_ProcessQueryNextImageRsp ( zclIncoming_t *pInMsg )
 
       // initialize other variables
       zclOTA_FileOffset = 0;
+      zclOTA_DlOffset = 0;
+      zclOTA_DeltaLen = 0;
+#if OTA_PAGE_REQ
+      zclOTA_PageReq = TRUE;
+      zclOTA_PageEnd = 0;
+#endif
+      zclOTA_BlockSizeMax = ( OTA_BLOCK_SIZE != 0 ) ? OTA_BLOCK_SIZE : zclOTA_FrameBlockSize();
+      zclOTA_BlockSize = zclOTA_BlockSizeMax;
+      zclOTA_BlockRun = 0;
+      zclOTA_Srtt8 = 0;
+      zclOTA_RttPending = FALSE;
       zclOTA_ClientPdState = ZCL_OTA_PD_MAGIC_0_STATE;
+#if OTA_RESUME
+      // Carry on from the checkpoint of an interrupted download of the same file
+      zclOTA_LoadCheckpoint ( &param.fileId, param.imageSize );
+#endif
+#if OTA_WINDOW > 1
+      zclOTA_WinOpen();
+#endif
+      zclOTA_RateStart();
+      zclOTA_Lz4Stop();
 
       // set state to 'in progress'
       zclOTA_ImageUpgradeStatus = OTA_STATUS_IN_PROGRESS;
 
+      // Keep the flash powered for the download and erase it ahead of the block writes
+      if ( !zclOTA_XnvHeld )
+      {
+        zclOTA_XnvHeld = TRUE;
+        HalOTAAcquire();
+      }
+      HalOTAEraseAhead ( zclOTA_DlOffset, zclOTA_DownloadedImageSize - zclOTA_FileOffset );
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+
       // store server address
       zclOTA_serverAddr = pInMsg->msg->srcAddr;
 
@@ -1721,7 +3047,7 @@ static ZStatus_t zclOTA_ProcessQueryNextImageRsp ( zclIncoming_t *pInMsg )
       osal_memcpy ( &zclOTA_CurrentDlFileId, &param.fileId, sizeof ( zclOTA_FileID_t ) );
 
       // send image block request
-      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_MinBlockReqDelay );
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_BlockReqDelay );
       status = ZCL_STATUS_CMD_HAS_RSP;
 
       osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_QUERY_TO_EVT );
@@ -1805,31 +3131,134 @@ static ZStatus_t zclOTA_ProcessImageBlockRsp ( zclIncoming_t *pInMsg )
     }
     else
     {
+#if OTA_WINDOW > 1
+      // Blocks ahead of the next one in order wait in the window
+      if ( ( zclOTA_WinBuf != NULL ) &&
+           !zclOTA_WinPlace ( param.rsp.success.fileOffset, param.rsp.success.pData,
+                              param.rsp.success.dataSize ) )
+      {
+        return ZSuccess;
+      }
+#endif
+
       // Drop duplicate packets (retries)
       if ( param.rsp.success.fileOffset != zclOTA_FileOffset )
       {
+#if OTA_PAGE_REQ
+        // A block of the page went missing: ask for it on its own, then
+        // carry on with a new page from there
+        if ( ( param.rsp.success.fileOffset > zclOTA_FileOffset ) &&
+             ( param.rsp.success.fileOffset < zclOTA_PageEnd ) )
+        {
+          zclOTA_PageEnd = zclOTA_FileOffset;
+          sendImageBlockReq ( &zclOTA_serverAddr );
+        }
+#endif
+        return ZSuccess;
+      }
+
+      // Not while the last block is still expanding, the block comes again
+      if ( zclOTA_Lz4Wait )
+      {
+#if OTA_PAGE_REQ
+        zclOTA_PageEnd = zclOTA_FileOffset;
+#endif
+        zclOTA_BlockRetry = 0;
+        osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT );
+        return ZSuccess;
+      }
+
+#if OTA_PAGE_REQ
+      // An erase the page itself started can't keep up: stop the page and
+      // ask for the rest once the flash has caught up
+      if ( ( zclOTA_FileOffset < zclOTA_PageEnd ) && ( HalOTAPoll() == HAL_OTA_XNV_STALL ) )
+      {
+        zclOTA_PageEnd = zclOTA_FileOffset;
+        zclOTA_BlockRetry = 0;
+        osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT );
+        zclOTA_XnvStalled = TRUE;
+        osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
         return ZSuccess;
       }
+#endif
 
       status = zclOTA_ProcessImageData ( param.rsp.success.pData, param.rsp.success.dataSize );
+#if OTA_WINDOW > 1
+      // then the blocks it was holding up
+      if ( ( status == ZSuccess ) && ( zclOTA_WinBuf != NULL ) )
+      {
+        status = zclOTA_WinDrain();
+      }
+#endif
+
+      // Time the round trip, unless the request was repeated and the answer could be to either (Karn)
+      if ( zclOTA_RttPending && ( zclOTA_BlockRetry == 0 ) )
+      {
+        zclOTA_RttSample ( zclOTA_ReqTime );
+      }
+      zclOTA_RttPending = FALSE;
+
+      // Clean answers speed the requests up
+      if ( ( status == ZSuccess ) && ( zclOTA_BlockRetry == 0 ) )
+      {
+        zclOTA_RateUp();
+      }
+      zclOTA_RateSample();
 
       // Stop the timer and clear the retry count
       zclOTA_BlockRetry = 0;
       osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT );
 
+      // Try larger blocks again once the link has settled
+      if ( ( zclOTA_BlockSize < zclOTA_BlockSizeMax ) && ( ++zclOTA_BlockRun >= OTA_BLOCK_GROW_COUNT ) )
+      {
+        zclOTA_BlockRun = 0;
+        zclOTA_BlockSize = ( zclOTA_BlockSize > zclOTA_BlockSizeMax / 2 ) ?
+                           zclOTA_BlockSizeMax : ( zclOTA_BlockSize * 2 );
+      }
+
       if ( status == ZSuccess )
       {
-        if ( zclOTA_ImageUpgradeStatus == OTA_STATUS_COMPLETE )
+#if OTA_RESUME
+        if ( ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS ) &&
+             ( zclOTA_FileOffset - zclOTA_CkptOffset >= OTA_CKPT_INTERVAL ) )
         {
-          // send upgrade end req with success status
-          osal_memcpy ( &req.fileId, &param.rsp.success.fileId, sizeof ( zclOTA_FileID_t ) );
-          req.status = ZSuccess;
-          zclOTA_SendUpgradeEndReq ( & ( pInMsg->msg->srcAddr ), &req );
+          zclOTA_SaveCheckpoint();
+        }
+#endif
+
+        if ( zclOTA_Lz4Wait )
+        {
+#if OTA_PAGE_REQ
+          // ZCL_OTA_LZ4_EVT asks for the rest of the page once the block has expanded
+          zclOTA_PageEnd = zclOTA_FileOffset;
+#endif
+#if OTA_FAST_POLL
+          zclOTA_PollSlow();
+#endif
         }
+        else if ( zclOTA_ImageUpgradeStatus == OTA_STATUS_COMPLETE )
+        {
+          status = zclOTA_DownloadDone();
+        }
+#if OTA_PAGE_REQ
+        else if ( zclOTA_FileOffset < zclOTA_PageEnd )
+        {
+          // the rest of the page is on its way, spaced as asked for
+          osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT,
+                               zclOTA_RspTimeout() + zclOTA_PageSpacing );
+#if OTA_FAST_POLL
+          zclOTA_PollFast();
+#endif
+        }
+#endif
         else
         {
+#if OTA_FAST_POLL
+          zclOTA_PollSlow();
+#endif
           // send image block request using rate limiting
-          osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_MinBlockReqDelay );
+          osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_BlockReqDelay );
         }
       }
     }
@@ -1851,6 +3280,18 @@ static ZStatus_t zclOTA_ProcessImageBlockRsp ( zclIncoming_t *pInMsg )
     pData += 4;
     param.rsp.wait.blockReqDelay = BUILD_UINT16 ( pData[0], pData[1] );
 
+#if OTA_PAGE_REQ
+    // the server is not streaming anything
+    zclOTA_PageEnd = zclOTA_FileOffset;
+#endif
+#if OTA_WINDOW > 1
+    // nor serving the requests still outstanding
+    zclOTA_WinBusy &= zclOTA_WinRx;
+#endif
+#if OTA_FAST_POLL
+    zclOTA_PollSlow();
+#endif
+
     // check to see if device supports blockReqDelay rate limiting
     if ( ( zclOTA_ImageBlockFC & OTA_BLOCK_FC_REQ_DELAY_PRESENT ) != 0 )
     {
@@ -1860,6 +3301,9 @@ static ZStatus_t zclOTA_ProcessImageBlockRsp ( zclIncoming_t *pInMsg )
         zclOTA_BlockRetry = 0;
         osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_BLOCK_RSP_TO_EVT );
 
+        // The server is busy, slow down once it takes requests again
+        zclOTA_RateDown();
+
         // set timer for next image block req
         zclOTA_StartTimer ( ZCL_OTA_IMAGE_BLOCK_WAIT_EVT,
                             ( param.rsp.wait.requestTime - param.rsp.wait.currentTime ) );
@@ -1868,8 +3312,9 @@ static ZStatus_t zclOTA_ProcessImageBlockRsp ( zclIncoming_t *pInMsg )
       {
         // if wait timer delta is 0, then update device with blockReqDelay value and use rate limiting
         zclOTA_MinBlockReqDelay = param.rsp.wait.blockReqDelay;
+        zclOTA_BlockReqDelay = MAX ( zclOTA_BlockReqDelay, zclOTA_MinBlockReqDelay );
 
-        osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_MinBlockReqDelay );
+        osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT, zclOTA_BlockReqDelay );
       }
     }
     else
@@ -1904,6 +3349,13 @@ static ZStatus_t zclOTA_ProcessImageBlockRsp ( zclIncoming_t *pInMsg )
   {
     // download failed; set state to 'normal'
     zclOTA_ImageUpgradeStatus = OTA_STATUS_NORMAL;
+    zclOTA_ReleaseXnv();
+#if OTA_RESUME
+    zclOTA_ClearCheckpoint();
+#endif
+#if OTA_WINDOW > 1
+    zclOTA_WinClose();
+#endif
 
     // send upgrade end req with failure status
     osal_memcpy ( &req.fileId, &param.rsp.success.fileId, sizeof ( zclOTA_FileID_t ) );
@@ -2046,10 +3498,39 @@ static ZStatus_t zclOTA_ProcessQuerySpecificFileRsp ( zclIncoming_t *pInMsg )
 
       // initialize other variables
       zclOTA_FileOffset = 0;
+      zclOTA_DlOffset = 0;
+      zclOTA_DeltaLen = 0;
+#if OTA_PAGE_REQ
+      zclOTA_PageReq = TRUE;
+      zclOTA_PageEnd = 0;
+#endif
+      zclOTA_BlockSizeMax = ( OTA_BLOCK_SIZE != 0 ) ? OTA_BLOCK_SIZE : zclOTA_FrameBlockSize();
+      zclOTA_BlockSize = zclOTA_BlockSizeMax;
+      zclOTA_BlockRun = 0;
+      zclOTA_Srtt8 = 0;
+      zclOTA_RttPending = FALSE;
+#if OTA_RESUME
+      // Carry on from the checkpoint of an interrupted download of the same file
+      zclOTA_LoadCheckpoint ( &param.fileId, param.imageSize );
+#endif
+#if OTA_WINDOW > 1
+      zclOTA_WinOpen();
+#endif
+      zclOTA_RateStart();
+      zclOTA_Lz4Stop();
 
       // set state to 'in progress'
       zclOTA_ImageUpgradeStatus = OTA_STATUS_IN_PROGRESS;
 
+      // Keep the flash powered for the download and erase it ahead of the block writes
+      if ( !zclOTA_XnvHeld )
+      {
+        zclOTA_XnvHeld = TRUE;
+        HalOTAAcquire();
+      }
+      HalOTAEraseAhead ( zclOTA_DlOffset, zclOTA_DownloadedImageSize - zclOTA_FileOffset );
+      osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+
       // send image block request
       sendImageBlockReq ( & ( pInMsg->msg->srcAddr ) );
     }
@@ -2136,6 +3617,14 @@ static void zclOTA_ImageBlockWaitExpired ( void )
   // verify in 'in progress' state
   if ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS )
   {
+#if OTA_WINDOW > 1
+    if ( zclOTA_WinBuf != NULL )
+    {
+      // refill the window
+      zclOTA_WinFill();
+    }
+    else
+#endif
     // request next block
     sendImageBlockReq ( &zclOTA_serverAddr );
   }
@@ -2155,6 +3644,32 @@ static void zclOTA_UpgradeComplete ( uint8 status )
   // Go back to the normal state
   zclOTA_ImageUpgradeStatus = OTA_STATUS_NORMAL;
 
+#if OTA_RESUME
+  if ( status == ZSuccess )
+  {
+    zclOTA_ClearCheckpoint();
+  }
+  else if ( zclOTA_FileOffset < zclOTA_DownloadedImageSize )
+  {
+    // Lost the server part way: keep as much of the download as the flash lets us save now
+    zclOTA_SaveCheckpoint();
+  }
+#endif
+
+  // Program whatever is still buffered, whether the download completed or was aborted
+  HalOTAFlush();
+  zclOTA_XnvStalled = FALSE;
+  zclOTA_XnvFinish = FALSE;
+  HalOTADeltaStop();
+  zclOTA_ReleaseXnv();
+#if OTA_WINDOW > 1
+  zclOTA_WinClose();
+#endif
+#if OTA_FAST_POLL
+  // The application sets the poll rate from here on
+  osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_FAST_POLL_EVT );
+#endif
+
   if ( ( zclOTA_DownloadedImageSize == OTA_HEADER_LEN_MIN_ECDSA ) ||
        ( zclOTA_DownloadedImageSize == OTA_HEADER_LEN_MIN ) )
   {
@@ -2191,6 +3706,318 @@ static void zclOTA_UpgradeComplete ( uint8 status )
   }
 }
 
+/******************************************************************************
+ * @fn      zclOTA_ReleaseXnv
+ *
+ * @brief   Drop the download's hold on the external flash so that it can
+ *          enter deep power-down.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_ReleaseXnv ( void )
+{
+  if ( zclOTA_XnvHeld )
+  {
+    uint32 active, down;
+
+    zclOTA_XnvHeld = FALSE;
+    HalOTARelease();
+
+    HalOTAPwrStats ( &active, &down );
+    LREP ( "[FLASH] active %d s, power-down %d s\r\n", ( uint16 ) ( active / 1000 ), ( uint16 ) ( down / 1000 ) );
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_FinishDownload
+ *
+ * @brief   Send the Upgrade End Request of a completed download once the external
+ *          flash is ready, polling on ZCL_OTA_XNV_POLL_EVT until then. Programs
+ *          the last page and, with OTA_PARANOID_CRC, re-checks the whole image.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_FinishDownload ( void )
+{
+  zclOTA_UpgradeEndReqParams_t req;
+  uint32 start;
+
+  if ( zclOTA_ImageUpgradeStatus != OTA_STATUS_COMPLETE )
+  {
+    zclOTA_XnvFinish = FALSE;
+    return;
+  }
+
+  if ( !HalOTAReady() )
+  {
+    zclOTA_XnvFinish = TRUE;
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_XNV_POLL_EVT, OTA_XNV_POLL_PERIOD );
+    return;
+  }
+
+  zclOTA_XnvFinish = FALSE;
+  start = osal_GetSystemClock();
+
+  HalOTAFlush();
+  req.status = ZSuccess;
+
+#if OTA_PARANOID_CRC
+  if ( HalOTAChkDL ( HAL_OTA_CRC_OSET ) != SUCCESS )
+  {
+#if (defined HAL_LCD) && (HAL_LCD == TRUE)
+    HalLcdWriteString ( "OTA CRC Fail", HAL_LCD_LINE_3 );
+#endif
+    // download failed; set state to 'normal'
+    zclOTA_ImageUpgradeStatus = OTA_STATUS_NORMAL;
+    req.status = ZCL_STATUS_INVALID_IMAGE;
+#if OTA_RESUME
+    // Resuming would only keep the bad bytes, start the next download over
+    zclOTA_ClearCheckpoint();
+#endif
+  }
+#endif
+
+  zclOTA_ReleaseXnv();
+
+  LREP ( "[OTA] complete: flash wait %d ms, finish %d ms\r\n",
+         ( uint16 ) ( start - zclOTA_CompleteTime ), ( uint16 ) ( osal_GetSystemClock() - start ) );
+
+  osal_memcpy ( &req.fileId, &zclOTA_CurrentDlFileId, sizeof ( zclOTA_FileID_t ) );
+  zclOTA_SendUpgradeEndReq ( &zclOTA_serverAddr, &req );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_DownloadDone
+ *
+ * @brief   Wrap up the download once the last block is in: finish it as soon
+ *          as the flash has settled, or rebuild a delta image first.
+ *
+ * @param   none
+ *
+ * @return  ZSuccess, or ZCL_STATUS_INVALID_IMAGE if the delta can't be applied
+ */
+static uint8 zclOTA_DownloadDone ( void )
+{
+  zclOTA_CompleteTime = osal_GetSystemClock();
+#if OTA_WINDOW > 1
+  zclOTA_WinClose();
+#endif
+
+  if ( zclOTA_DeltaLen == 0 )
+  {
+    // send upgrade end req with success status as soon as the flash has settled
+    zclOTA_FinishDownload();
+  }
+  else if ( HalOTADeltaStart ( zclOTA_DeltaOset, zclOTA_DeltaLen, zclOTA_DlOffset ) == SUCCESS )
+  {
+    // rebuild the upgrade image first
+    osal_set_event ( zclOTA_TaskID, ZCL_OTA_DELTA_EVT );
+  }
+  else
+  {
+    return ZCL_STATUS_INVALID_IMAGE;
+  }
+
+  return ZSuccess;
+}
+
+/******************************************************************************
+ * @fn      zclOTA_Lz4Step
+ *
+ * @brief   Expand the last block of a compressed image element another step on
+ *          ZCL_OTA_LZ4_EVT, yielding while the flash is stalled behind an erase.
+ *          Once it has expanded, processes the rest of the block and carries on
+ *          with the download.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_Lz4Step ( void )
+{
+  uint8 *pRest = zclOTA_Lz4Rest;
+  uint8 status = ZSuccess;
+  uint8 build;
+
+  if ( !zclOTA_Lz4Wait )
+  {
+    return;
+  }
+
+  if ( ( zclOTA_ImageUpgradeStatus != OTA_STATUS_IN_PROGRESS ) &&
+       ( zclOTA_ImageUpgradeStatus != OTA_STATUS_COMPLETE ) )
+  {
+    zclOTA_Lz4Stop();
+    return;
+  }
+
+  // Don't sit in a write waiting for the erase ahead of the expanded image
+  if ( HalOTAPoll() == HAL_OTA_XNV_STALL )
+  {
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_LZ4_EVT, OTA_XNV_POLL_PERIOD );
+    return;
+  }
+
+  build = HalOTALz4Resume ( &zclOTA_DlOffset );
+
+  if ( build == HAL_OTA_BUILD_WAIT )
+  {
+    osal_set_event ( zclOTA_TaskID, ZCL_OTA_LZ4_EVT );
+    return;
+  }
+
+  zclOTA_Lz4Wait = FALSE;
+  zclOTA_Lz4Rest = NULL;
+
+  // The element ended in that block, verify what it expanded to
+  if ( ( build == HAL_OTA_BUILD_FAIL ) ||
+       ( ( zclOTA_ClientPdState != ZCL_OTA_PD_ELEMENT_STATE ) &&
+         ( ( build != HAL_OTA_BUILD_DONE ) || ( HalOTACrcCheck() != SUCCESS ) ) ) )
+  {
+    status = ZCL_STATUS_INVALID_IMAGE;
+  }
+  else if ( pRest != NULL )
+  {
+    status = zclOTA_ProcessImageData ( pRest, zclOTA_Lz4RestLen );
+  }
+
+  if ( pRest != NULL )
+  {
+    osal_mem_free ( pRest );
+  }
+
+  if ( ( status == ZSuccess ) && ( zclOTA_ImageUpgradeStatus == OTA_STATUS_COMPLETE ) && !zclOTA_Lz4Wait )
+  {
+    status = zclOTA_DownloadDone();
+  }
+
+  if ( status != ZSuccess )
+  {
+    zclOTA_AbortDownload ( status );
+  }
+  else if ( !zclOTA_Lz4Wait && ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS ) )
+  {
+    // back to the blocks
+    osal_set_event ( zclOTA_TaskID, ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT );
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_Lz4Stop
+ *
+ * @brief   Drop a block still expanding and the rest of it held back.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_Lz4Stop ( void )
+{
+  if ( zclOTA_Lz4Rest != NULL )
+  {
+    osal_mem_free ( zclOTA_Lz4Rest );
+    zclOTA_Lz4Rest = NULL;
+  }
+
+  zclOTA_Lz4Wait = FALSE;
+  HalOTALz4Stop();
+}
+
+/******************************************************************************
+ * @fn      zclOTA_AbortDownload
+ *
+ * @brief   Give up on the download outside of a block response and tell the
+ *          server with an Upgrade End Request.
+ *
+ * @param   status - status for the Upgrade End Request
+ *
+ * @return  none
+ */
+static void zclOTA_AbortDownload ( uint8 status )
+{
+  zclOTA_UpgradeEndReqParams_t req;
+
+  // download failed; set state to 'normal'
+  zclOTA_ImageUpgradeStatus = OTA_STATUS_NORMAL;
+  zclOTA_ReleaseXnv();
+#if OTA_RESUME
+  zclOTA_ClearCheckpoint();
+#endif
+#if OTA_WINDOW > 1
+  zclOTA_WinClose();
+#endif
+  zclOTA_Lz4Stop();
+
+  // send upgrade end req with failure status
+  req.status = status;
+  osal_memcpy ( &req.fileId, &zclOTA_CurrentDlFileId, sizeof ( zclOTA_FileID_t ) );
+  zclOTA_SendUpgradeEndReq ( &zclOTA_serverAddr, &req );
+}
+
+/******************************************************************************
+ * @fn      zclOTA_DeltaStep
+ *
+ * @brief   Rebuild the upgrade image of a completed delta download a step at a
+ *          time on ZCL_OTA_DELTA_EVT, then finish the download as usual once the
+ *          rebuilt image passes its CRC check.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_DeltaStep ( void )
+{
+  zclOTA_UpgradeEndReqParams_t req;
+  uint8 status;
+
+  if ( zclOTA_ImageUpgradeStatus != OTA_STATUS_COMPLETE )
+  {
+    HalOTADeltaStop();
+    return;
+  }
+
+  // Don't sit in a write waiting for the erase ahead of the rebuilt image
+  if ( HalOTAPoll() == HAL_OTA_XNV_STALL )
+  {
+    osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_DELTA_EVT, OTA_XNV_POLL_PERIOD );
+    return;
+  }
+
+  status = HalOTADeltaStep();
+
+  if ( status == HAL_OTA_BUILD_BUSY )
+  {
+    osal_set_event ( zclOTA_TaskID, ZCL_OTA_DELTA_EVT );
+    return;
+  }
+
+  if ( ( status == HAL_OTA_BUILD_DONE ) && ( HalOTACrcCheck() == SUCCESS ) )
+  {
+    LREP ( "[OTA] delta applied in %d ms\r\n", ( uint16 ) ( osal_GetSystemClock() - zclOTA_CompleteTime ) );
+    zclOTA_FinishDownload();
+    return;
+  }
+
+#if (defined HAL_LCD) && (HAL_LCD == TRUE)
+  HalLcdWriteString ( "OTA CRC Fail", HAL_LCD_LINE_3 );
+#endif
+  // download failed; set state to 'normal'
+  zclOTA_ImageUpgradeStatus = OTA_STATUS_NORMAL;
+  zclOTA_ReleaseXnv();
+#if OTA_RESUME
+  zclOTA_ClearCheckpoint();
+#endif
+
+  // send upgrade end req with failure status
+  req.status = ZCL_STATUS_INVALID_IMAGE;
+  osal_memcpy ( &req.fileId, &zclOTA_CurrentDlFileId, sizeof ( zclOTA_FileID_t ) );
+  zclOTA_SendUpgradeEndReq ( &zclOTA_serverAddr, &req );
+}
+
 /******************************************************************************
  * @fn      zclOTA_ProcessZDOMsgs
  *
@@ -2333,6 +4160,86 @@ void zclOTA_ProcessFileReadRsp ( uint8* pMsg, zclOTA_FileID_t *pFileId,
 
   // Send the block response to the peer
   zclOTA_SendImageBlockRsp ( pAddr, &blockRsp );
+
+  // Stream the next block of an Image Page Request
+  if ( ( zclOTA_SrvPage.end != 0 ) &&
+       ( pAddr->addr.shortAddr == zclOTA_SrvPage.addr.addr.shortAddr ) &&
+       ( pAddr->endPoint == zclOTA_SrvPage.addr.endPoint ) )
+  {
+    if ( ( blockRsp.status != ZSuccess ) || ( blockRsp.rsp.success.dataSize == 0 ) )
+    {
+      zclOTA_SrvPage.end = 0;
+    }
+    else if ( blockRsp.rsp.success.fileOffset == zclOTA_SrvPage.offset )
+    {
+      zclOTA_SrvPage.offset += blockRsp.rsp.success.dataSize;
+
+      if ( zclOTA_SrvPage.offset >= zclOTA_SrvPage.end )
+      {
+        zclOTA_SrvPage.end = 0;
+      }
+      else if ( zclOTA_SrvPage.spacing == 0 )
+      {
+        osal_set_event ( zclOTA_TaskID, ZCL_OTA_PAGE_RSP_EVT );
+      }
+      else
+      {
+        osal_start_timerEx ( zclOTA_TaskID, ZCL_OTA_PAGE_RSP_EVT, zclOTA_SrvPage.spacing );
+      }
+    }
+  }
+}
+
+/******************************************************************************
+ * @fn      zclOTA_SrvBlockSize
+ *
+ * @brief   Largest image block served. With ZIGBEE_FRAGMENTATION the response
+ *          is sent in fragments, otherwise it has to fit one frame.
+ *
+ * @param   none
+ *
+ * @return  block size
+ */
+static uint8 zclOTA_SrvBlockSize ( void )
+{
+#if defined ZIGBEE_FRAGMENTATION
+  return OTA_FRAG_BLOCK_SIZE;
+#else
+  return zclOTA_FrameBlockSize();
+#endif
+}
+
+/******************************************************************************
+ * @fn      zclOTA_SrvPageRead
+ *
+ * @brief   Read the next block of the page being streamed from the OTA Console.
+ *          zclOTA_ProcessFileReadRsp() sends it and paces the one after.
+ *
+ * @param   none
+ *
+ * @return  none
+ */
+static void zclOTA_SrvPageRead ( void )
+{
+  uint8 len;
+
+  if ( zclOTA_SrvPage.end == 0 )
+  {
+    return;
+  }
+
+  len = zclOTA_SrvPage.blockLen;
+  if ( zclOTA_SrvPage.end - zclOTA_SrvPage.offset < len )
+  {
+    len = ( uint8 ) ( zclOTA_SrvPage.end - zclOTA_SrvPage.offset );
+  }
+
+  // The client falls back to block requests for whatever is not sent
+  if ( MT_OtaFileReadReq ( &zclOTA_SrvPage.addr, &zclOTA_SrvPage.fileId, len,
+                           zclOTA_SrvPage.offset ) != ZSuccess )
+  {
+    zclOTA_SrvPage.end = 0;
+  }
 }
 
 /******************************************************************************
@@ -2447,9 +4354,9 @@ ZStatus_t zclOTA_Srv_ImageBlockReq ( afAddrType_t *pSrcAddr, zclOTA_ImageBlockRe
     {
       uint8 len = pParam->maxDataSize;
 
-      if ( len > OTA_MAX_MTU )
+      if ( len > zclOTA_SrvBlockSize() )
       {
-        len = OTA_MAX_MTU;
+        len = zclOTA_SrvBlockSize();
       }
 
       // The item already exists in NV memory, read it from NV memory
@@ -2505,7 +4412,10 @@ ZStatus_t zclOTA_Srv_ImageBlockReq ( afAddrType_t *pSrcAddr, zclOTA_ImageBlockRe
 /******************************************************************************
  * @fn      zclOTA_Srv_ImagePageReq
  *
- * @brief   Handle an Image Page Request.  Note: Not currently supported.
+ * @brief   Handle an Image Page Request. The page is read from the OTA Console
+ *          a block at a time and sent as Image Block Responses spaced by
+ *          responseSpacing, or the minimum block request delay if longer.
+ *          A new page request supersedes the page being streamed.
  *
  * @param   pSrcAddr - The source of the message
  *          pParam - message parameters
@@ -2514,8 +4424,45 @@ ZStatus_t zclOTA_Srv_ImageBlockReq ( afAddrType_t *pSrcAddr, zclOTA_ImageBlockRe
  */
 ZStatus_t zclOTA_Srv_ImagePageReq ( afAddrType_t *pSrcAddr, zclOTA_ImagePageReqParams_t *pParam )
 {
-  // Send not supported resposne
-  return ZUnsupClusterCmd;
+  uint32 end;
+
+  if ( pParam->fileId.version != queryResponse.fileId.version )
+  {
+    return ZCL_STATUS_NO_IMAGE_AVAILABLE;
+  }
+
+  if ( !zclOTA_Permit )
+  {
+    return ZFailure;
+  }
+
+  end = pParam->fileOffset + pParam->pageSize;
+  if ( end > queryResponse.imageSize )
+  {
+    end = queryResponse.imageSize;
+  }
+
+  if ( ( pParam->maxDataSize == 0 ) || ( pParam->fileOffset >= end ) )
+  {
+    return ZCL_STATUS_INVALID_VALUE;
+  }
+
+  // The item already exists in NV memory, read it from NV memory
+  osal_nv_read ( ZCD_NV_OTA_BLOCK_REQ_DELAY, 0,
+                 sizeof ( zclOTA_MinBlockReqDelay ), &zclOTA_MinBlockReqDelay );
+
+  osal_stop_timerEx ( zclOTA_TaskID, ZCL_OTA_PAGE_RSP_EVT );
+
+  zclOTA_SrvPage.addr = *pSrcAddr;
+  osal_memcpy ( &zclOTA_SrvPage.fileId, &pParam->fileId, sizeof ( zclOTA_FileID_t ) );
+  zclOTA_SrvPage.offset = pParam->fileOffset;
+  zclOTA_SrvPage.end = end;
+  zclOTA_SrvPage.spacing = MAX ( pParam->responseSpacing, zclOTA_MinBlockReqDelay );
+  zclOTA_SrvPage.blockLen = MIN ( pParam->maxDataSize, zclOTA_SrvBlockSize() );
+
+  zclOTA_SrvPageRead();
+
+  return ZCL_STATUS_CMD_HAS_RSP;
 }
 
 /******************************************************************************
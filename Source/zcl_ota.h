@@ -60,10 +60,106 @@ extern "C"
 #define ZCL_SE_DEVICEID_PHYSICAL                      0x0507
 
 #define OTA_MIN_FILENAME_LEN                          27
-#define OTA_MAX_MTU                                   32
+#define OTA_MAX_MTU                                   32    // Block size every server serves, the client backs off to it
 #define OTA_MAX_BLOCK_RETRIES                         10
 #define OTA_MAX_END_REQ_RETRIES                       2
-#define OTA_MAX_BLOCK_RSP_WAIT_TIME                   ((uint16)5000)
+#define OTA_MAX_BLOCK_RSP_WAIT_TIME                   ((uint16)5000)  // Block response timeout before the first RTT sample, and its cap
+#define OTA_MIN_BLOCK_RSP_WAIT_TIME                   ((uint16)300)   // Floor of the RTT based block response timeout
+#define OTA_XNV_POLL_PERIOD                           10    // ms between checks of a pending flash erase
+
+// Re-read the whole image from flash to check the CRC on completion, on top of the running CRC
+#if !defined OTA_PARANOID_CRC
+#define OTA_PARANOID_CRC                              FALSE
+#endif
+
+// Fetch the image with Image Page Requests, falling back to Image Block Requests for lost blocks
+#if !defined OTA_PAGE_REQ
+#define OTA_PAGE_REQ                                  TRUE
+#endif
+#if !defined OTA_PAGE_SIZE
+#define OTA_PAGE_SIZE                                 256   // bytes streamed per Image Page Request
+#endif
+#if !defined OTA_PAGE_RSP_SPACING
+#define OTA_PAGE_RSP_SPACING                          50    // ms between the blocks of a page
+#endif
+
+// Save the download state every OTA_CKPT_INTERVAL bytes, so that it resumes after a reset or a
+// lost parent. Not with OTA_MMO_SIGN: the image hash is not saved.
+#if !defined OTA_RESUME
+#if defined OTA_MMO_SIGN
+#define OTA_RESUME                                    FALSE
+#else
+#define OTA_RESUME                                    TRUE
+#endif
+#endif
+#if !defined OTA_CKPT_INTERVAL
+#define OTA_CKPT_INTERVAL                             4096  // bytes of the OTA file between checkpoints
+#endif
+#if OTA_RESUME && defined OTA_MMO_SIGN
+#error "OTA_RESUME does not save the OTA_MMO_SIGN image hash"
+#endif
+
+// NV item of the download checkpoint, next to NW_APP_CONFIG in zcl_app.h
+#define ZCD_NV_OTA_CHECKPOINT                         0x0402
+
+// Largest block the client asks for. 0 sizes a block to fill one frame, see zclOTA_FrameBlockSize().
+// Larger blocks, up to 241 bytes, need ZIGBEE_FRAGMENTATION on both ends.
+#if !defined OTA_BLOCK_SIZE
+#define OTA_BLOCK_SIZE                                0
+#endif
+// Frame bytes left free for a source route subframe (2 + 2 per relay)
+#if !defined OTA_FRAME_RESERVE
+#define OTA_FRAME_RESERVE                             8
+#endif
+// Blocks received in a row before the client tries twice the block size again
+#if !defined OTA_BLOCK_GROW_COUNT
+#define OTA_BLOCK_GROW_COUNT                          16
+#endif
+// Image Block Requests kept outstanding at once. Blocks that arrive ahead of the next one in
+// order wait in RAM, OTA_WINDOW times the largest block, until the gap before them is filled.
+// Above 1 the client pipelines Image Block Requests instead of sending Image Page Requests.
+#if !defined OTA_WINDOW
+#if defined RTR_NWK
+#define OTA_WINDOW                                    4
+#else
+#define OTA_WINDOW                                    1
+#endif
+#endif
+#if OTA_WINDOW > 8
+#error "OTA_WINDOW slots are tracked in a uint8 bitmap"
+#endif
+
+// Block request pacing (AIMD): the delay between block requests drops by OTA_RATE_STEP ms for
+// every block received cleanly and doubles, to at least OTA_RATE_BACKOFF_MIN ms, on a lost block
+// or a busy server. It stays between the server's Minimum Block Request Delay and OTA_RATE_MAX_DELAY.
+#if !defined OTA_RATE_STEP
+#define OTA_RATE_STEP                                 10
+#endif
+#if !defined OTA_RATE_BACKOFF_MIN
+#define OTA_RATE_BACKOFF_MIN                          50
+#endif
+#if !defined OTA_RATE_MAX_DELAY
+#define OTA_RATE_MAX_DELAY                            2000
+#endif
+#if !defined OTA_RATE_PERIOD
+#define OTA_RATE_PERIOD                               5000  // ms between samples of the download rate
+#endif
+#define OTA_DELAY_HISTORY_LEN                         8     // block request delays kept in ATTRID_DELAY_HISTORY
+
+// End devices poll their parent every OTA_FAST_POLL_RATE ms from each block request until the
+// block arrives or OTA_FAST_POLL_TIME passes, and every OTA_SLOW_POLL_RATE ms in between
+#if !defined OTA_FAST_POLL
+#define OTA_FAST_POLL                                 ZG_BUILD_ENDDEVICE_TYPE
+#endif
+#if !defined OTA_FAST_POLL_RATE
+#define OTA_FAST_POLL_RATE                            50
+#endif
+#if !defined OTA_FAST_POLL_TIME
+#define OTA_FAST_POLL_TIME                            1000
+#endif
+#if !defined OTA_SLOW_POLL_RATE
+#define OTA_SLOW_POLL_RATE                            1000
+#endif
 
 // Simple descriptor values
 #define ZCL_OTA_ENDPOINT                              14
@@ -128,6 +224,12 @@ extern "C"
 #define ATTRID_IMAGE_TYPE_ID                          0x0008  // UINT16, R, O
 #define ATTRID_MINIMUM_BLOCK_REQ_DELAY                0x0009  // UINT16, R, O
 #define ATTRID_IMAGE_STAMP                            0x000A  // UINT32, R, O
+// Diagnostics of this client, read without a manufacturer code. They sit above the standard
+// attributes (0x0000-0x4FFF) and below the global ones (0xF000-0xFFFF)
+#define ATTRID_BOOT_STATUS                            0x5000  // UINT16, R: pages written/skipped by the last boot copy
+#define ATTRID_DOWNLOAD_RATE                          0x5001  // UINT16, R: bytes/s over the last OTA_RATE_PERIOD
+#define ATTRID_BLOCK_LOSSES                           0x5002  // UINT16, R: block responses timed out this download
+#define ATTRID_DELAY_HISTORY                          0x5003  // OCTET_STR, R: uint16 block request delays, newest first
 
 // OTA Upgrade Status
 #define OTA_STATUS_NORMAL                             0x00
@@ -196,6 +298,13 @@ extern "C"
 #define ZCL_OTA_IMAGE_BLOCK_REQ_DELAY_EVT             0x0020
 #define ZCL_OTA_SEND_MATCH_DESCRIPTOR_EVT             0x0040
 #define ZCL_OTA_SEND_IEEE_ADD_REQ_EVT                 0x0080
+#define ZCL_OTA_XNV_POLL_EVT                          0x0100
+#define ZCL_OTA_DELTA_EVT                             0x0200
+#define ZCL_OTA_FAST_POLL_EVT                         0x0800
+#define ZCL_OTA_LZ4_EVT                               0x1000
+
+// Server Task Events
+#define ZCL_OTA_PAGE_RSP_EVT                          0x0400
 
 
 // The OTA Upgrade delay is the number of seconds before the client
@@ -211,6 +320,8 @@ extern "C"
 #define OTA_UPGRADE_IMAGE_TAG_ID                      0
 #define OTA_ECDSA_SIGNATURE_TAG_ID                    1
 #define OTA_ECDSA_CERT_TAG_ID                         2
+#define OTA_DELTA_IMAGE_TAG_ID                        0xF000  // Manufacturer specific, see HalOTADeltaStart()
+#define OTA_LZ4_IMAGE_TAG_ID                          0xF001  // Manufacturer specific, see HalOTALz4Feed()
 
 // OTA Client process data states
 #define ZCL_OTA_PD_MAGIC_0_STATE                      0
@@ -0,0 +1,83 @@
+"""Re-stamp an OTA upgrade image (.zigbee) with the checksum type checked by Source/hal_ota.c.
+
+OtaConverter.exe fills the CRC control block (HAL_OTA_CRC_ADDR) with the software
+0x1021 CRC, checksum type 0. Type 1 is the CC2530 RNDL/RNDH CRC16 unit (polynomial
+0x8005, MSB first, seed 0x0000), which HalOTAChkDL() and the boot code run in hardware.
+The type lives in the top byte of the program size, the low 24 bits are the length.
+
+The boot code checks the image again before running it, and stock boot code only
+knows type 0: a type 1 image downloads fine and then never boots. Only use
+--type hw for devices running boot code built from this tree, with the
+application built with HAL_OTA_BOOT_CRC_HW=TRUE (HalOTAChkDL() rejects type 1
+otherwise).
+
+    python ota_crc.py IMAGE.zigbee [-o OUT.zigbee] [--type 1021|hw]
+"""
+import argparse
+import struct
+
+HAL_OTA_RC_START = 0x0800
+HAL_OTA_CRC_ADDR = 0x0888
+CRC_OSET = HAL_OTA_CRC_ADDR - HAL_OTA_RC_START
+SUB_ELEMENT_HDR_LEN = 6
+SIZE_MASK = 0x00FFFFFF
+TYPES = {'1021': 0x00, 'hw': 0x01}
+
+
+def crc_1021(data):
+    """runPoly(): augmented CRC16, polynomial 0x1021."""
+    crc = 0
+    for val in data:
+        for bit in range(8):
+            msb = crc & 0x8000
+            crc = ((crc << 1) | ((val >> (7 - bit)) & 1)) & 0xFFFF
+            if msb:
+                crc ^= 0x1021
+    return crc
+
+
+def crc_hw(data):
+    """runHwPoly(): CRC16, polynomial 0x8005, as the CC2530 LFSR runs on writes to RNDH."""
+    crc = 0
+    for val in data:
+        crc ^= val << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x8005) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('image', help='OTA upgrade image made by OtaConverter')
+    parser.add_argument('-o', '--output', help='output file, default is to rewrite the image')
+    parser.add_argument('--type', choices=sorted(TYPES), default='1021',
+                        help='checksum type, hw needs boot code built from this tree')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = bytearray(f.read())
+
+    header_len = struct.unpack_from('<H', image, 6)[0]
+    start = header_len + SUB_ELEMENT_HDR_LEN
+    crc_pos = start + CRC_OSET
+    size = struct.unpack_from('<I', image, crc_pos + 4)[0] & SIZE_MASK
+    if size == SIZE_MASK:
+        # Preamble default, the image was not post-processed: take the sub-element length.
+        size = struct.unpack_from('<I', image, header_len + 2)[0]
+    if start + size > len(image):
+        raise SystemExit('program size 0x%X runs past the end of the image' % size)
+
+    ctype = TYPES[args.type]
+    struct.pack_into('<I', image, crc_pos + 4, (ctype << 24) | size)
+    body = image[start:crc_pos] + image[crc_pos + 4:start + size]
+    crc = crc_hw(body) if ctype else crc_1021(body)
+    # The shadow stays erased, the boot code programs it once the image checks out.
+    struct.pack_into('<HH', image, crc_pos, crc, 0xFFFF)
+
+    with open(args.output or args.image, 'wb') as f:
+        f.write(image)
+    print('type %d, program size 0x%X, crc 0x%04X' % (ctype, size, crc))
+
+
+if __name__ == '__main__':
+    main()
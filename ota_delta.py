@@ -0,0 +1,162 @@
+"""Make a delta OTA file that Source/hal_ota.c rebuilds into a full upgrade image on the device.
+
+The delta image element (tag 0xF000, OTA_DELTA_IMAGE_TAG_ID) patches the program image the
+device is running, named by the CRC in its CRC control block. After the download the client
+rebuilds the upgrade image element into external flash behind the OTA file, checks its CRC
+and the boot code copies it as usual. Payload, little-endian:
+
+    uint16 magic (0xDE17), uint16 source CRC, uint32 target length, then ops:
+    0x01 COPY   uint32 src, uint16 len    bytes of the running program image
+    0x02 INSERT uint16 len, len bytes     literal bytes
+    0x00 END
+
+    python ota_delta.py OLD.zigbee NEW.zigbee [-o OUT.zigbee] [--block 16]
+"""
+import argparse
+import struct
+
+from ota_crc import CRC_OSET, SIZE_MASK, SUB_ELEMENT_HDR_LEN, crc_1021, crc_hw
+
+UPGRADE_IMAGE_TAG_ID = 0x0000
+DELTA_IMAGE_TAG_ID = 0xF000
+DELTA_MAGIC = 0xDE17
+OP_END, OP_COPY, OP_INSERT = 0x00, 0x01, 0x02
+OP_MAX_LEN = 0xFFFF
+# The CRC and its shadow differ between the file and the running image.
+MASK_START, MASK_END = CRC_OSET, CRC_OSET + 4
+TOTAL_IMAGE_SIZE_OSET = 52
+
+
+def image_element(image):
+    """Return the payload of the upgrade image element of an OTA file."""
+    header_len = struct.unpack_from('<H', image, 6)[0]
+    oset = header_len
+    while oset + SUB_ELEMENT_HDR_LEN <= len(image):
+        tag, length = struct.unpack_from('<HI', image, oset)
+        oset += SUB_ELEMENT_HDR_LEN
+        if tag == UPGRADE_IMAGE_TAG_ID:
+            return bytes(image[oset:oset + length])
+        oset += length
+    raise SystemExit('no upgrade image element')
+
+
+def program_size(program):
+    """Program size and CRC type from the CRC control block, as HalOTAChkDL() reads them."""
+    size = struct.unpack_from('<I', program, CRC_OSET + 4)[0]
+    return size & SIZE_MASK, size >> 24
+
+
+def check_crc(program):
+    size, ctype = program_size(program)
+    body = program[:CRC_OSET] + program[CRC_OSET + 4:size]
+    crc = crc_hw(body) if ctype else crc_1021(body)
+    return crc == struct.unpack_from('<H', program, CRC_OSET)[0]
+
+
+def make_patch(old, new, block):
+    """Greedy COPY/INSERT patch of new against the first len(old) bytes of the running image."""
+    index = {}
+    for pos in range(len(old) - block + 1):
+        if pos + block > MASK_START and pos < MASK_END:
+            continue
+        index.setdefault(old[pos:pos + block], pos)
+
+    ops = []
+    literal = bytearray()
+
+    def flush():
+        for start in range(0, len(literal), OP_MAX_LEN):
+            chunk = literal[start:start + OP_MAX_LEN]
+            ops.append(struct.pack('<BH', OP_INSERT, len(chunk)) + bytes(chunk))
+        del literal[:]
+
+    pos = 0
+    while pos < len(new):
+        src = index.get(new[pos:pos + block])
+        if src is None:
+            literal.append(new[pos])
+            pos += 1
+            continue
+        length = block
+        while (pos + length < len(new) and src + length < len(old) and length < OP_MAX_LEN and
+               not MASK_START <= src + length < MASK_END and new[pos + length] == old[src + length]):
+            length += 1
+        flush()
+        ops.append(struct.pack('<BIH', OP_COPY, src, length))
+        pos += length
+    flush()
+    ops.append(struct.pack('<B', OP_END))
+    return b''.join(ops)
+
+
+def apply_patch(payload, running):
+    """What HalOTADeltaStep() does, on the host."""
+    magic, src_crc, target_len = struct.unpack_from('<HHI', payload, 0)
+    if magic != DELTA_MAGIC:
+        raise ValueError('bad magic')
+    out = bytearray()
+    pos = 8
+    while True:
+        op = payload[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_COPY:
+            src, length = struct.unpack_from('<IH', payload, pos)
+            pos += 6
+            out += running[src:src + length]
+        elif op == OP_INSERT:
+            length = struct.unpack_from('<H', payload, pos)[0]
+            pos += 2
+            out += payload[pos:pos + length]
+            pos += length
+        else:
+            raise ValueError('bad op 0x%02X' % op)
+    if len(out) != target_len:
+        raise ValueError('rebuilt %d bytes, expected %d' % (len(out), target_len))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('old', help='OTA file of the image running on the devices')
+    parser.add_argument('new', help='OTA file of the upgrade image')
+    parser.add_argument('-o', '--output', help='output file, default is NEW with a .delta suffix')
+    parser.add_argument('--block', type=int, default=16, help='shortest match turned into a COPY')
+    args = parser.parse_args()
+
+    with open(args.old, 'rb') as f:
+        old_file = f.read()
+    with open(args.new, 'rb') as f:
+        new_file = bytearray(f.read())
+
+    old = image_element(old_file)
+    new = image_element(new_file)
+    old_size = program_size(old)[0]
+    if old_size > len(old):
+        raise SystemExit('old program size 0x%X runs past its element' % old_size)
+    old = old[:old_size]
+    if not check_crc(new):
+        raise SystemExit('the upgrade image CRC does not check out, run ota_crc.py on it first')
+
+    src_crc = struct.unpack_from('<H', old, CRC_OSET)[0]
+    payload = struct.pack('<HHI', DELTA_MAGIC, src_crc, len(new)) + make_patch(old, new, args.block)
+
+    # The device copies from its running image, where the shadow CRC has been programmed.
+    running = bytearray(old)
+    struct.pack_into('<H', running, CRC_OSET + 2, src_crc)
+    if apply_patch(payload, bytes(running)) != new:
+        raise SystemExit('internal error: the patch does not rebuild the upgrade image')
+
+    header_len = struct.unpack_from('<H', new_file, 6)[0]
+    out = new_file[:header_len] + struct.pack('<HI', DELTA_IMAGE_TAG_ID, len(payload)) + payload
+    struct.pack_into('<I', out, TOTAL_IMAGE_SIZE_OSET, len(out))
+
+    with open(args.output or args.new + '.delta', 'wb') as f:
+        f.write(out)
+    print('source crc 0x%04X, target 0x%X bytes, delta %d bytes (%.1f%%)'
+          % (src_crc, len(new), len(out), 100.0 * len(out) / len(new_file)))
+
+
+if __name__ == '__main__':
+    main()
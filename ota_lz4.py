@@ -0,0 +1,143 @@
+"""Compress the upgrade image element of an OTA file for HalOTALz4Feed() in Source/hal_ota.c.
+
+The upgrade image element is replaced by a compressed image element (tag 0xF001,
+OTA_LZ4_IMAGE_TAG_ID) holding the uint32 program image length, little-endian, followed
+by the program image as one LZ4 block. The client expands it into the DL image as the
+blocks arrive, so the boot code finds the usual upgrade image element there. The CRC
+control block is checked on the expanded image: stamp it with ota_crc.py first.
+
+    python ota_lz4.py IMAGE.zigbee [-o OUT.zigbee]
+"""
+import argparse
+import struct
+
+from ota_crc import SUB_ELEMENT_HDR_LEN
+from ota_delta import TOTAL_IMAGE_SIZE_OSET, UPGRADE_IMAGE_TAG_ID, check_crc
+
+LZ4_IMAGE_TAG_ID = 0xF001
+MIN_MATCH = 4
+LAST_LITERALS = 5   # LZ4 block rules: the last 5 bytes are literals ...
+MF_LIMIT = 12       # ... and the last match starts at least 12 bytes before the end.
+MAX_OFFSET = 0xFFFF
+
+
+def _length(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def _sequence(out, literals, offset=0, match=0):
+    lit = len(literals)
+    ml = match - MIN_MATCH if offset else 0
+    out.append((min(lit, 15) << 4) | min(ml, 15))
+    if lit >= 15:
+        _length(out, lit - 15)
+    out += literals
+    if offset:
+        out += struct.pack('<H', offset)
+        if ml >= 15:
+            _length(out, ml - 15)
+
+
+def compress(data):
+    """Greedy LZ4 block compressor, readable by any LZ4 block decoder."""
+    out = bytearray()
+    table = {}
+    anchor = pos = 0
+    limit = len(data) - MF_LIMIT
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        cand = table.get(key)
+        table[key] = pos
+        if cand is None or pos - cand > MAX_OFFSET:
+            pos += 1
+            continue
+        match = MIN_MATCH
+        end = len(data) - LAST_LITERALS - pos
+        while match < end and data[cand + match] == data[pos + match]:
+            match += 1
+        _sequence(out, data[anchor:pos], pos - cand, match)
+        pos += match
+        anchor = pos
+    _sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def decompress(block, raw_len):
+    """What HalOTALz4Feed() does, on the host."""
+    out = bytearray()
+    pos = 0
+    while True:
+        token = block[pos]
+        pos += 1
+        lit = token >> 4
+        if lit == 15:
+            while True:
+                lit += block[pos]
+                pos += 1
+                if block[pos - 1] != 255:
+                    break
+        out += block[pos:pos + lit]
+        pos += lit
+        if len(out) == raw_len:
+            break
+        offset = struct.unpack_from('<H', block, pos)[0]
+        pos += 2
+        match = (token & 0x0F) + MIN_MATCH
+        if token & 0x0F == 15:
+            while True:
+                match += block[pos]
+                pos += 1
+                if block[pos - 1] != 255:
+                    break
+        if offset == 0 or offset > len(out) or len(out) + match > raw_len:
+            raise ValueError('bad match at block offset %d' % pos)
+        for _ in range(match):
+            out.append(out[-offset])
+        if len(out) == raw_len:
+            break
+    if pos != len(block):
+        raise ValueError('%d bytes left over' % (len(block) - pos))
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('image', help='OTA file with an upgrade image element')
+    parser.add_argument('-o', '--output', help='output file, default is IMAGE with a .lz4 suffix')
+    args = parser.parse_args()
+
+    with open(args.image, 'rb') as f:
+        image = f.read()
+
+    header_len = struct.unpack_from('<H', image, 6)[0]
+    out = bytearray(image[:header_len])
+    oset = header_len
+    raw = None
+    while oset + SUB_ELEMENT_HDR_LEN <= len(image):
+        tag, length = struct.unpack_from('<HI', image, oset)
+        payload = image[oset + SUB_ELEMENT_HDR_LEN:oset + SUB_ELEMENT_HDR_LEN + length]
+        oset += SUB_ELEMENT_HDR_LEN + length
+        if tag == UPGRADE_IMAGE_TAG_ID and raw is None:
+            raw = payload
+            if not check_crc(raw):
+                raise SystemExit('the upgrade image CRC does not check out, run ota_crc.py on it first')
+            block = compress(raw)
+            if decompress(block, len(raw)) != raw:
+                raise SystemExit('internal error: the block does not expand to the upgrade image')
+            tag, payload = LZ4_IMAGE_TAG_ID, struct.pack('<I', len(raw)) + block
+        out += struct.pack('<HI', tag, len(payload)) + payload
+    if raw is None:
+        raise SystemExit('no upgrade image element')
+    struct.pack_into('<I', out, TOTAL_IMAGE_SIZE_OSET, len(out))
+
+    with open(args.output or args.image + '.lz4', 'wb') as f:
+        f.write(out)
+    print('program image 0x%X bytes, OTA file %d -> %d bytes (%.1f%%)'
+          % (len(raw), len(image), len(out), 100.0 * len(out) / len(image)))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,96 @@
+"""Host-side timing model of the external OTA flash driver in Source/hal_ota.c.
+
+Counts the SPI bytes and CPU overhead that HalSPIRead / HalSPIWrite spend for
+the typical OTA access patterns and prints the resulting time and throughput
+for every USART1 clock profile defined in Source/hal_board_cfg.h.
+
+    python spi_timing.py [--image-size BYTES] [--block-size BYTES] [--dma] [--no-page-buf]
+"""
+import argparse
+
+F_CPU = 32e6
+
+# XNV_SPI_PROFILE_* -> (BAUD_E, BAUD_M), see hal_board_cfg.h
+PROFILES = {
+    'XNV_SPI_PROFILE_115K': (11, 216),
+    'XNV_SPI_PROFILE_1M': (15, 0),
+    'XNV_SPI_PROFILE_4M': (17, 0),
+}
+
+# CPU cycles spent around every byte by xnvSPIWrite(): call, TX, RX poll, return.
+CYCLES_PER_BYTE = 20
+# CPU cycles spent per transaction: critical section, P1DIR shadow, CS toggles, NOPs.
+CYCLES_PER_TRANSACTION = 40
+# CPU cycles to set up both xnvSPIBurst() descriptors, arm and trigger (HAL_OTA_SPI_DMA).
+CYCLES_PER_BURST = 120
+# Data phases shorter than this are polled even with HAL_OTA_SPI_DMA (XNV_DMA_MIN_LEN).
+DMA_MIN_LEN = 8
+
+READ_HDR = 1 + 3 + 1    # XNV_READ_CMD, 24-bit address, dummy byte
+STAT_POLL = 1           # XNV_STAT_CMD, one status byte when the part is idle
+WRITE_HDR = 1 + 1 + 3   # XNV_WREN_CMD, XNV_WRPG_CMD, 24-bit address
+FLASH_PAGE = 256
+# HAL_OTA_STREAM_LEN: HalOTAChkDL reads the image a chunk at a time.
+STREAM_LEN_APP = 128
+# HAL_OTA_BOOT_DMA: dl2rc reads a whole internal flash page per transaction.
+INT_FLASH_PAGE = 2048
+
+
+def sck(baud_e, baud_m):
+    return (256 + baud_m) * (2 ** baud_e) / (2 ** 28) * F_CPU
+
+
+def byte_time(f_sck):
+    return 8 / f_sck + CYCLES_PER_BYTE / F_CPU
+
+
+def data_time(f_sck, length, dma):
+    """Data phase of `length` bytes, polled or by xnvSPIBurst()."""
+    if dma and length >= DMA_MIN_LEN:
+        return length * 8 / f_sck + CYCLES_PER_BURST / F_CPU
+    return length * byte_time(f_sck)
+
+
+def read_time(f_sck, length, dma=False):
+    """One HalSPIRead() call of `length` bytes."""
+    nbytes = STAT_POLL + READ_HDR
+    return nbytes * byte_time(f_sck) + data_time(f_sck, length, dma) + CYCLES_PER_TRANSACTION / F_CPU
+
+
+def write_time(f_sck, length, dma=False):
+    """One HalSPIWrite() call of `length` bytes, bus time only (no program time)."""
+    t = 0.0
+    while length > 0:
+        cnt = min(length, FLASH_PAGE)
+        t += ((STAT_POLL + WRITE_HDR) * byte_time(f_sck) + data_time(f_sck, cnt, dma)
+              + CYCLES_PER_TRANSACTION / F_CPU)
+        length -= cnt
+    return t
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('--image-size', type=int, default=200 * 1024, help='upgrade image size in bytes')
+    parser.add_argument('--block-size', type=int, default=32, help='OTA block size in bytes (maxDataSize)')
+    parser.add_argument('--dma', action='store_true', help='model HAL_OTA_SPI_DMA data phases')
+    parser.add_argument('--no-page-buf', action='store_true', help='model HAL_OTA_XNV_PAGE_BUF disabled')
+    args = parser.parse_args()
+
+    size = args.image_size
+    dma = args.dma
+    print('image %d bytes, %d-byte blocks%s' % (size, args.block_size, ', DMA' if dma else ''))
+    # HAL_OTA_XNV_PAGE_BUF turns every block write into part of one page program.
+    prog_len = args.block_size if args.no_page_buf else FLASH_PAGE
+    print('%d page programs' % (size // prog_len))
+    print('%-22s %9s %12s %12s %12s %12s' % ('profile', 'SCK', 'bulk KB/s', 'ChkDL s', 'dl2rc s', 'DL write s'))
+    for name, (e, m) in PROFILES.items():
+        f = sck(e, m)
+        bulk = size / read_time(f, size, dma) / 1024
+        chk = (size // STREAM_LEN_APP) * read_time(f, STREAM_LEN_APP, dma)   # HalOTAChkDL: one HalOTARead per chunk
+        dl2rc = (size // INT_FLASH_PAGE) * read_time(f, INT_FLASH_PAGE, True)  # dl2rc: hidden behind the page erase
+        dl = (size // prog_len) * write_time(f, prog_len, dma)
+        print('%-22s %8.0fk %12.1f %12.2f %12.2f %12.2f' % (name, f / 1e3, bulk, chk, dl2rc, dl))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,118 @@
+"""Source/hal_ota.c built with the host C compiler against tests/host, loaded with ctypes.
+
+The application build (HalOTA* with the write-combining page buffer and the SPI DMA
+bursts) and the boot code build (main() and dl2rc() with its journal) are compiled once
+per run into a temporary directory. $CC picks the compiler, gcc by default.
+"""
+import atexit
+import ctypes
+import os
+import shutil
+import subprocess
+import tempfile
+import unittest
+
+TESTS = os.path.dirname(os.path.abspath(__file__))
+HOST = os.path.join(TESTS, 'host')
+SOURCE = os.path.join(TESTS, os.pardir, 'Source')
+
+HOST_FLASH_SIZE = 0x40000
+HOST_XNV_MAX = 0x100000
+
+HAL_OTA_RC, HAL_OTA_DL = 0, 1
+HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE, HAL_OTA_BUILD_FAIL, HAL_OTA_BUILD_WAIT = 0, 1, 2, 3
+SUCCESS, FAILURE = 0, 1
+
+_builds = {}
+
+
+def _build(boot):
+    tmp = tempfile.mkdtemp(prefix='hal_ota_host')
+    atexit.register(shutil.rmtree, tmp, True)
+    # Copied out of Source/ so that its own includes find the host headers first.
+    shutil.copy(os.path.join(SOURCE, 'hal_ota.c'), tmp)
+    lib = os.path.join(tmp, 'hal_ota_%s.so' % ('boot' if boot else 'app'))
+    cmd = [os.environ.get('CC', 'gcc'), '-std=gnu99', '-O1', '-shared', '-fPIC',
+           '-Wall', '-Wno-unknown-pragmas', '-Wno-address-of-packed-member',
+           '-iquote', tmp, '-iquote', HOST, '-iquote', SOURCE,
+           '-o', lib, os.path.join(HOST, 'hal_ota_host.c')]
+    if boot:
+        # The host has no RNDL/RNDH CRC unit, the images are stamped with the 0x1021 CRC.
+        cmd += ['-DHAL_OTA_BOOT_CODE=TRUE', '-DHAL_OTA_BOOT_CRC_HW=FALSE']
+    try:
+        out = subprocess.run(cmd, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                             universal_newlines=True)
+    except OSError:
+        raise unittest.SkipTest('no host C compiler: %s' % cmd[0])
+    if out.returncode:
+        raise AssertionError('host build of hal_ota.c failed:\n' + out.stdout)
+    return ctypes.CDLL(lib)
+
+
+def _mem(addr, size):
+    return memoryview((ctypes.c_uint8 * size).from_address(addr)).cast('B')
+
+
+class HalOta(object):
+    """One host build of hal_ota.c and its emulated flash, reset for each test."""
+
+    def __init__(self, boot=False):
+        if boot not in _builds:
+            _builds[boot] = _build(boot)
+        self.lib = lib = _builds[boot]
+        u8, u16, u32, p8 = ctypes.c_uint8, ctypes.c_uint16, ctypes.c_uint32, ctypes.POINTER(ctypes.c_uint8)
+        for name, res, args in (
+                ('hostFlashMem', ctypes.c_void_p, []),
+                ('hostXnvMem', ctypes.c_void_p, []),
+                ('hostXnvPart', None, [u8, u8, u8]),
+                ('hostXnvEraseTime', None, [u16, u16, u32]),
+                ('hostXnvErrors', u32, []),
+                ('hostReset', None, [u8]),
+                ('hostCutAt', None, [u32]),
+                ('hostOpCount', u32, []),
+                ('HalOTAInit', None, []),
+                ('HalOTAAvail', u32, []),
+                ('HalOTABootStatus', u16, [])):
+            fn = getattr(lib, name)
+            fn.restype, fn.argtypes = res, args
+        if boot:
+            for name in ('hostBoot', 'hostDl2rc'):
+                fn = getattr(lib, name)
+                fn.restype, fn.argtypes = u8, []
+        else:
+            for name, res, args in (
+                    ('HalOTARead', None, [u32, p8, u16, u8]),
+                    ('HalOTAWrite', None, [u32, p8, u16, u8]),
+                    ('HalOTAFlush', None, []),
+                    ('HalOTAPoll', u8, []),
+                    ('HalOTADeltaStart', u8, [u32, u32, u32]),
+                    ('HalOTADeltaStep', u8, []),
+                    ('HalOTALz4Start', None, []),
+                    ('HalOTALz4Feed', u8, [p8, u16, ctypes.POINTER(u32)]),
+                    ('HalOTALz4Resume', u8, [ctypes.POINTER(u32)])):
+                fn = getattr(lib, name)
+                fn.restype, fn.argtypes = res, args
+        self.flash = _mem(lib.hostFlashMem(), HOST_FLASH_SIZE)
+        self.xnv = _mem(lib.hostXnvMem(), HOST_XNV_MAX)
+        self.flash[:] = b'\xff' * HOST_FLASH_SIZE
+        self.xnv[:] = b'\xff' * HOST_XNV_MAX
+        lib.hostXnvPart(0xEF, 0x40, 0x12)
+        lib.hostXnvEraseTime(1, 1, 1)
+        lib.hostCutAt(0)
+        lib.hostReset(True)
+
+    def __getattr__(self, name):
+        return getattr(self.lib, name)
+
+    def errors(self):
+        """SPI flash protocol errors and flash reads across a bank since the last reset."""
+        return self.lib.hostXnvErrors()
+
+    def write(self, oset, data, image=HAL_OTA_DL):
+        buf = (ctypes.c_uint8 * len(data)).from_buffer_copy(data)
+        self.lib.HalOTAWrite(oset, buf, len(data), image)
+
+    def read(self, oset, length, image=HAL_OTA_DL):
+        buf = (ctypes.c_uint8 * length)()
+        self.lib.HalOTARead(oset, buf, length, image)
+        return bytes(buf)
@@ -0,0 +1,8 @@
+/* Host build of Source/hal_ota.c for the tests: no serial trace. */
+#ifndef DEBUG_H
+#define DEBUG_H
+
+#define LREP(...)
+#define LREPMaster(s)
+
+#endif
@@ -0,0 +1,20 @@
+/* Host build of Source/hal_ota.c for the tests: the OSAL services hal_ota.c calls. */
+#ifndef OSAL_H
+#define OSAL_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "comdef.h"
+
+#define osal_mem_alloc(size)           malloc(size)
+#define osal_mem_free(ptr)             free(ptr)
+#define osal_memcpy(dst, src, len)     memcpy((dst), (src), (len))
+#define osal_memset(dst, val, len)     memset((dst), (val), (len))
+#define osal_rand()                    ((uint16)rand())
+
+uint32 osal_GetSystemClock(void);
+uint8 *osal_buffer_uint32(uint8 *buf, uint32 val);
+uint32 osal_build_uint32(uint8 *swapped, uint8 len);
+
+#endif
@@ -0,0 +1,7 @@
+/* Host build of Source/hal_ota.c for the tests. */
+#ifndef ONBOARD_H
+#define ONBOARD_H
+
+#define MicroWait(us)  ((void)(us))
+
+#endif
@@ -0,0 +1,17 @@
+/* Host build of Source/hal_ota.c for the tests. */
+#ifndef COMDEF_H
+#define COMDEF_H
+
+#include "hal_types.h"
+
+#define SUCCESS  0x00
+#define FAILURE  0x01
+
+#ifndef MAX
+#define MAX(n, m)  (((n) < (m)) ? (m) : (n))
+#endif
+#ifndef MIN
+#define MIN(n, m)  (((n) < (m)) ? (n) : (m))
+#endif
+
+#endif
@@ -0,0 +1,44 @@
+/* Host build of Source/hal_ota.c for the tests: the board settings hal_ota.c uses, with the
+ * CC2530 registers and the USART1 SPI to the external NV wired to the emulation in
+ * hal_ota_host.c.
+ */
+#ifndef HAL_BOARD_CFG_H
+#define HAL_BOARD_CFG_H
+
+#include "hal_types.h"
+
+#define HAL_CPU_CLOCK_MHZ          32
+
+#define HAL_FLASH_PAGE_PER_BANK    16
+#define HAL_FLASH_PAGE_SIZE        2048
+#define HAL_FLASH_WORD_SIZE        4
+#define HAL_NV_PAGE_CNT            6
+
+#define HAL_XNV_DMA_CH_TX          1
+#define HAL_XNV_DMA_CH_RX          2
+
+#ifndef HAL_DMA
+#define HAL_DMA TRUE
+#endif
+
+typedef uint8 halIntState_t;
+#define HAL_ENTER_CRITICAL_SECTION(x)  st( (x) = 0; )
+#define HAL_EXIT_CRITICAL_SECTION(x)   st( (void)(x); )
+
+#define HAL_BOARD_INIT()
+
+extern uint8 P1DIR, DMAARM, ADCCON1, RNDL, RNDH;
+extern uint8 X_U1DBUF;  // DMA source and destination of the SPI data, see hostDmaTrigger().
+
+void hostXnvSelect(uint8 sel);
+void hostXnvTx(uint8 ch);
+uint8 hostXnvRx(void);
+
+#define XNV_SPI_INIT()
+#define XNV_SPI_BEGIN()             hostXnvSelect(TRUE)
+#define XNV_SPI_TX(x)               hostXnvTx(x)
+#define XNV_SPI_RX()                hostXnvRx()
+#define XNV_SPI_WAIT_RXRDY()
+#define XNV_SPI_END()               hostXnvSelect(FALSE)
+
+#endif
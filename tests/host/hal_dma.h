@@ -0,0 +1,56 @@
+/* Host build of Source/hal_ota.c for the tests: the DMA channels hal_ota.c arms for SPI
+ * bursts run in hostDmaTrigger() when triggered.
+ */
+#ifndef HAL_DMA_H
+#define HAL_DMA_H
+
+#include "hal_types.h"
+
+typedef struct
+{
+  uint8 *src;
+  uint8 *dst;
+  uint16 len;
+  uint8 srcInc;
+  uint8 dstInc;
+} halDMADesc_t;
+
+extern halDMADesc_t dmaCh0;
+extern halDMADesc_t dmaCh1234[4];
+
+#define HAL_DMA_VLEN_USE_LEN     0
+#define HAL_DMA_WORDSIZE_BYTE    0
+#define HAL_DMA_TMODE_SINGLE     0
+#define HAL_DMA_TRIG_URX1        16
+#define HAL_DMA_SRCINC_0         0
+#define HAL_DMA_SRCINC_1         1
+#define HAL_DMA_DSTINC_0         0
+#define HAL_DMA_DSTINC_1         1
+#define HAL_DMA_IRQMASK_DISABLE  0
+#define HAL_DMA_M8_USE_8_BITS    0
+#define HAL_DMA_PRI_LOW          0
+#define HAL_DMA_PRI_HIGH         1
+
+#define HAL_DMA_SET_ADDR_DESC0(a)     ((void)(a))
+#define HAL_DMA_SET_ADDR_DESC1234(a)  ((void)(a))
+#define HAL_DMA_GET_DESC1234(a)       (dmaCh1234 + ((a) - 1))
+
+#define HAL_DMA_SET_SOURCE(ch, a)     ((ch)->src = (uint8 *)(a))
+#define HAL_DMA_SET_DEST(ch, a)       ((ch)->dst = (uint8 *)(a))
+#define HAL_DMA_SET_LEN(ch, a)        ((ch)->len = (a))
+#define HAL_DMA_SET_SRC_INC(ch, a)    ((ch)->srcInc = (a))
+#define HAL_DMA_SET_DST_INC(ch, a)    ((ch)->dstInc = (a))
+#define HAL_DMA_SET_VLEN(ch, a)       ((void)(ch))
+#define HAL_DMA_SET_WORD_SIZE(ch, a)  ((void)(ch))
+#define HAL_DMA_SET_TRIG_MODE(ch, a)  ((void)(ch))
+#define HAL_DMA_SET_TRIG_SRC(ch, a)   ((void)(ch))
+#define HAL_DMA_SET_IRQ(ch, a)        ((void)(ch))
+#define HAL_DMA_SET_M8(ch, a)         ((void)(ch))
+#define HAL_DMA_SET_PRIORITY(ch, a)   ((void)(ch))
+
+#define HAL_DMA_ARM_CH(ch)            (DMAARM |= BV(ch))
+#define HAL_DMA_MAN_TRIGGER(ch)       hostDmaTrigger(ch)
+
+void hostDmaTrigger(uint8 ch);
+
+#endif
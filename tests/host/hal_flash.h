@@ -0,0 +1,11 @@
+/* Host build of Source/hal_ota.c for the tests: the internal flash is emulated in hal_ota_host.c. */
+#ifndef HAL_FLASH_H
+#define HAL_FLASH_H
+
+#include "hal_types.h"
+
+void HalFlashRead(uint8 pg, uint16 offset, uint8 *buf, uint16 cnt);
+void HalFlashWrite(uint16 addr, uint8 *buf, uint16 cnt);
+void HalFlashErase(uint8 pg);
+
+#endif
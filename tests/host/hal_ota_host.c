@@ -0,0 +1,453 @@
+/******************************************************************************
+  Filename:       hal_ota_host.c
+
+  Description:    Source/hal_ota.c built with the host compiler for the tests in
+                  tests/, against an emulation of what it drives on the board:
+                  the internal flash behind HalFlashRead/Write/Erase(), and the
+                  SPI flash on USART1, command by command, including the DMA
+                  bursts. The SPI flash counts the protocol errors it sees, and
+                  any erase or program, internal or external, can be made the
+                  one during which the power fails.
+
+                  Build with -DHAL_OTA_BOOT_CODE=TRUE for the boot code, see
+                  tests/hal_ota_host.py.
+******************************************************************************/
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hal_types.h"
+#include "hal_dma.h"
+
+/******************************************************************************
+ * CC2530 REGISTERS
+ */
+uint8 P1DIR, DMAARM, ADCCON1, RNDL, RNDH;
+uint8 X_U1DBUF;
+
+#if !HAL_OTA_BOOT_CODE
+halDMADesc_t dmaCh0;
+halDMADesc_t dmaCh1234[4];
+#endif
+
+/******************************************************************************
+ * hal_ota.c, with the boot code's reset vector made callable
+ */
+#define main  hostBootMain
+#define asm(x)
+#include "hal_ota.c"
+#undef main
+#undef asm
+
+/******************************************************************************
+ * CONSTANTS
+ */
+#define HOST_FLASH_SIZE   0x40000      // CC2530F256
+#define HOST_XNV_MAX      0x100000     // Largest part emulated, the W25Q80.
+
+#define XNV_WRSR_WEL      0x02
+
+/******************************************************************************
+ * LOCAL VARIABLES
+ */
+static uint8 hostFlash[HOST_FLASH_SIZE];
+static uint8 hostXnv[HOST_XNV_MAX];
+static uint8 hostXnvId[3] = { 0xEF, 0x40, 0x12 };
+static uint32 hostXnvSize = 0x40000;
+
+// The SPI flash: the transaction in progress and the volatile state of the part.
+static uint8 xnvSel;
+static uint32 xnvCnt;        // Bytes clocked since the chip select went low.
+static uint8 xnvCmd;
+static uint32 xnvAddr;
+static uint8 xnvRx;
+static uint8 xnvWel;
+static uint8 xnvDown;
+static uint16 xnvWip;        // Status reads left until the erase or program completes.
+static uint8 xnvProg[256];   // Page program data, ANDed into the page at the chip select rising.
+
+static uint16 hostEraseMin = 1, hostEraseMax = 1;
+static uint32 hostErrors;    // SPI flash protocol errors and flash reads across a bank.
+static uint32 hostOps;       // Erases and programs since hostCutAt().
+static uint32 hostCut;       // The op that loses power, 0 for none.
+static uint32 hostRng = 1;
+static jmp_buf hostCutJmp;
+
+/******************************************************************************
+ * LOCAL FUNCTIONS
+ */
+static uint8 hostRand(void)
+{
+  hostRng = hostRng * 1103515245 + 12345;
+  return (uint8)(hostRng >> 16);
+}
+
+/* Count an erase or program and fail the power during the one set by hostCutAt(): a cut
+ * program leaves only some of its bits cleared and a cut erase only some of them set.
+ */
+static void hostOp(uint8 *pMem, uint8 *pData, uint32 len)
+{
+  uint32 i;
+
+  if (++hostOps == hostCut)
+  {
+    for (i = 0; i < len; i++)
+    {
+      pMem[i] = (pData) ? (pMem[i] & (pData[i] | hostRand())) : (pMem[i] | hostRand());
+    }
+    longjmp(hostCutJmp, 1);
+  }
+
+  for (i = 0; i < len; i++)
+  {
+    pMem[i] = (pData) ? (pMem[i] & pData[i]) : 0xFF;
+  }
+}
+
+static void xnvExecute(void)
+{
+  uint32 size = 0;
+
+  switch (xnvCmd)
+  {
+  case XNV_WREN_CMD:
+    xnvWel = TRUE;
+    return;
+  case XNV_DPD_CMD:
+    xnvDown = TRUE;
+    return;
+  case XNV_RDP_CMD:
+    xnvDown = FALSE;
+    return;
+  case XNV_WRPG_CMD:
+    if (xnvCnt <= 4)
+    {
+      return;
+    }
+    break;
+  case XNV_SE_CMD:
+    size = ERASE_SECTOR_SIZE;
+    break;
+  case XNV_BE32_CMD:
+    size = ERASE_BLOCK32_SIZE;
+    break;
+  case XNV_BE64_CMD:
+    size = ERASE_BLOCK64_SIZE;
+    break;
+  case XNV_BE_CMD:
+    size = hostXnvSize;
+    break;
+  default:
+    return;
+  }
+
+  if (!xnvWel || (size && (xnvCnt != ((xnvCmd == XNV_BE_CMD) ? 1 : 4))))
+  {
+    hostErrors++;
+    return;
+  }
+  xnvWel = FALSE;
+
+  if (size)
+  {
+    xnvAddr &= ~(size - 1);
+    xnvWip = hostEraseMin + hostRand() % (hostEraseMax - hostEraseMin + 1);
+    hostOp(hostXnv + xnvAddr, NULL, size);
+  }
+  else
+  {
+    uint32 page = xnvAddr & ~0xFFUL;
+
+    xnvWip = 1;
+    hostOp(hostXnv + page, xnvProg, 256);
+  }
+}
+
+/******************************************************************************
+ * SPI FLASH ON USART1
+ */
+void hostXnvSelect(uint8 sel)
+{
+  if (sel == xnvSel)
+  {
+    hostErrors++;
+  }
+  xnvSel = sel;
+
+  if (sel)
+  {
+    xnvCnt = 0;
+    xnvCmd = 0;
+  }
+  else if (xnvCnt)
+  {
+    xnvExecute();
+  }
+}
+
+void hostXnvTx(uint8 ch)
+{
+  uint32 pos = xnvCnt++;
+
+  xnvRx = 0xFF;
+
+  if (!xnvSel)
+  {
+    hostErrors++;
+    return;
+  }
+
+  if (pos == 0)
+  {
+    xnvCmd = ch;
+    xnvAddr = 0;
+
+    // Only the release from deep power-down is heard in it, only a status read while busy.
+    if ((xnvDown && (ch != XNV_RDP_CMD)) || (xnvWip && (ch != XNV_STAT_CMD)))
+    {
+      hostErrors++;
+      xnvCmd = 0;
+    }
+    if (ch == XNV_WRPG_CMD)
+    {
+      memset(xnvProg, 0xFF, sizeof(xnvProg));
+    }
+    return;
+  }
+
+  switch (xnvCmd)
+  {
+  case XNV_STAT_CMD:
+    xnvRx = ((xnvWip) ? XNV_STAT_WIP : 0) | ((xnvWel) ? XNV_WRSR_WEL : 0);
+    if (xnvWip)
+    {
+      xnvWip--;
+    }
+    break;
+
+  case XNV_RDID_CMD:
+    xnvRx = (pos <= 3) ? hostXnvId[pos - 1] : 0xFF;
+    break;
+
+  case 0x03:
+  case XNV_READ_CMD:
+  case XNV_WRPG_CMD:
+  case XNV_SE_CMD:
+  case XNV_BE32_CMD:
+  case XNV_BE64_CMD:
+    if (pos <= 3)
+    {
+      xnvAddr = ((xnvAddr << 8) | ch) & (hostXnvSize - 1);
+    }
+    else if (xnvCmd == XNV_WRPG_CMD)
+    {
+      xnvProg[(xnvAddr + pos - 4) & 0xFF] &= ch;
+    }
+    else if ((xnvCmd == 0x03) || (pos > 4))
+    {
+      xnvRx = hostXnv[xnvAddr];
+      xnvAddr = (xnvAddr + 1) & (hostXnvSize - 1);
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+uint8 hostXnvRx(void)
+{
+  return xnvRx;
+}
+
+/******************************************************************************
+ * DMA: the RX and TX channels of an SPI burst, see xnvSPIBurstStart().
+ */
+void hostDmaTrigger(uint8 ch)
+{
+  halDMADesc_t *pTx = HAL_DMA_GET_DESC1234(HAL_XNV_DMA_CH_TX);
+  halDMADesc_t *pRx = HAL_DMA_GET_DESC1234(HAL_XNV_DMA_CH_RX);
+  uint8 *pSrc = pTx->src;
+  uint8 *pDst = pRx->dst;
+  uint16 i;
+
+  if ((ch != HAL_XNV_DMA_CH_TX) || (DMAARM != (BV(HAL_XNV_DMA_CH_TX) | BV(HAL_XNV_DMA_CH_RX))) ||
+      (pTx->dst != &X_U1DBUF) || (pRx->src != &X_U1DBUF) || (pTx->len != pRx->len))
+  {
+    hostErrors++;
+  }
+
+  for (i = 0; i < pTx->len; i++)
+  {
+    hostXnvTx(*pSrc);
+    *pDst = hostXnvRx();
+    pSrc += pTx->srcInc;
+    pDst += pRx->dstInc;
+  }
+
+  DMAARM = 0;
+}
+
+/******************************************************************************
+ * INTERNAL FLASH
+ */
+void HalFlashRead(uint8 pg, uint16 offset, uint8 *buf, uint16 cnt)
+{
+  // A read goes through the 32 KB bank mapped at HAL_FLASH_PAGE_MAP, it cannot run past it.
+  if ((pg % HAL_FLASH_PAGE_PER_BANK) * HAL_FLASH_PAGE_SIZE + offset + cnt >
+      HAL_FLASH_PAGE_PER_BANK * HAL_FLASH_PAGE_SIZE)
+  {
+    hostErrors++;
+  }
+  else if ((uint32)pg * HAL_FLASH_PAGE_SIZE < HOST_FLASH_SIZE)
+  {
+    memcpy(buf, hostFlash + (uint32)pg * HAL_FLASH_PAGE_SIZE + offset, cnt);
+  }
+  else
+  {
+    hostErrors++;
+  }
+}
+
+void HalFlashWrite(uint16 addr, uint8 *buf, uint16 cnt)
+{
+  hostOp(hostFlash + (uint32)addr * HAL_FLASH_WORD_SIZE, buf, (uint32)cnt * HAL_FLASH_WORD_SIZE);
+}
+
+void HalFlashErase(uint8 pg)
+{
+  hostOp(hostFlash + (uint32)pg * HAL_FLASH_PAGE_SIZE, NULL, HAL_FLASH_PAGE_SIZE);
+}
+
+/******************************************************************************
+ * OSAL
+ */
+uint32 osal_GetSystemClock(void)
+{
+  return 0;
+}
+
+uint8 *osal_buffer_uint32(uint8 *buf, uint32 val)
+{
+  *buf++ = (uint8)val;
+  *buf++ = (uint8)(val >> 8);
+  *buf++ = (uint8)(val >> 16);
+  *buf++ = (uint8)(val >> 24);
+  return buf;
+}
+
+uint32 osal_build_uint32(uint8 *swapped, uint8 len)
+{
+  uint32 val = 0;
+
+  while (len--)
+  {
+    val = (val << 8) | swapped[len];
+  }
+  return val;
+}
+
+/******************************************************************************
+ * TEST ACCESS
+ */
+
+// The internal flash and the SPI flash contents, the JEDEC ID and the erase time in status reads.
+uint8 *hostFlashMem(void)
+{
+  return hostFlash;
+}
+
+uint8 *hostXnvMem(void)
+{
+  return hostXnv;
+}
+
+void hostXnvPart(uint8 manufacturer, uint8 type, uint8 capacity)
+{
+  hostXnvId[0] = manufacturer;
+  hostXnvId[1] = type;
+  hostXnvId[2] = capacity;
+  hostXnvSize = ((capacity >= 0x12) && (capacity <= 0x14)) ? (1UL << capacity) : 0x40000;
+}
+
+void hostXnvEraseTime(uint16 min, uint16 max, uint32 seed)
+{
+  hostEraseMin = min;
+  hostEraseMax = max;
+  hostRng = seed;
+}
+
+uint32 hostXnvErrors(void)
+{
+  return hostErrors;
+}
+
+/* A reset of the CC2530, losing the state of hal_ota.c. With power lost too the SPI flash
+ * comes up in standby with nothing in progress, otherwise it stays in deep power-down.
+ */
+void hostReset(uint8 powerLost)
+{
+  xnvChip = xnvChips;
+  xnvCapacity = HAL_OTA_DL_MAX;
+  xnvInited = FALSE;
+  xnvPowerDown = TRUE;
+  lastErased = 0xFFFFFFFF;
+  xnvBusy = FALSE;
+  xnvAheadFrom = xnvAheadNext = xnvAheadEnd = 0;
+#if HAL_OTA_XNV_PAGE_BUF
+  xnvPageLen = 0;
+#endif
+#if !HAL_OTA_BOOT_CODE
+  HalOTADeltaStop();
+  HalOTALz4Stop();
+#endif
+
+  xnvSel = FALSE;
+  xnvWel = FALSE;
+  if (powerLost)
+  {
+    xnvDown = FALSE;
+    xnvWip = 0;
+  }
+  DMAARM = 0;
+  hostErrors = 0;
+}
+
+// Fail the power during erase or program number cut from now on, 0 for never.
+void hostCutAt(uint32 cut)
+{
+  hostCut = cut;
+  hostOps = 0;
+}
+
+uint32 hostOpCount(void)
+{
+  return hostOps;
+}
+
+#if HAL_OTA_BOOT_CODE
+// Run the boot code from its reset vector: 1 if the power failed, 0 if it jumped to the image.
+uint8 hostBoot(void)
+{
+  if (setjmp(hostCutJmp))
+  {
+    return 1;
+  }
+  hostBootMain();
+  return 0;
+}
+
+// Run dl2rc() alone, with the part probed as main() does: 1 if the power failed.
+uint8 hostDl2rc(void)
+{
+  if (setjmp(hostCutJmp))
+  {
+    return 1;
+  }
+  xnvProbe();
+  dl2rc();
+  return 0;
+}
+#endif
@@ -0,0 +1,37 @@
+/* Host build of Source/hal_ota.c for the tests: the CC2530 types on a little-endian host. */
+#ifndef HAL_TYPES_H
+#define HAL_TYPES_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int8_t   int8;
+typedef uint8_t  uint8;
+typedef int16_t  int16;
+typedef uint16_t uint16;
+typedef int32_t  int32;
+typedef uint32_t uint32;
+
+typedef uint8 halDataAlign_t;
+
+#define CODE
+#define XDATA
+
+#ifndef TRUE
+#define TRUE   1
+#endif
+#ifndef FALSE
+#define FALSE  0
+#endif
+
+#define BV(n)  (1 << (n))
+#define st(x)  do { x } while (__LINE__ == -1)
+
+#define BUILD_UINT16(loByte, hiByte) ((uint16)(((loByte) & 0x00FF) + (((hiByte) & 0x00FF) << 8)))
+#define BUILD_UINT32(Byte0, Byte1, Byte2, Byte3) \
+  ((uint32)((uint32)((Byte0) & 0x00FF) + ((uint32)((Byte1) & 0x00FF) << 8) + \
+            ((uint32)((Byte2) & 0x00FF) << 16) + ((uint32)((Byte3) & 0x00FF) << 24)))
+#define HI_UINT16(a) (((a) >> 8) & 0xFF)
+#define LO_UINT16(a) ((a) & 0xFF)
+
+#endif
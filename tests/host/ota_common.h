@@ -0,0 +1,34 @@
+/* Host build of Source/hal_ota.c for the tests: the OTA file headers, packed as on the 8051. */
+#ifndef OTA_COMMON_H
+#define OTA_COMMON_H
+
+#include "hal_types.h"
+
+#define OTA_HEADER_STR_LEN       32
+#define OTA_SUB_ELEMENT_HDR_LEN  6
+
+typedef struct __attribute__((packed))
+{
+  uint32 magicNumber;
+  uint16 headerVersion;
+  uint16 headerLength;
+  uint16 fieldControl;
+  uint16 manufacturer;
+  uint16 type;
+  uint32 version;
+  uint16 stackVersion;
+  uint8 headerString[OTA_HEADER_STR_LEN];
+  uint32 imageSize;
+  uint8 secCredentialVer;
+  uint8 destIEEE[8];
+  uint16 minHwVer;
+  uint16 maxHwVer;
+} OTA_ImageHeader_t;
+
+typedef struct __attribute__((packed))
+{
+  uint16 tag;
+  uint32 length;
+} OTA_SubElementHdr_t;
+
+#endif
@@ -0,0 +1,91 @@
+"""Check the CRC16 tables of runPoly() in Source/hal_ota.c against the bit-serial 0x1021 CRC.
+
+crcTable (application) and crcNibble (boot code) are read out of hal_ota.c, compared with
+tables generated here, and runPoly() is run with each of them over random images against
+crc_1021() of ota_crc.py, the CRC OtaConverter stamps images with.
+
+    python -m unittest discover tests
+"""
+import os
+import random
+import re
+import sys
+import unittest
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+sys.path.insert(0, ROOT)
+
+from ota_crc import crc_1021  # noqa: E402
+
+HAL_OTA_C = os.path.join(ROOT, 'Source', 'hal_ota.c')
+
+
+def c_table(name):
+    """The initializer of a static const uint16 table in hal_ota.c."""
+    with open(HAL_OTA_C, encoding='latin-1') as f:
+        src = f.read()
+    m = re.search(r'\b%s\[\d+\]\s*=\s*\{([^}]*)\}' % name, src)
+    if not m:
+        raise AssertionError('%s not found in hal_ota.c' % name)
+    return [int(v, 16) for v in re.findall(r'0x[0-9A-Fa-f]+', m.group(1))]
+
+
+def feedback(h, bits):
+    """What the bit-serial 0x1021 register feeds back over `bits` shifts with h in its top bits."""
+    crc = h << (16 - bits)
+    for _ in range(bits):
+        crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+def run_poly_byte(table, crc, data):
+    """runPoly() of the application: a byte at a time."""
+    for val in data:
+        crc = (((crc << 8) | val) ^ table[crc >> 8]) & 0xFFFF
+    return crc
+
+
+def run_poly_nibble(table, crc, data):
+    """runPoly() of the boot code: a nibble at a time."""
+    for val in data:
+        crc = (((crc << 4) | (val >> 4)) ^ table[crc >> 12]) & 0xFFFF
+        crc = (((crc << 4) | (val & 0x0F)) ^ table[crc >> 12]) & 0xFFFF
+    return crc
+
+
+class CrcTableTest(unittest.TestCase):
+
+    def setUp(self):
+        self.rng = random.Random(0x1021)
+
+    def test_byte_table(self):
+        self.assertEqual(c_table('crcTable'), [feedback(h, 8) for h in range(256)])
+
+    def test_nibble_table(self):
+        self.assertEqual(c_table('crcNibble'), [feedback(h, 4) for h in range(16)])
+
+    def test_random_images(self):
+        byte_table = c_table('crcTable')
+        nibble_table = c_table('crcNibble')
+        for _ in range(500):
+            size = self.rng.choice([1, 2, 3, self.rng.randint(4, 300), self.rng.randint(300, 4096)])
+            image = bytes(self.rng.getrandbits(8) for _ in range(size))
+            expect = crc_1021(image)
+            self.assertEqual(run_poly_byte(byte_table, 0, image), expect)
+            self.assertEqual(run_poly_nibble(nibble_table, 0, image), expect)
+
+    def test_running_crc(self):
+        """HalOTACrcUpdate() carries the CRC across blocks of any length."""
+        table = c_table('crcTable')
+        image = bytes(self.rng.getrandbits(8) for _ in range(2000))
+        crc = 0
+        oset = 0
+        while oset < len(image):
+            cnt = self.rng.randint(1, 241)
+            crc = run_poly_byte(table, crc, image[oset:oset + cnt])
+            oset += cnt
+        self.assertEqual(crc, crc_1021(image))
+
+
+if __name__ == '__main__':
+    unittest.main()
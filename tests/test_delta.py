@@ -0,0 +1,180 @@
+"""Check the delta image ops against HalOTADeltaStart(), HalOTADeltaStep() and otaDeltaOp().
+
+Source/hal_ota.c is built for the host (see hal_ota_host.py) and rebuilds each patch from
+a running image in the emulated internal flash into the emulated SPI flash, stepped as
+zclOTA_DeltaStep() does, with slow sector erases so that the page buffer has to wait. It
+must rebuild what apply_patch() of ota_delta.py rebuilds from patches make_patch() makes,
+must fail the hand-made patches below that break the op format or its limits, and must
+never read a COPY across a flash bank or break the SPI flash protocol.
+
+    python -m unittest discover tests
+"""
+import os
+import random
+import struct
+import sys
+import unittest
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from hal_ota_host import (HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE, SUCCESS,  # noqa: E402
+                          HalOta)
+from ota_crc import CRC_OSET  # noqa: E402
+from ota_delta import (DELTA_MAGIC, OP_COPY, OP_END, OP_INSERT, OP_MAX_LEN,  # noqa: E402
+                       apply_patch, make_patch)
+
+HAL_FLASH_PAGE_SIZE = 2048
+HAL_FLASH_BANK_SIZE = 16 * HAL_FLASH_PAGE_SIZE
+HAL_OTA_RC_START = 0x0800
+ERASE_SECTOR_SIZE = 0x1000
+OTA_SUB_ELEMENT_HDR = struct.Struct('<HI')
+OTA_IMAGE_TAG_ID = 0x0000
+PATCH_OSET = 0x100  # Where the delta element payload sits in the OTA file.
+DELTA_HDR = struct.Struct('<HHI')  # halOtaDeltaHdr_t: magic, srcCrc, targetLen
+
+
+def patch(target_len, *ops, **kw):
+    return DELTA_HDR.pack(kw.get('magic', DELTA_MAGIC), kw.get('crc', 0x1234), target_len) + b''.join(ops)
+
+
+def copy(src, length):
+    return struct.pack('<BIH', OP_COPY, src, length)
+
+
+def insert(data):
+    return struct.pack('<BH', OP_INSERT, len(data)) + data
+
+
+END = struct.pack('<B', OP_END)
+
+
+class DeltaTest(unittest.TestCase):
+
+    def setUp(self):
+        self.rng = random.Random(0xDE17)
+        running = bytearray(self.rng.getrandbits(8) for _ in range(3 * HAL_FLASH_PAGE_SIZE + 100))
+        # Both CRCs checked, and the program size that bounds COPY sources.
+        struct.pack_into('<HHI', running, CRC_OSET, 0x1234, 0x1234, len(running))
+        self.running = bytes(running)
+
+    def rebuild(self, payload):
+        """Start and step to the end as zclOTA_DeltaStep() does: the image, or None on failure."""
+        dev = HalOta()
+        dev.flash[HAL_OTA_RC_START:HAL_OTA_RC_START + len(self.running)] = self.running
+        dev.xnv[PATCH_OSET:PATCH_OSET + len(payload)] = payload
+        out_oset = PATCH_OSET + len(payload)
+        # Stale bytes past the OTA file, so that the rebuild has to erase ahead of itself.
+        stale = -(-out_oset // ERASE_SECTOR_SIZE) * ERASE_SECTOR_SIZE
+        dev.xnv[stale:stale + 0x14000] = bytes(self.rng.getrandbits(8) for _ in range(0x14000))
+        dev.hostXnvEraseTime(1, 40, self.rng.getrandbits(32))
+        dev.HalOTAInit()
+        out = None
+        if dev.HalOTADeltaStart(PATCH_OSET, len(payload), out_oset) == SUCCESS:
+            status = HAL_OTA_BUILD_BUSY
+            while status == HAL_OTA_BUILD_BUSY:
+                status = dev.HalOTADeltaStep()
+            if status == HAL_OTA_BUILD_DONE:
+                dev.HalOTAFlush()
+                tag, length = OTA_SUB_ELEMENT_HDR.unpack_from(dev.xnv, out_oset)
+                self.assertEqual(tag, OTA_IMAGE_TAG_ID)
+                base = out_oset + OTA_SUB_ELEMENT_HDR.size
+                out = bytes(dev.xnv[base:base + length])
+        self.assertEqual(dev.errors(), 0, 'SPI flash protocol errors or flash reads across a bank')
+        return out
+
+    def assert_agrees(self, payload, expect):
+        self.assertEqual(self.rebuild(payload), expect)
+        self.assertEqual(apply_patch(payload, self.running), expect)
+
+    def assert_fails(self, payload):
+        self.assertIsNone(self.rebuild(payload))
+
+    def mutate(self):
+        """A new image: the running one with some runs changed, moved, grown and cut."""
+        new = bytearray(self.running)
+        for _ in range(self.rng.randint(1, 12)):
+            pos = self.rng.randrange(len(new))
+            run = bytes(self.rng.getrandbits(8) for _ in range(self.rng.randint(1, 300)))
+            kind = self.rng.randrange(3)
+            if kind == 0:
+                new[pos:pos + len(run)] = run
+            elif kind == 1:
+                new[pos:pos] = run
+            else:
+                del new[pos:pos + len(run)]
+        return bytes(new)
+
+    def test_make_patch_rebuilds(self):
+        for _ in range(60):
+            new = self.mutate()
+            block = self.rng.choice([4, 8, 16, 32])
+            payload = DELTA_HDR.pack(DELTA_MAGIC, 0x1234, len(new)) + make_patch(self.running, new, block)
+            self.assert_agrees(payload, new)
+
+    def test_long_ops(self):
+        """Ops of OP_MAX_LEN bytes split over many steps, and a literal run split into two ops."""
+        literal = bytes(self.rng.getrandbits(8) for _ in range(OP_MAX_LEN + 10))
+        new = self.running + literal
+        payload = DELTA_HDR.pack(DELTA_MAGIC, 0x1234, len(new)) + make_patch(self.running, new, 16)
+        self.assert_agrees(payload, new)
+        self.assert_agrees(patch(OP_MAX_LEN, insert(literal[:OP_MAX_LEN]), END), literal[:OP_MAX_LEN])
+
+    def test_copy_across_pages(self):
+        src = 2 * HAL_FLASH_PAGE_SIZE - HAL_OTA_RC_START - 3
+        self.assert_agrees(patch(2 * HAL_FLASH_PAGE_SIZE, copy(src, 2 * HAL_FLASH_PAGE_SIZE), END),
+                           self.running[src:src + 2 * HAL_FLASH_PAGE_SIZE])
+
+    def test_copy_across_banks(self):
+        running = bytearray(self.rng.randbytes(HAL_FLASH_BANK_SIZE))
+        struct.pack_into('<HHI', running, CRC_OSET, 0x1234, 0x1234, len(running))
+        self.running = bytes(running)
+        src = HAL_FLASH_BANK_SIZE - HAL_OTA_RC_START - 3
+        self.assert_agrees(patch(100, copy(src, 100), END), self.running[src:src + 100])
+
+    def test_empty_ops(self):
+        data = b'\x5a\xa5'
+        self.assert_agrees(patch(2, copy(0, 0), insert(b''), insert(data), copy(len(self.running), 0), END),
+                           data)
+        # otaBuildFits() refuses an empty image, as it does an empty LZ4 element.
+        self.assertEqual(apply_patch(patch(0, END), self.running), b'')
+        self.assert_fails(patch(0, END))
+
+    def test_bytes_after_end_ignored(self):
+        self.assert_agrees(patch(3, insert(b'abc'), END, b'\x07garbage'), b'abc')
+
+    def test_copy_end_of_running_image(self):
+        size = len(self.running)
+        self.assert_agrees(patch(10, copy(size - 10, 10), END), self.running[-10:])
+        self.assert_fails(patch(10, copy(size - 9, 10), END))
+        self.assert_fails(patch(1, copy(size + 1, 0), insert(b'x'), END))
+        self.assert_fails(patch(1, copy(0xFFFFFFFF, 1), END))
+
+    def test_op_past_target(self):
+        self.assert_fails(patch(4, insert(b'abcde'), END))
+        self.assert_fails(patch(4, insert(b'ab'), copy(0, 3), END))
+        self.assert_fails(patch(0x10000, insert(b'a' * 10), copy(0, 0xFFFF), END))
+
+    def test_end_short_of_target(self):
+        self.assert_fails(patch(4, insert(b'abc'), END))
+        self.assert_fails(patch(1, END))
+
+    def test_truncated(self):
+        whole = patch(8, insert(b'abcd'), copy(16, 4), END)
+        self.assertEqual(self.rebuild(whole), b'abcd' + self.running[16:20])
+        for cut in range(DELTA_HDR.size, len(whole)):
+            self.assert_fails(whole[:cut])
+
+    def test_bad_op(self):
+        for op in (0x03, 0x7F, 0xFF):
+            self.assert_fails(patch(1, insert(b'a'), struct.pack('<B', op), END))
+
+    def test_bad_header(self):
+        self.assert_fails(patch(1, insert(b'a'), END, magic=DELTA_MAGIC ^ 1))
+        self.assert_fails(patch(1, insert(b'a'), END, crc=0x4321))
+        self.assert_fails(patch(0)[:DELTA_HDR.size - 1])
+
+
+if __name__ == '__main__':
+    unittest.main()
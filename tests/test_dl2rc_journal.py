@@ -0,0 +1,267 @@
+"""Power-cut runs of the boot code's dl2rc() progress journal (Source/hal_ota.c).
+
+The boot code build of hal_ota.c runs against the emulated internal flash and SPI flash
+of tests/host, which can lose power in the middle of any erase or program. A cut program
+leaves only some of its bits cleared and a cut erase only some of them set, as NOR flash
+does. After every cut the copy is run again from the top, as the boot code does on the
+next reset, and must end with the RC image equal to the DL image.
+
+    python -m unittest discover tests
+"""
+import os
+import random
+import struct
+import sys
+import unittest
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from hal_ota_host import HalOta  # noqa: E402
+from ota_crc import CRC_OSET, crc_1021  # noqa: E402
+
+HAL_FLASH_PAGE_SIZE = 2048
+HAL_FLASH_WORD_SIZE = 4
+HAL_OTA_RC_START = 0x0800
+HAL_OTA_BOOT_STATUS_NONE = 0xFFFF
+SECTOR_SIZE = 0x1000
+
+OTA_HDR_LEN = 56           # OTA_ImageHeader_t
+OTA_SUB_ELEMENT_HDR_LEN = 6
+
+# Offsets into the boot status sector, the last sector of the part.
+XNV_JOURNAL_OSET = 0x100
+XNV_JOURNAL_MAGIC = 0x10C9
+XNV_JOURNAL_HDR = struct.Struct('<HH')      # xnvJournalHdr_t: magic, dlCrc
+HAL_OTA_BOOT_STATUS_MAGIC = 0xB057
+BOOT_STATUS = struct.Struct('<HBB')         # halOtaBootStatus_t: magic, written, skipped
+XNV_JOURNAL_MAX = (0x40000 - (6 + 2) * HAL_FLASH_PAGE_SIZE) // HAL_FLASH_PAGE_SIZE
+
+W25Q80 = (0xEF, 0x40, 0x14)
+
+
+def dl_pages(image):
+    """The DL image as dl2rc() reads it: pages, the last padded to a word with 0xFF."""
+    pages = []
+    for oset in range(0, len(image), HAL_FLASH_PAGE_SIZE):
+        page = bytearray(image[oset:oset + HAL_FLASH_PAGE_SIZE])
+        while len(page) % HAL_FLASH_WORD_SIZE:
+            page.append(0xFF)
+        pages.append(bytes(page))
+    return pages
+
+
+def ota_file(program):
+    """An OTA file holding the program image as its one upgrade image element."""
+    hdr = bytearray(b'\x00' * OTA_HDR_LEN)
+    struct.pack_into('<IHH', hdr, 0, 0x0BEEF11E, 0x0100, OTA_HDR_LEN)
+    return bytes(hdr) + struct.pack('<HI', 0x0000, len(program)) + program
+
+
+def stamp(program):
+    """The CRC control block as OtaConverter fills it in: the CRC, an erased shadow, the size."""
+    program = bytearray(program)
+    struct.pack_into('<HHI', program, CRC_OSET, 0, 0xFFFF, len(program))
+    crc = crc_1021(program[:CRC_OSET] + program[CRC_OSET + 4:])
+    struct.pack_into('<H', program, CRC_OSET, crc)
+    return bytes(program), crc
+
+
+class Dl2rcJournalTest(unittest.TestCase):
+
+    FIRST = HAL_OTA_RC_START // HAL_FLASH_PAGE_SIZE
+
+    def setUp(self):
+        self.rng = random.Random(0x10C9)
+        # Five pages, the last a partial one. Pages 1 and 3 did not change between releases.
+        image = bytearray(self.rng.getrandbits(8) for _ in range(4 * HAL_FLASH_PAGE_SIZE + 1030))
+        struct.pack_into('<HHI', image, CRC_OSET, 0x5A3C, 0xFFFF, len(image))
+        self.image = bytes(image)
+        self.dl_crc = 0x5A3C
+        old = bytearray(self.rng.getrandbits(8) for _ in range(len(self.image)))
+        for pg in (1, 3):
+            sl = slice(pg * HAL_FLASH_PAGE_SIZE, (pg + 1) * HAL_FLASH_PAGE_SIZE)
+            old[sl] = self.image[sl]
+        self.old = bytes(old)
+        self.part = None
+
+    def device(self, part=None):
+        dev = HalOta(boot=True)
+        self.part = part
+        if part:
+            dev.hostXnvPart(*part)
+        rc = HAL_OTA_RC_START
+        dev.flash[rc:rc + len(self.old)] = self.old
+        dl = ota_file(self.image)
+        dev.xnv[:len(dl)] = dl
+        return dev
+
+    def status_addr(self):
+        return (1 << (self.part or (0, 0, 0x12))[2]) - SECTOR_SIZE
+
+    def rc_page(self, dev, n, length=HAL_FLASH_PAGE_SIZE):
+        oset = (self.FIRST + n) * HAL_FLASH_PAGE_SIZE
+        return bytes(dev.flash[oset:oset + length])
+
+    def journal_done(self, dev, dl_crc=None):
+        """The pages journaled as done, as xnvJournalOpen() counts them, None if no journal."""
+        addr = self.status_addr() + XNV_JOURNAL_OSET
+        magic, crc = XNV_JOURNAL_HDR.unpack(bytes(dev.xnv[addr:addr + XNV_JOURNAL_HDR.size]))
+        if (magic, crc) != (XNV_JOURNAL_MAGIC, self.dl_crc if dl_crc is None else dl_crc):
+            return None
+        addr += XNV_JOURNAL_HDR.size
+        entry = bytes(dev.xnv[addr:addr + XNV_JOURNAL_MAX])
+        done = 0
+        while done < XNV_JOURNAL_MAX and entry[done] == (self.FIRST + done) & 0xFF:
+            done += 1
+        return done
+
+    def boot_status(self, dev):
+        addr = self.status_addr()
+        return BOOT_STATUS.unpack(bytes(dev.xnv[addr:addr + BOOT_STATUS.size]))
+
+    def dl2rc(self, dev):
+        """dl2rc() after a reset that lost the power: True if the power failed again."""
+        dev.hostReset(True)
+        cut = dev.hostDl2rc()
+        self.assertEqual(dev.errors(), 0, 'SPI flash protocol errors')
+        return bool(cut)
+
+    def assert_journal_sound(self, dev):
+        """Every page the journal counts as done holds its DL page: resuming relies on it."""
+        pages = dl_pages(self.image)
+        for n in range(self.journal_done(dev) or 0):
+            self.assertEqual(self.rc_page(dev, n, len(pages[n])), pages[n],
+                             'page %d journaled before it was programmed' % n)
+
+    def assert_copied(self, dev):
+        for n, page in enumerate(dl_pages(self.image)):
+            self.assertEqual(self.rc_page(dev, n, len(page)), page, 'page %d' % n)
+        self.assertEqual(self.boot_status(dev)[0], HAL_OTA_BOOT_STATUS_MAGIC)
+        self.assertIsNone(self.journal_done(dev), 'journal left behind')
+
+    def run_to_end(self, dev, cuts):
+        """Boot with a power cut at each op count in cuts in turn, then boot once without one."""
+        for cut in cuts:
+            dev.hostCutAt(cut)
+            if self.dl2rc(dev):
+                self.assert_journal_sound(dev)
+        dev.hostCutAt(0)
+        self.assertFalse(self.dl2rc(dev))
+        self.assert_copied(dev)
+
+    def ops_per_copy(self):
+        dev = self.device()
+        dev.hostCutAt(0)
+        self.dl2rc(dev)
+        return dev.hostOpCount()
+
+    def test_uninterrupted(self):
+        dev = self.device()
+        self.assertFalse(self.dl2rc(dev))
+        self.assert_copied(dev)
+        self.assertEqual(self.boot_status(dev)[1:], (3, 2))
+
+    def test_cut_at_every_op(self):
+        for cut in range(1, self.ops_per_copy() + 1):
+            self.run_to_end(self.device(), [cut])
+
+    def test_cut_twice(self):
+        ops = self.ops_per_copy()
+        for first in range(1, ops + 1):
+            for second in range(1, ops + 1):
+                self.run_to_end(self.device(), [first, second])
+
+    def test_cut_repeatedly(self):
+        ops = self.ops_per_copy()
+        for _ in range(200):
+            cuts = [self.rng.randint(1, ops) for _ in range(self.rng.randint(3, 8))]
+            self.run_to_end(self.device(), cuts)
+
+    def test_resume_redoes_last_journaled_page(self):
+        """Resuming starts at done - 1, which is not journaled a second time (n >= done)."""
+        dev = self.device()
+        # Cut the first program of page 2: pages 0 and 1 are journaled.
+        dev.hostCutAt(2 + 3 + 1 + 2)
+        self.assertTrue(self.dl2rc(dev))
+        self.assertEqual(self.journal_done(dev), 2)
+        addr = self.status_addr() + XNV_JOURNAL_OSET + XNV_JOURNAL_HDR.size
+        self.assertEqual(bytes(dev.xnv[addr:addr + 3]), bytes([self.FIRST, self.FIRST + 1, 0xFF]))
+        self.run_to_end(dev, [])
+
+    def test_other_image_journal_restarts(self):
+        """A journal left by another DL image is erased, and the copy starts from page 0."""
+        dev = self.device()
+        addr = self.status_addr() + XNV_JOURNAL_OSET
+        dev.xnv[addr:addr + 4] = XNV_JOURNAL_HDR.pack(XNV_JOURNAL_MAGIC, self.dl_crc ^ 1)
+        dev.xnv[addr + 4:addr + 9] = bytes(range(self.FIRST, self.FIRST + 5))
+        self.run_to_end(dev, [])
+
+    def test_larger_part(self):
+        """On the W25Q80 the journal and the boot status go in its last sector, not at 256 KB."""
+        dev = self.device(W25Q80)
+        self.run_to_end(dev, [])
+        self.assertEqual(self.boot_status(dev)[1:], (3, 2))
+        self.assertEqual(bytes(dev.xnv[0x3F000:0x40000]), b'\xff' * SECTOR_SIZE)
+        self.run_to_end(self.device(W25Q80), [2 + 3 + 1 + 2, 5])
+
+    def test_boot(self):
+        """main() with the RC image invalidated copies the DL image and validates its CRC shadow."""
+        program, crc = stamp(self.image)
+        self.image = program
+        self.dl_crc = crc
+        dev = self.device()
+        struct.pack_into('<HH', dev.flash, HAL_OTA_RC_START + CRC_OSET, 0, 0xFFFF)  # HalOTAInvRC()
+        dev.hostCutAt(0)
+        self.assertEqual(dev.hostBoot(), 0)
+        ops = dev.hostOpCount()
+
+        for cut in range(1, ops + 1):
+            dev = self.device()
+            struct.pack_into('<HH', dev.flash, HAL_OTA_RC_START + CRC_OSET, 0, 0xFFFF)
+            dev.hostCutAt(cut)
+            dev.hostReset(True)
+            self.assertEqual(dev.hostBoot(), 1)
+            dev.hostCutAt(0)
+            dev.hostReset(True)
+            self.assertEqual(dev.hostBoot(), 0)
+            self.assertEqual(dev.errors(), 0)
+
+            expect = bytearray(self.image)
+            struct.pack_into('<H', expect, CRC_OSET + 2, crc)
+            rc = bytes(dev.flash[HAL_OTA_RC_START:HAL_OTA_RC_START + len(expect)])
+            self.assertEqual(rc, bytes(expect), 'cut at op %d' % cut)
+
+        # With the shadow valid the next reset goes straight to the image.
+        dev.hostCutAt(0)
+        dev.hostReset(False)
+        self.assertEqual(dev.hostBoot(), 0)
+        self.assertEqual(dev.hostOpCount(), 0)
+
+
+class BootStatusSectorTest(unittest.TestCase):
+    """The application finds the boot status where the boot code left it, by the JEDEC ID."""
+
+    def avail(self, part):
+        dev = HalOta()
+        dev.hostXnvPart(*part)
+        dev.HalOTAInit()
+        return dev, dev.HalOTAAvail()
+
+    def test_avail(self):
+        self.assertEqual(self.avail((0x20, 0x80, 0x12))[1], 0x40000 - SECTOR_SIZE)   # M25PE20
+        self.assertEqual(self.avail(W25Q80)[1], 0x100000 - SECTOR_SIZE)
+        self.assertEqual(self.avail((0xC2, 0x20, 0x13))[1], 0x80000 - SECTOR_SIZE)   # Not in the table.
+        self.assertEqual(self.avail((0xFF, 0xFF, 0xFF))[1], 0x40000 - SECTOR_SIZE)   # No part.
+
+    def test_boot_status(self):
+        dev, _ = self.avail(W25Q80)
+        self.assertEqual(dev.HalOTABootStatus(), HAL_OTA_BOOT_STATUS_NONE)
+        dev.xnv[0xFF000:0xFF004] = BOOT_STATUS.pack(HAL_OTA_BOOT_STATUS_MAGIC, 3, 2)
+        self.assertEqual(dev.HalOTABootStatus(), 0x0302)
+        self.assertEqual(dev.errors(), 0)
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,235 @@
+"""Check compressed image elements against HalOTALz4Feed() and HalOTALz4Resume().
+
+Source/hal_ota.c is built for the host (see hal_ota_host.py) and expands each element
+into the emulated SPI flash, fed a block at a time and resumed while it waits as
+zclOTA_Lz4Step() does. Each element also goes through with slow sector erases over stale
+bytes, so that matches yield on flash stalls as well as after OTA_LZ4_STEP_LEN bytes. It
+must expand what ota_lz4.py compresses and what its decompress() expands, however the
+element is split into blocks, and must fail the hand-made blocks below that break the
+format or do not fit.
+
+    python -m unittest discover tests
+"""
+import ctypes
+import os
+import random
+import struct
+import sys
+import unittest
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+sys.path.insert(0, ROOT)
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+from hal_ota_host import (HAL_OTA_BUILD_BUSY, HAL_OTA_BUILD_DONE,  # noqa: E402
+                          HAL_OTA_BUILD_FAIL, HAL_OTA_BUILD_WAIT, HalOta)
+from ota_lz4 import MIN_MATCH, compress, decompress  # noqa: E402
+
+ERASE_SECTOR_SIZE = 0x1000
+OTA_SUB_ELEMENT_HDR = struct.Struct('<HI')
+OTA_IMAGE_TAG_ID = 0x0000
+HAL_OTA_DL_SIZE = 0x40000 - (6 + 2) * 2048  # HAL_NV_PAGE_CNT + HAL_OTA_BOOT_PG_CNT pages.
+ELEMENT_OSET = 0x1234      # DL image offset of the expanded element, past the OTA file.
+STALE_LEN = 0x3000
+
+
+def length_bytes(n):
+    """The 255-run extension of a length field past its nibble of 15."""
+    return b'\xff' * (n // 255) + bytes([n % 255])
+
+
+def sequence(literals, offset=0, match=0):
+    """One LZ4 sequence, built independently of ota_lz4.py."""
+    lit = len(literals)
+    ml = match - MIN_MATCH
+    out = bytes([(min(lit, 15) << 4) | (min(ml, 15) if offset else 0)])
+    if lit >= 15:
+        out += length_bytes(lit - 15)
+    out += literals
+    if offset:
+        out += struct.pack('<H', offset)
+        if ml >= 15:
+            out += length_bytes(ml - 15)
+    return out
+
+
+def element(raw_len, block):
+    return struct.pack('<I', raw_len) + block
+
+
+# Checked-in vectors: 300 bytes of 0xFF as one literal and an offset 1 match of 295 + 4
+# bytes, then five literals; and "abc" repeated at offset 3.
+VECTORS = [
+    (bytes.fromhex('31010000' '1f' 'ff' '0100' 'ff19' '50' '3031323334'),
+     b'\xff' * 300 + b'01234'),
+    (bytes.fromhex('11000000' '3a' '616263' '0300'),
+     b'abc' * 5 + b'ab'),
+]
+
+
+class Lz4Test(unittest.TestCase):
+
+    def setUp(self):
+        self.rng = random.Random(0x4C5A)
+        self.stale = bytes(self.rng.getrandbits(8) for _ in range(STALE_LEN))
+
+    def splits(self, elem):
+        """The element in one block, split at each boundary, and in blocks of random length."""
+        yield [elem]
+        for cut in range(1, len(elem)):
+            yield [elem[:cut], elem[cut:]]
+        for _ in range(4):
+            blocks = []
+            pos = 0
+            while pos < len(elem):
+                cnt = self.rng.choice([1, 2, 3, self.rng.randint(4, 64), self.rng.randint(64, 241)])
+                blocks.append(elem[pos:pos + cnt])
+                pos += cnt
+            yield blocks
+
+    def device(self, slow):
+        dev = HalOta()
+        stale = -(-ELEMENT_OSET // ERASE_SECTOR_SIZE) * ERASE_SECTOR_SIZE
+        dev.xnv[stale:stale + STALE_LEN] = self.stale
+        if slow:
+            dev.hostXnvEraseTime(1, 60, self.rng.getrandbits(32))
+        dev.HalOTAInit()
+        dev.HalOTALz4Start()
+        return dev
+
+    def feed(self, dev, oset, block):
+        buf = (ctypes.c_uint8 * len(block)).from_buffer_copy(block)
+        return dev.HalOTALz4Feed(buf, len(block), ctypes.byref(oset))
+
+    def expand(self, blocks, slow=False, oset=ELEMENT_OSET):
+        """Feed the blocks in turn as zclOTA_Lz4Step() does: the image, or None on failure."""
+        dev = self.device(slow)
+        pos = ctypes.c_uint32(oset)
+        status = HAL_OTA_BUILD_BUSY
+        for block in blocks:
+            status = self.feed(dev, pos, block)
+            while status == HAL_OTA_BUILD_WAIT:
+                status = dev.HalOTALz4Resume(ctypes.byref(pos))
+            if status == HAL_OTA_BUILD_FAIL:
+                break
+        self.assertEqual(dev.errors(), 0, 'SPI flash protocol errors or flash reads across a bank')
+        if status != HAL_OTA_BUILD_DONE:
+            return None
+        dev.HalOTAFlush()
+        tag, length = OTA_SUB_ELEMENT_HDR.unpack_from(dev.xnv, oset)
+        self.assertEqual(tag, OTA_IMAGE_TAG_ID)
+        self.assertEqual(length, pos.value - oset - OTA_SUB_ELEMENT_HDR.size)
+        return bytes(dev.xnv[oset + OTA_SUB_ELEMENT_HDR.size:pos.value])
+
+    def assert_expands(self, elem, raw, every_split=True):
+        raw_len = struct.unpack_from('<I', elem, 0)[0]
+        self.assertEqual(decompress(elem[4:], raw_len), raw)
+        for blocks in (self.splits(elem) if every_split else [[elem]]):
+            self.assertEqual(self.expand(blocks), raw)
+            self.assertEqual(self.expand(blocks, slow=True), raw)
+
+    def assert_fails(self, elem):
+        for blocks in self.splits(elem):
+            self.assertIsNone(self.expand(blocks))
+
+    def test_vectors(self):
+        for elem, raw in VECTORS:
+            self.assert_expands(elem, raw)
+
+    def test_short_offsets(self):
+        """Offsets 1 to 3, and around OTA_LZ4_BUF_LEN, where the period buffer ends."""
+        for offset in (1, 2, 3, 5, 16, 31, 32, 33, 64):
+            head = bytes(self.rng.getrandbits(8) for _ in range(offset))
+            for match in (MIN_MATCH, 31, 32, 33, 97, 700):
+                raw = head + bytes(head[i % offset] for i in range(match)) + b'tail!'
+                elem = element(len(raw), sequence(head, offset, match) + sequence(b'tail!'))
+                self.assert_expands(elem, raw, every_split=match < 100)
+
+    def test_length_extensions(self):
+        """Literal and match lengths at each edge of the nibble and the 255-run extension."""
+        for n in (14, 15, 16, 269, 270, 271, 524, 525, 526):
+            lit = bytes(self.rng.getrandbits(8) for _ in range(n))
+            self.assert_expands(element(n, sequence(lit)), lit, every_split=n < 20)
+            match = n + MIN_MATCH
+            raw = b'xyzw' + b'xyzw' * (match // 4) + b'xyzw'[:match % 4] + b'end'
+            elem = element(len(raw), sequence(b'xyzw', 4, match) + sequence(b'end'))
+            self.assert_expands(elem, raw, every_split=n < 300)
+
+    def test_ends_with_match(self):
+        raw = b'ab' * 20
+        self.assert_expands(element(len(raw), sequence(b'ab', 2, 38)), raw)
+
+    def test_round_trip(self):
+        """Images of code-like bytes, padding and short periods through compress()."""
+        for _ in range(40):
+            raw = bytearray()
+            while len(raw) < self.rng.randint(1, 6000):
+                kind = self.rng.randrange(4)
+                n = self.rng.randint(1, 400)
+                if kind == 0:
+                    raw += bytes(self.rng.getrandbits(8) for _ in range(n))
+                elif kind == 1:
+                    raw += b'\xff' * n
+                elif kind == 2:
+                    period = bytes(self.rng.getrandbits(8) for _ in range(self.rng.randint(1, 40)))
+                    raw += (period * (n // len(period) + 1))[:n]
+                elif raw:
+                    src = self.rng.randrange(len(raw))
+                    raw += raw[src:src + n]
+            raw = bytes(raw)
+            self.assert_expands(element(len(raw), compress(raw)), raw, every_split=False)
+
+    def test_bad_match_offset(self):
+        self.assert_fails(element(8, b'\x40abcd\x00\x00'))
+        self.assert_fails(element(9, sequence(b'abcd', 5, 5)))
+        self.assert_fails(element(8, sequence(b'', 1, 8)))
+
+    def test_past_program_length(self):
+        self.assert_fails(element(9, sequence(b'abcd', 1, 6)))
+        self.assert_fails(element(3, sequence(b'abcd')))
+        self.assert_fails(element(300, sequence(b'a' * 200, 1, 255) + sequence(b'end')))
+
+    def test_bytes_after_done(self):
+        elem = element(4, sequence(b'abcd'))
+        self.assert_expands(elem, b'abcd')
+        self.assert_fails(elem + b'\x00')
+        self.assert_fails(element(8, sequence(b'abcd', 4, 4)) + b'\x40abcd')
+
+    def test_truncated(self):
+        elem = element(24, sequence(b'abcd', 4, 16) + sequence(b'1234'))
+        self.assert_expands(elem, b'abcd' * 5 + b'1234')
+        for cut in range(len(elem)):
+            self.assertIsNone(self.expand([elem[:cut]]))
+
+    def test_empty_or_oversized_image(self):
+        """otaBuildFits(): no empty image, none past HAL_OTA_DL_SIZE or HalOTAAvail()."""
+        self.assert_fails(element(0, b''))
+        self.assert_fails(element(HAL_OTA_DL_SIZE + 1, sequence(b'a', 1, 1000)))
+        dev = self.device(False)
+        avail = dev.HalOTAAvail()
+        for raw_len, oset, status in ((HAL_OTA_DL_SIZE, ELEMENT_OSET, HAL_OTA_BUILD_BUSY),
+                                      (HAL_OTA_DL_SIZE + 1, ELEMENT_OSET, HAL_OTA_BUILD_FAIL),
+                                      (100, avail - OTA_SUB_ELEMENT_HDR.size - 100, HAL_OTA_BUILD_BUSY),
+                                      (101, avail - OTA_SUB_ELEMENT_HDR.size - 100, HAL_OTA_BUILD_FAIL)):
+            dev = self.device(False)
+            self.assertEqual(self.feed(dev, ctypes.c_uint32(oset), struct.pack('<I', raw_len)), status)
+        self.assertEqual(self.expand([element(4, sequence(b'abcd'))], oset=avail - 10),
+                         b'abcd')
+
+    def test_feed_while_waiting(self):
+        """A block fed before the match that yielded has finished is refused."""
+        dev = self.device(False)
+        oset = ctypes.c_uint32(ELEMENT_OSET)
+        elem = element(2000, sequence(b'a', 1, 1999))
+        self.assertEqual(self.feed(dev, oset, elem[:-1]), HAL_OTA_BUILD_BUSY)
+        self.assertEqual(self.feed(dev, oset, elem[-1:]), HAL_OTA_BUILD_WAIT)
+        self.assertEqual(self.feed(dev, oset, b'\x00'), HAL_OTA_BUILD_FAIL)
+        status = HAL_OTA_BUILD_WAIT
+        while status == HAL_OTA_BUILD_WAIT:
+            status = dev.HalOTALz4Resume(ctypes.byref(oset))
+        self.assertEqual(status, HAL_OTA_BUILD_DONE)
+        self.assertEqual(oset.value - ELEMENT_OSET - OTA_SUB_ELEMENT_HDR.size, 2000)
+        self.assertEqual(dev.errors(), 0)
+
+if __name__ == '__main__':
+    unittest.main()
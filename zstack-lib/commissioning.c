@@ -11,6 +11,7 @@
 static void zclCommissioning_ProcessCommissioningStatus(bdbCommissioningModeMsg_t *bdbCommissioningModeMsg);
 static void zclCommissioning_ResetBackoffRetry(void);
 static void zclCommissioning_BindNotification(bdbBindNotificationData_t *data);
+static uint8 zclCommissioning_PollRateFree(void);
 extern bool requestNewTrustCenterLinkKey;
 
 byte rejoinsLeft = APP_COMMISSIONING_END_DEVICE_REJOIN_TRIES;
@@ -115,9 +116,21 @@ static void zclCommissioning_ProcessIncomingMsg(zclIncomingMsg_t *pInMsg) {
     }
 }
 
+static uint8 zclCommissioning_PollRateFree(void) {
+#if defined(OTA_CLIENT) && (OTA_CLIENT == TRUE)
+    // The OTA client sets the poll rate itself while a download is in progress
+    return zclOTA_ImageUpgradeStatus != OTA_STATUS_IN_PROGRESS;
+#else
+    return TRUE;
+#endif
+}
+
 void zclCommissioning_Sleep(uint8 allow) {
     LREP("zclCommissioning_Sleep %d\r\n", allow);
 #if defined(POWER_SAVING)
+    if (!zclCommissioning_PollRateFree()) {
+        return;
+    }
     if (allow) {
         NLME_SetPollRate(0);
     } else {
@@ -169,12 +182,6 @@ uint16 zclCommissioning_event_loop(uint8 task_id, uint16 events) {
 
     if (events & APP_COMMISSIONING_CLOCK_DOWN_POLING_RATE_EVT) {
         LREPMaster("APP_CLOCK_DOWN_POLING_RATE_EVT\r\n");
-#if defined (OTA_CLIENT) && (OTA_CLIENT == TRUE)        
-        if ( zclOTA_ImageUpgradeStatus == OTA_STATUS_IN_PROGRESS )
-        {
-           NLME_SetPollRate(DEVICE_POLL_RATE_DL);
-        }
-#endif
         zclCommissioning_Sleep(true);
         return (events ^ APP_COMMISSIONING_CLOCK_DOWN_POLING_RATE_EVT);
     }
@@ -208,6 +215,8 @@ void zclCommissioning_HandleKeys(uint8 portAndAction, uint8 keyCode) {
 #endif
     }
     #if defined(POWER_SAVING)
-        NLME_SetPollRate(1);
+        if (zclCommissioning_PollRateFree()) {
+            NLME_SetPollRate(1);
+        }
     #endif
 }
\ No newline at end of file